@@ -0,0 +1,162 @@
+#include "BamReader.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static const uint16_t BAM_FPAIRED = 0x1;
+static const uint16_t BAM_FREVERSE = 0x10;
+static const uint16_t BAM_FREAD1 = 0x40;
+static const uint16_t BAM_FSECONDARY = 0x100;
+static const uint16_t BAM_FSUPPLEMENTARY = 0x800;
+
+static const char NT16[] = "=ACMGRSVTWYHKDBN";
+static const char NT16_COMP[] = "=TGKCYSBAWRDMHVN";
+
+static int32_t get32(const char* p) {
+  int32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static uint16_t get16(const char* p) {
+  uint16_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+bool isBamFile(const std::string& fname) {
+  return fname.size() > 4 && fname.compare(fname.size() - 4, 4, ".bam") == 0;
+}
+
+bool BamReader::open(const std::string& fname, int n_threads) {
+  fname_ = fname;
+  waiting_.clear();
+  num_orphans_ = 0;
+  if (!bgzf_.open(fname, n_threads)) {
+    return false;
+  }
+  // magic, then the text header and the references, none of which we need
+  char buf[4];
+  if (!bgzf_.read(buf, 4) || memcmp(buf, "BAM\1", 4) != 0) {
+    return false;
+  }
+  if (!bgzf_.read(buf, 4)) {
+    return false;
+  }
+  int32_t l_text = get32(buf);
+  if (l_text < 0) {
+    return false;
+  }
+  rec_.resize(l_text);
+  if (!bgzf_.read(&rec_[0], rec_.size()) || !bgzf_.read(buf, 4)) {
+    return false;
+  }
+  int32_t n_ref = get32(buf);
+  if (n_ref < 0) {
+    return false;
+  }
+  for (int32_t i = 0; i < n_ref; i++) {
+    if (!bgzf_.read(buf, 4)) {
+      return false;
+    }
+    int32_t l_name = get32(buf);
+    if (l_name < 0) {
+      return false;
+    }
+    rec_.resize((size_t) l_name + 4); // name and length
+    if (!bgzf_.read(&rec_[0], rec_.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BamReader::readRecord(BamRead& r) {
+  while (true) {
+    char buf[4];
+    if (!bgzf_.read(buf, 4)) {
+      return false;
+    }
+    int32_t block_size = get32(buf);
+    if (block_size < 32) {
+      std::cerr << "Error: " << fname_ << " is truncated or corrupt" << std::endl;
+      exit(1);
+    }
+    rec_.resize(block_size);
+    if (!bgzf_.read(&rec_[0], block_size)) {
+      std::cerr << "Error: " << fname_ << " is truncated or corrupt" << std::endl;
+      exit(1);
+    }
+    const char* p = rec_.data();
+    uint8_t l_read_name = p[8];
+    uint16_t n_cigar_op = get16(p + 12);
+    uint16_t flag = get16(p + 14);
+    int32_t l_seq = get32(p + 16);
+    if (l_seq < 0 || 32 + l_read_name + 4*n_cigar_op + (l_seq+1)/2 + (size_t) l_seq > (size_t) block_size) {
+      std::cerr << "Error: " << fname_ << " is truncated or corrupt" << std::endl;
+      exit(1);
+    }
+    if (flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) {
+      continue;
+    }
+
+    r.flag = flag;
+    r.name.assign(p + 32, (l_read_name > 0) ? l_read_name - 1 : 0);
+    const unsigned char* seq = (const unsigned char*) p + 32 + l_read_name + 4*n_cigar_op;
+    const unsigned char* qual = seq + (l_seq+1)/2;
+    r.seq.resize(l_seq);
+    r.qual.resize(l_seq);
+    bool missing_qual = (l_seq > 0 && qual[0] == 0xff);
+    if (flag & BAM_FREVERSE) {
+      for (int32_t i = 0; i < l_seq; i++) {
+        int j = l_seq - 1 - i;
+        r.seq[i] = NT16_COMP[(seq[j/2] >> ((j & 1) ? 0 : 4)) & 0xf];
+        r.qual[i] = missing_qual ? '!' : (char) (qual[j] + 33);
+      }
+    } else {
+      for (int32_t i = 0; i < l_seq; i++) {
+        r.seq[i] = NT16[(seq[i/2] >> ((i & 1) ? 0 : 4)) & 0xf];
+        r.qual[i] = missing_qual ? '!' : (char) (qual[i] + 33);
+      }
+    }
+    return true;
+  }
+}
+
+bool BamReader::next(BamRead& r) {
+  return readRecord(r);
+}
+
+bool BamReader::nextPair(BamRead& r1, BamRead& r2) {
+  BamRead r;
+  while (readRecord(r)) {
+    if (!(r.flag & BAM_FPAIRED)) {
+      ++num_orphans_;
+      continue;
+    }
+    auto it = waiting_.find(r.name);
+    if (it == waiting_.end()) {
+      std::string name = r.name;
+      waiting_.emplace(std::move(name), std::move(r));
+      continue;
+    }
+    if (r.flag & BAM_FREAD1) {
+      r1 = std::move(r);
+      r2 = std::move(it->second);
+    } else {
+      r1 = std::move(it->second);
+      r2 = std::move(r);
+    }
+    waiting_.erase(it);
+    return true;
+  }
+  num_orphans_ += waiting_.size();
+  waiting_.clear();
+  if (num_orphans_ > 0) {
+    std::cerr << std::endl << "[~warn] " << fname_ << " has " << num_orphans_
+              << " reads without a mate, they were skipped" << std::endl;
+    num_orphans_ = 0;
+  }
+  return false;
+}
@@ -0,0 +1,50 @@
+#ifndef KALLISTO_BAMREADER_H
+#define KALLISTO_BAMREADER_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "BgzfReader.h"
+
+// a read taken from a BAM record, in the orientation it was sequenced
+struct BamRead {
+  std::string name;
+  std::string seq;
+  std::string qual; // phred+33
+  uint16_t flag;
+};
+
+// Reads the sequences of a BAM file as input for pseudoalignment, either
+// unaligned BAM or aligned BAM in any order. Secondary and supplementary
+// alignments are skipped and reads stored reverse complemented are turned
+// back. For paired-end reads the two ends are matched up by name and flags,
+// ends that are next to each other (as in unaligned BAM) never wait.
+class BamReader {
+public:
+  BamReader() : num_orphans_(0) {}
+
+  // parses the header, false if fname is not a BAM file
+  bool open(const std::string& fname, int n_threads);
+  // the next read, false at the end of the file
+  bool next(BamRead& r);
+  // the next pair, first and second end, false at the end of the file
+  bool nextPair(BamRead& r1, BamRead& r2);
+  // compressed bytes of the file read so far
+  uint64_t offset() const { return bgzf_.offset(); }
+
+private:
+  // the next primary record
+  bool readRecord(BamRead& r);
+
+  BgzfReader bgzf_;
+  std::string fname_;
+  std::string rec_;
+  std::unordered_map<std::string, BamRead> waiting_; // ends whose mate has not been seen
+  size_t num_orphans_; // records that are not part of a pair
+};
+
+// BAM input is recognized by the file name
+bool isBamFile(const std::string& fname);
+
+#endif // KALLISTO_BAMREADER_H
@@ -0,0 +1,297 @@
+#include "BamSorter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+
+// offsets into a BAM record, counted from its block_size
+static const size_t BAM_REFID = 4;
+static const size_t BAM_POS = 8;
+static const size_t BAM_L_READ_NAME = 12;
+static const size_t BAM_BIN = 14;
+static const size_t BAM_N_CIGAR = 16;
+static const size_t BAM_FLAG = 18;
+static const size_t BAM_READ_NAME = 36;
+
+static const uint32_t BAI_PSEUDO_BIN = 37450;
+
+template <typename T>
+static T getField(const char* rec, size_t off) {
+  T x;
+  memcpy(&x, rec + off, sizeof(T));
+  return x;
+}
+
+static uint32_t recordSize(const char* rec) {
+  return getField<uint32_t>(rec, 0) + 4;
+}
+
+// sort key of a record, unmapped records (refID -1) go to the end
+static uint64_t sortPos(const char* rec) {
+  uint32_t tid = getField<int32_t>(rec, BAM_REFID);
+  uint32_t pos = getField<int32_t>(rec, BAM_POS);
+  return ((uint64_t) tid << 32) | pos;
+}
+
+/** -- BamIndex -- **/
+
+void BamIndex::add(const char* rec, uint64_t vbeg, uint64_t vend) {
+  int32_t tid = getField<int32_t>(rec, BAM_REFID);
+  if (tid < 0) {
+    ++no_coor_;
+    return;
+  }
+
+  // the reference span of the alignment, one base if there is no cigar
+  int32_t beg = getField<int32_t>(rec, BAM_POS);
+  int n_cigar = getField<uint16_t>(rec, BAM_N_CIGAR);
+  const char* cigar = rec + BAM_READ_NAME + (uint8_t) rec[BAM_L_READ_NAME];
+  int32_t len = 0;
+  for (int i = 0; i < n_cigar; i++) {
+    uint32_t op = getField<uint32_t>(cigar, 4 * i);
+    switch (op & 0xf) {
+      case 0: case 2: case 3: case 7: case 8:
+        len += op >> 4;
+    }
+  }
+  int32_t end = beg + std::max(len, 1);
+
+  Ref& r = refs_[tid];
+  auto& chunks = r.bins[getField<uint16_t>(rec, BAM_BIN)];
+  if (!chunks.empty() && (chunks.back().second >> 16) == (vbeg >> 16)) {
+    // same block, extend the last chunk
+    chunks.back().second = vend;
+  } else {
+    chunks.push_back({vbeg, vend});
+  }
+
+  size_t last = (end - 1) >> 14;
+  if (r.linear.size() <= last) {
+    r.linear.resize(last + 1, 0);
+  }
+  for (size_t w = beg >> 14; w <= last; w++) {
+    if (r.linear[w] == 0) {
+      r.linear[w] = vbeg;
+    }
+  }
+
+  if (r.mapped + r.unmapped == 0) {
+    r.beg = vbeg;
+  }
+  r.end = vend;
+  if (getField<uint16_t>(rec, BAM_FLAG) & 0x4) {
+    ++r.unmapped;
+  } else {
+    ++r.mapped;
+  }
+}
+
+bool BamIndex::write(const std::string& fname, const BgzfWriter& bam) const {
+  std::ofstream out;
+  out.open(fname, std::ios::out | std::ios::binary);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  auto put32 = [&](int32_t x) { out.write((char*) &x, sizeof(x)); };
+  auto put64 = [&](uint64_t x) { out.write((char*) &x, sizeof(x)); };
+
+  out.write("BAI\1", 4);
+  put32(refs_.size());
+  for (const auto& r : refs_) {
+    bool used = (r.mapped + r.unmapped) > 0;
+    put32(r.bins.size() + (used ? 1 : 0));
+    for (const auto& b : r.bins) {
+      put32(b.first);
+      put32(b.second.size());
+      for (const auto& c : b.second) {
+        put64(bam.resolveOffset(c.first));
+        put64(bam.resolveOffset(c.second));
+      }
+    }
+    if (used) {
+      put32(BAI_PSEUDO_BIN);
+      put32(2);
+      put64(bam.resolveOffset(r.beg));
+      put64(bam.resolveOffset(r.end));
+      put64(r.mapped);
+      put64(r.unmapped);
+    }
+
+    // windows without records get the offset of the window before them
+    put32(r.linear.size());
+    uint64_t prev = 0;
+    for (uint64_t v : r.linear) {
+      if (v != 0) {
+        prev = bam.resolveOffset(v);
+      }
+      put64(prev);
+    }
+  }
+  put64(no_coor_);
+
+  out.close();
+  return !out.fail();
+}
+
+/** -- BamSorter -- **/
+
+BamSorter::BamSorter(const std::string& tmp_prefix, size_t max_memory, int n_threads)
+  : tmp_prefix_(tmp_prefix), max_buffer_(max_memory / std::max(n_threads, 1)) {}
+
+BamSorter::~BamSorter() {
+  for (const auto& fn : runs_) {
+    std::remove(fn.c_str());
+  }
+}
+
+void BamSorter::add(BamSortBuffer& buf, int chunk, const std::string& records) {
+  size_t start = buf.data.size();
+  buf.data.append(records);
+  uint64_t order = (uint64_t) chunk << 32;
+  for (size_t off = start; off < buf.data.size(); off += recordSize(&buf.data[off])) {
+    buf.entries.push_back({sortPos(&buf.data[off]), order++, off});
+  }
+  if (buf.bytes() > max_buffer_) {
+    spill(buf);
+  }
+}
+
+void BamSorter::finish(BamSortBuffer& buf) {
+  if (buf.entries.empty()) {
+    return;
+  }
+  std::sort(buf.entries.begin(), buf.entries.end());
+  std::lock_guard<std::mutex> lock(lock_);
+  kept_.push_back(std::move(buf));
+  buf = BamSortBuffer();
+}
+
+void BamSorter::spill(BamSortBuffer& buf) {
+  std::sort(buf.entries.begin(), buf.entries.end());
+
+  std::string fname;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    fname = tmp_prefix_ + "." + std::to_string(runs_.size());
+    runs_.push_back(fname);
+  }
+
+  // each record is preceded by its sort key
+  FILE* f = fopen(fname.c_str(), "wb");
+  bool ok = (f != nullptr);
+  for (size_t i = 0; ok && i < buf.entries.size(); i++) {
+    const auto& e = buf.entries[i];
+    const char* rec = &buf.data[e.offset];
+    ok = fwrite(&e.pos, sizeof(e.pos), 1, f) == 1
+      && fwrite(&e.order, sizeof(e.order), 1, f) == 1
+      && fwrite(rec, recordSize(rec), 1, f) == 1;
+  }
+  if (f != nullptr) {
+    ok = (fclose(f) == 0) && ok;
+  }
+  if (!ok) {
+    std::cerr << "Error: could not write temporary file " << fname << std::endl;
+    exit(1);
+  }
+
+  buf.data.clear();
+  buf.entries.clear();
+}
+
+namespace {
+
+// a sorted run, read one record at a time from a file or from memory
+struct MergeSource {
+  FILE* f = nullptr;
+  const BamSortBuffer* buf = nullptr;
+  size_t next = 0;
+  std::string rec; // current record when reading from a file
+  const char* data = nullptr;
+  uint64_t pos = 0;
+  uint64_t order = 0;
+
+  bool advance() {
+    if (buf != nullptr) {
+      if (next == buf->entries.size()) {
+        return false;
+      }
+      const auto& e = buf->entries[next++];
+      pos = e.pos;
+      order = e.order;
+      data = &buf->data[e.offset];
+      return true;
+    }
+    uint32_t block_size;
+    if (fread(&pos, sizeof(pos), 1, f) != 1) {
+      return false;
+    }
+    if (fread(&order, sizeof(order), 1, f) != 1
+        || fread(&block_size, sizeof(block_size), 1, f) != 1) {
+      std::cerr << "Error: truncated temporary BAM file" << std::endl;
+      exit(1);
+    }
+    rec.resize(block_size + 4);
+    memcpy(&rec[0], &block_size, 4);
+    if (block_size > 0 && fread(&rec[4], block_size, 1, f) != 1) {
+      std::cerr << "Error: truncated temporary BAM file" << std::endl;
+      exit(1);
+    }
+    data = rec.data();
+    return true;
+  }
+};
+
+}
+
+void BamSorter::merge(BgzfWriter& out, BamIndex& index) {
+  std::vector<MergeSource> sources(runs_.size() + kept_.size());
+  std::vector<std::vector<char>> file_bufs(runs_.size());
+  for (size_t i = 0; i < runs_.size(); i++) {
+    sources[i].f = fopen(runs_[i].c_str(), "rb");
+    if (sources[i].f == nullptr) {
+      std::cerr << "Error: could not open temporary file " << runs_[i] << std::endl;
+      exit(1);
+    }
+    file_bufs[i].resize(1 << 20);
+    setvbuf(sources[i].f, file_bufs[i].data(), _IOFBF, file_bufs[i].size());
+  }
+  for (size_t i = 0; i < kept_.size(); i++) {
+    sources[runs_.size() + i].buf = &kept_[i];
+  }
+
+  typedef std::pair<std::pair<uint64_t, uint64_t>, size_t> HeapItem;
+  std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (sources[i].advance()) {
+      heap.push({{sources[i].pos, sources[i].order}, i});
+    }
+  }
+
+  while (!heap.empty()) {
+    size_t i = heap.top().second;
+    heap.pop();
+    auto& s = sources[i];
+    uint64_t vbeg = out.virtualOffset();
+    out.write(s.data, recordSize(s.data));
+    index.add(s.data, vbeg, out.virtualOffset());
+    if (s.advance()) {
+      heap.push({{s.pos, s.order}, i});
+    }
+  }
+
+  for (auto& s : sources) {
+    if (s.f != nullptr) {
+      fclose(s.f);
+    }
+  }
+  for (const auto& fn : runs_) {
+    std::remove(fn.c_str());
+  }
+  runs_.clear();
+  kept_.clear();
+}
@@ -0,0 +1,90 @@
+#ifndef KALLISTO_BAMSORTER_H
+#define KALLISTO_BAMSORTER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BgzfWriter.h"
+
+// Coordinate sorting of pseudobam records with bounded memory. Every worker
+// collects the BAM records it formats in its own BamSortBuffer. A buffer
+// that grows past its share of the memory is sorted and spilled to a
+// temporary run file, what is left at the end stays in memory. merge then
+// does a k-way merge of all runs into the BGZF output and builds the index.
+
+struct BamSortEntry {
+  uint64_t pos;   // target in the high bits, unmapped (-1) sorts last
+  uint64_t order; // buffer and record number, ties keep the input order
+  size_t offset;  // of the record in BamSortBuffer::data
+
+  bool operator<(const BamSortEntry& o) const {
+    return (pos < o.pos) || (pos == o.pos && order < o.order);
+  }
+};
+
+struct BamSortBuffer {
+  std::string data; // BAM records, each starting with its block_size
+  std::vector<BamSortEntry> entries;
+
+  size_t bytes() const {
+    return data.size() + entries.size() * sizeof(BamSortEntry);
+  }
+};
+
+// BAI index of a coordinate-sorted BAM file. CSI is not written, a BAI
+// covers targets up to 2^29 bases which is plenty for transcripts.
+class BamIndex {
+public:
+  explicit BamIndex(int n_ref) : refs_(n_ref), no_coor_(0) {}
+
+  // a record written to [vbeg, vend), offsets from BgzfWriter::virtualOffset
+  void add(const char* rec, uint64_t vbeg, uint64_t vend);
+  // write the index, 'bam' has to be closed so its offsets can be resolved
+  bool write(const std::string& fname, const BgzfWriter& bam) const;
+
+private:
+  struct Ref {
+    std::map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> bins;
+    std::vector<uint64_t> linear; // first record overlapping each 16kb window
+    uint64_t beg = 0;
+    uint64_t end = 0;
+    uint64_t mapped = 0;
+    uint64_t unmapped = 0;
+  };
+  std::vector<Ref> refs_;
+  uint64_t no_coor_;
+};
+
+class BamSorter {
+public:
+  // runs are written to tmp_prefix.0, tmp_prefix.1, ... and removed again
+  BamSorter(const std::string& tmp_prefix, size_t max_memory, int n_threads);
+  ~BamSorter();
+
+  BamSorter(const BamSorter&) = delete;
+  BamSorter& operator=(const BamSorter&) = delete;
+
+  // add the records of buffer number 'chunk' to a worker's buffer, spills
+  // the buffer if it is full. Only the spilling takes the lock.
+  void add(BamSortBuffer& buf, int chunk, const std::string& records);
+  // the worker is done, its buffer is kept in memory until the merge
+  void finish(BamSortBuffer& buf);
+  // merge everything into 'out', after the header, and index it
+  void merge(BgzfWriter& out, BamIndex& index);
+
+private:
+  void spill(BamSortBuffer& buf);
+
+  std::string tmp_prefix_;
+  size_t max_buffer_; // per worker
+  std::mutex lock_;
+  std::vector<std::string> runs_;
+  std::vector<BamSortBuffer> kept_;
+};
+
+#endif // KALLISTO_BAMSORTER_H
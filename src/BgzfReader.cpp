@@ -0,0 +1,223 @@
+#include "BgzfReader.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+static const size_t BGZF_FIXED_HEADER = 12; // up to and including XLEN
+static const size_t BGZF_FOOTER = 8;
+static const size_t BGZF_MAX_BLOCK = 65536;
+
+static uint16_t get16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+BgzfReader::~BgzfReader() {
+  close();
+}
+
+bool BgzfReader::open(const std::string& fname, int n_threads) {
+  close();
+  fname_ = fname;
+  f_ = (fname == "-") ? stdin : fopen(fname.c_str(), "rb");
+  if (f_ == nullptr) {
+    return false;
+  }
+  block_.clear();
+  pos_ = 0;
+  eof_ = false;
+  offset_ = 0;
+  stop_ = false;
+  if (n_threads > 1) {
+    max_queued_ = 4 * n_threads;
+    for (int i = 0; i < n_threads; i++) {
+      workers_.emplace_back(&BgzfReader::worker, this);
+    }
+  }
+  return true;
+}
+
+void BgzfReader::close() {
+  if (f_ == nullptr) {
+    return;
+  }
+  if (!workers_.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stop_ = true;
+      pending_.clear();
+    }
+    work_cv_.notify_all();
+    for (auto& t : workers_) {
+      t.join();
+    }
+    workers_.clear();
+  }
+  queue_.clear();
+  if (f_ != stdin) {
+    fclose(f_);
+  }
+  f_ = nullptr;
+}
+
+bool BgzfReader::read(char* data, size_t n) {
+  while (n > 0) {
+    if (pos_ == block_.size() && !nextBlock()) {
+      return false;
+    }
+    size_t k = std::min(n, block_.size() - pos_);
+    memcpy(data, block_.data() + pos_, k);
+    pos_ += k;
+    data += k;
+    n -= k;
+  }
+  return true;
+}
+
+bool BgzfReader::readBlock(std::string& in) {
+  unsigned char h[BGZF_FIXED_HEADER];
+  size_t r = fread(h, 1, BGZF_FIXED_HEADER, f_);
+  if (r == 0) {
+    return false;
+  }
+  if (r != BGZF_FIXED_HEADER || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)) {
+    std::cerr << "Error: " << fname_ << " is not a BGZF file" << std::endl;
+    exit(1);
+  }
+  size_t xlen = get16(h + 10);
+  in.assign((const char*) h, BGZF_FIXED_HEADER);
+  in.resize(BGZF_FIXED_HEADER + xlen);
+  if (fread(&in[BGZF_FIXED_HEADER], 1, xlen, f_) != xlen) {
+    std::cerr << "Error: " << fname_ << " is truncated" << std::endl;
+    exit(1);
+  }
+
+  // the BC subfield has the size of the block
+  size_t bsize = 0;
+  const unsigned char* x = (const unsigned char*) in.data() + BGZF_FIXED_HEADER;
+  for (size_t i = 0; i + 4 <= xlen; i += 4 + get16(x + i + 2)) {
+    if (x[i] == 'B' && x[i+1] == 'C' && get16(x + i + 2) == 2) {
+      bsize = get16(x + i + 4) + 1;
+    }
+  }
+  if (bsize < in.size() + BGZF_FOOTER) {
+    std::cerr << "Error: " << fname_ << " is not a BGZF file" << std::endl;
+    exit(1);
+  }
+  size_t have = in.size();
+  in.resize(bsize);
+  if (fread(&in[have], 1, bsize - have, f_) != bsize - have) {
+    std::cerr << "Error: " << fname_ << " is truncated" << std::endl;
+    exit(1);
+  }
+  offset_ += bsize;
+  return true;
+}
+
+bool BgzfReader::nextBlock() {
+  while (true) {
+    if (workers_.empty()) {
+      if (eof_ || !readBlock(in_)) {
+        eof_ = true;
+        return false;
+      }
+      if (!decompressBlock(in_, block_)) {
+        std::cerr << "Error: corrupt BGZF block in " << fname_ << std::endl;
+        exit(1);
+      }
+    } else {
+      // keep the workers busy with the blocks that follow
+      while (!eof_ && queue_.size() < max_queued_) {
+        std::shared_ptr<Job> job(new Job());
+        if (!readBlock(job->in)) {
+          eof_ = true;
+          break;
+        }
+        job->done = false;
+        std::lock_guard<std::mutex> lock(lock_);
+        queue_.push_back(job);
+        pending_.push_back(job);
+        work_cv_.notify_one();
+      }
+      if (queue_.empty()) {
+        return false;
+      }
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        done_cv_.wait(lock, [this] { return queue_.front()->done; });
+        job = queue_.front();
+        queue_.pop_front();
+      }
+      if (!job->ok) {
+        std::cerr << "Error: corrupt BGZF block in " << fname_ << std::endl;
+        exit(1);
+      }
+      block_.swap(job->out);
+    }
+    pos_ = 0;
+    // the EOF marker and other empty blocks have nothing to hand out
+    if (!block_.empty()) {
+      return true;
+    }
+  }
+}
+
+void BgzfReader::worker() {
+  while (true) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+      if (stop_) {
+        return;
+      }
+      job = pending_.front();
+      pending_.pop_front();
+    }
+
+    job->ok = decompressBlock(job->in, job->out);
+    std::string().swap(job->in);
+
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      job->done = true;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+bool BgzfReader::decompressBlock(const std::string& in, std::string& out) {
+  const unsigned char* p = (const unsigned char*) in.data();
+  size_t hlen = BGZF_FIXED_HEADER + get16(p + 10);
+  uint32_t crc = get32(p + in.size() - 8);
+  size_t isize = get32(p + in.size() - 4);
+  if (isize > BGZF_MAX_BLOCK) {
+    return false;
+  }
+  out.resize(isize);
+  if (isize == 0) {
+    return true;
+  }
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -15) != Z_OK) {
+    return false;
+  }
+  zs.next_in = (Bytef*) p + hlen;
+  zs.avail_in = in.size() - hlen - BGZF_FOOTER;
+  zs.next_out = (Bytef*) &out[0];
+  zs.avail_out = isize;
+  int ret = inflate(&zs, Z_FINISH);
+  bool ok = (ret == Z_STREAM_END) && (zs.total_out == isize);
+  inflateEnd(&zs);
+  return ok && crc32(crc32(0L, Z_NULL, 0), (const Bytef*) out.data(), isize) == crc;
+}
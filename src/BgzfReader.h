@@ -0,0 +1,72 @@
+#ifndef KALLISTO_BGZFREADER_H
+#define KALLISTO_BGZFREADER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads a BGZF file (the blocked gzip used by BAM) as one stream. The
+// compressed blocks are read ahead on the calling thread, inflated by a pool
+// of worker threads and handed back in order. The file is only read forward,
+// so "-" (standard input) and pipes work too.
+class BgzfReader {
+public:
+  BgzfReader() : f_(nullptr), pos_(0), eof_(false), stop_(false) {}
+  ~BgzfReader();
+
+  BgzfReader(const BgzfReader&) = delete;
+  BgzfReader& operator=(const BgzfReader&) = delete;
+
+  // n_threads <= 1 decompresses on the calling thread
+  bool open(const std::string& fname, int n_threads);
+  // exactly n bytes, false if the data ends first. Exits on a corrupt file.
+  bool read(char* data, size_t n);
+  void close();
+  // compressed bytes read from the file so far, ahead of what read() has
+  // handed out by the blocks queued for the workers
+  uint64_t offset() const { return offset_; }
+
+  // inflate the block 'in' (header and footer included) into 'out', false if
+  // it is not a valid BGZF block
+  static bool decompressBlock(const std::string& in, std::string& out);
+
+private:
+  struct Job {
+    std::string in;
+    std::string out;
+    bool ok;
+    bool done;
+  };
+
+  // the next compressed block of the file, false at the end
+  bool readBlock(std::string& in);
+  // make block_ the next block with data, false at the end
+  bool nextBlock();
+  void worker();
+
+  FILE* f_;
+  std::string fname_;
+  std::string in_; // used when decompressing on the calling thread
+  std::string block_;
+  size_t pos_; // next byte of block_
+  bool eof_; // every block of the file has been read
+  uint64_t offset_ = 0;
+
+  // the worker pool
+  std::vector<std::thread> workers_;
+  std::mutex lock_;
+  std::condition_variable work_cv_; // a job was queued or we are stopping
+  std::condition_variable done_cv_; // a job finished
+  std::deque<std::shared_ptr<Job>> queue_;   // in file order
+  std::deque<std::shared_ptr<Job>> pending_; // not yet picked by a worker
+  size_t max_queued_ = 0;
+  bool stop_;
+};
+
+#endif // KALLISTO_BGZFREADER_H
@@ -0,0 +1,209 @@
+#include "BgzfWriter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+// the empty block that marks the end of a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+  0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+static const size_t BGZF_HEADER = 18;
+static const size_t BGZF_FOOTER = 8;
+static const size_t BGZF_MAX_BLOCK = 65536;
+
+BgzfWriter::~BgzfWriter() {
+  close();
+}
+
+bool BgzfWriter::open(const std::string& fname, int n_threads, int level) {
+  close();
+  fname_ = fname;
+  level_ = level;
+  f_ = fopen(fname.c_str(), "wb");
+  if (f_ == nullptr) {
+    return false;
+  }
+  file_offset_ = 0;
+  num_blocks_ = 0;
+  block_starts_.clear();
+  stop_ = false;
+  next_id_ = 0;
+  block_.reserve(MAX_BLOCK_DATA);
+  if (n_threads > 1) {
+    max_queued_ = 4 * n_threads;
+    for (int i = 0; i < n_threads; i++) {
+      workers_.emplace_back(&BgzfWriter::worker, this);
+    }
+  }
+  return true;
+}
+
+void BgzfWriter::write(const char* data, size_t n) {
+  while (n > 0) {
+    size_t k = std::min(n, MAX_BLOCK_DATA - block_.size());
+    block_.append(data, k);
+    data += k;
+    n -= k;
+    if (block_.size() == MAX_BLOCK_DATA) {
+      submit();
+    }
+  }
+}
+
+void BgzfWriter::flush() {
+  if (!block_.empty()) {
+    submit();
+  }
+}
+
+void BgzfWriter::close() {
+  if (f_ == nullptr) {
+    return;
+  }
+  flush();
+  if (!workers_.empty()) {
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      done_cv_.wait(lock, [this] { return queue_.empty(); });
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& t : workers_) {
+      t.join();
+    }
+    workers_.clear();
+  }
+  block_starts_.push_back(file_offset_);
+  bool ok = fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), f_) == sizeof(BGZF_EOF);
+  ok = (fclose(f_) == 0) && ok;
+  f_ = nullptr;
+  if (!ok) {
+    std::cerr << "Error: could not write to " << fname_ << std::endl;
+    exit(1);
+  }
+}
+
+void BgzfWriter::submit() {
+  ++num_blocks_;
+  if (workers_.empty()) {
+    compressBlock(block_.data(), block_.size(), level_, out_);
+    block_starts_.push_back(file_offset_);
+    if (fwrite(out_.data(), 1, out_.size(), f_) != out_.size()) {
+      std::cerr << "Error: could not write to " << fname_ << std::endl;
+      exit(1);
+    }
+    file_offset_ += out_.size();
+    block_.clear();
+    return;
+  }
+
+  std::shared_ptr<Job> job(new Job());
+  job->data.swap(block_);
+  job->done = false;
+  block_.reserve(MAX_BLOCK_DATA);
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    // don't run too far ahead of the workers
+    done_cv_.wait(lock, [this] { return queue_.size() < max_queued_; });
+    job->id = next_id_++;
+    queue_.push_back(job);
+    pending_.push_back(job);
+  }
+  work_cv_.notify_one();
+}
+
+void BgzfWriter::worker() {
+  while (true) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      job = pending_.front();
+      pending_.pop_front();
+    }
+
+    compressBlock(job->data.data(), job->data.size(), level_, job->out);
+    std::string().swap(job->data);
+
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      job->done = true;
+      drain();
+    }
+    done_cv_.notify_all();
+  }
+}
+
+void BgzfWriter::drain() {
+  while (!queue_.empty() && queue_.front()->done) {
+    auto& out = queue_.front()->out;
+    block_starts_.push_back(file_offset_);
+    if (fwrite(out.data(), 1, out.size(), f_) != out.size()) {
+      std::cerr << "Error: could not write to " << fname_ << std::endl;
+      exit(1);
+    }
+    file_offset_ += out.size();
+    queue_.pop_front();
+  }
+}
+
+static void put16(unsigned char* p, uint16_t x) {
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+}
+
+static void put32(unsigned char* p, uint32_t x) {
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+  p[2] = (x >> 16) & 0xff;
+  p[3] = (x >> 24) & 0xff;
+}
+
+void BgzfWriter::compressBlock(const char* data, size_t n, int level, std::string& out) {
+  out.resize(BGZF_MAX_BLOCK);
+  unsigned char* p = (unsigned char*) &out[0];
+
+  size_t clen = 0;
+  // incompressible data can come out larger than a block, then store it
+  for (int lvl : {level, 0}) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, lvl, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef*) data;
+    zs.avail_in = n;
+    zs.next_out = p + BGZF_HEADER;
+    zs.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER - BGZF_FOOTER;
+    int ret = deflate(&zs, Z_FINISH);
+    clen = zs.total_out;
+    deflateEnd(&zs);
+    if (ret == Z_STREAM_END) {
+      break;
+    }
+    if (lvl == 0) {
+      std::cerr << "Error: could not compress BGZF block" << std::endl;
+      exit(1);
+    }
+  }
+
+  size_t bsize = BGZF_HEADER + clen + BGZF_FOOTER;
+  static const unsigned char header[BGZF_HEADER] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0x00, 'B', 'C', 0x02, 0x00, 0, 0
+  };
+  memcpy(p, header, BGZF_HEADER);
+  put16(p + 16, bsize - 1);
+
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data, n);
+  put32(p + BGZF_HEADER + clen, crc);
+  put32(p + BGZF_HEADER + clen + 4, n);
+  out.resize(bsize);
+}
@@ -0,0 +1,86 @@
+#ifndef KALLISTO_BGZFWRITER_H
+#define KALLISTO_BGZFWRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes a BGZF file (the blocked gzip used by BAM). Data is cut into
+// blocks of at most MAX_BLOCK_DATA bytes, the blocks are deflated by a pool
+// of worker threads and written to the file in order.
+class BgzfWriter {
+public:
+  static const size_t MAX_BLOCK_DATA = 0xff00;
+
+  BgzfWriter() : f_(nullptr), next_id_(0), stop_(false) {}
+  ~BgzfWriter();
+
+  BgzfWriter(const BgzfWriter&) = delete;
+  BgzfWriter& operator=(const BgzfWriter&) = delete;
+
+  // n_threads <= 1 compresses on the calling thread
+  bool open(const std::string& fname, int n_threads, int level = 6);
+  void write(const char* data, size_t n);
+  void write(const std::string& s) {
+    write(s.data(), s.size());
+  }
+  // end the current block even if it is not full
+  void flush();
+  // flush, wait for the workers, write the EOF block and close the file
+  void close();
+
+  // Position of the next byte written, as a BGZF virtual offset but with
+  // the number of the block in place of its file offset, which is not known
+  // until the block has been compressed. Turn it into a real virtual offset
+  // with resolveOffset once the file is closed.
+  uint64_t virtualOffset() const {
+    return (num_blocks_ << 16) | block_.size();
+  }
+  uint64_t resolveOffset(uint64_t v) const {
+    return (block_starts_[v >> 16] << 16) | (v & 0xffff);
+  }
+
+  // compress one block of at most MAX_BLOCK_DATA bytes into 'out'
+  static void compressBlock(const char* data, size_t n, int level, std::string& out);
+
+private:
+  struct Job {
+    size_t id;
+    std::string data;
+    std::string out;
+    bool done;
+  };
+
+  void submit();
+  void worker();
+  // write out every finished job at the front of the queue, needs lock_
+  void drain();
+
+  FILE* f_;
+  std::string fname_;
+  int level_;
+  std::string block_;
+  std::string out_; // used when compressing on the calling thread
+  uint64_t file_offset_ = 0;
+  uint64_t num_blocks_ = 0;
+  std::vector<uint64_t> block_starts_; // file offset of each block, then of the EOF block
+
+  // the worker pool
+  std::vector<std::thread> workers_;
+  std::mutex lock_;
+  std::condition_variable work_cv_; // a job was queued or we are stopping
+  std::condition_variable done_cv_; // a job finished
+  std::deque<std::shared_ptr<Job>> queue_;   // in file order
+  std::deque<std::shared_ptr<Job>> pending_; // not yet picked by a worker
+  size_t next_id_;
+  size_t max_queued_ = 0;
+  bool stop_;
+};
+
+#endif // KALLISTO_BGZFWRITER_H
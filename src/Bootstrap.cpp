@@ -1,20 +1,161 @@
 #include "Bootstrap.h"
 
-EMAlgorithm Bootstrap::run_em() {
-    auto counts = mult_.sample();
-    EMAlgorithm em(counts, index_, tc_, mean_fls_, opt);
+BootstrapContext::BootstrapContext(
+    const std::vector<int>& true_counts,
+    const KmerIndex& index,
+    const MinCollector& tc,
+    const std::vector<double>& mean_fls) :
+  eff_lens(calc_eff_lens(index.target_lens_, mean_fls)),
+  sampler(true_counts.begin(), true_counts.end()),
+  num_ecs(true_counts.size()),
+  n(0),
+  ecs(tc.ecs)
+{
+  assert(mean_fls.size() == index.target_lens_.size());
+  weights = calc_weights(tc.counts, tc.ecs, eff_lens);
+  for (auto c : true_counts) {
+    n += c;
+  }
+}
+
+const EMAlgorithm& Bootstrap::run_em(size_t seed) {
+  // the distribution object itself is empty, the table lives in the context
+  std::default_random_engine gen(seed);
+  std::discrete_distribution<int> dd;
+
+  std::fill(counts_.begin(), counts_.end(), 0);
+  for (int i = 0; i < ctx_.n; ++i) {
+    ++counts_[dd(gen, ctx_.sampler)];
+  }
+
+  em_.reset();
+  em_.run(10000, 50, false, false);
+  /* em_.compute_rho(); */
+
+  return em_;
+}
+
+BatchBootstrap::BatchBootstrap(
+    const BootstrapContext& ctx,
+    const KmerIndex& index,
+    size_t n_lanes,
+    size_t n_iter,
+    size_t min_rounds) :
+  ctx_(ctx),
+  ecmap_(ctx.ecs),
+  L_(n_lanes),
+  num_trans_(index.num_trans),
+  n_iter_(n_iter),
+  min_rounds_(min_rounds),
+  counts_(ctx.num_ecs * n_lanes, 0),
+  alpha_(index.num_trans * n_lanes, 0.0),
+  next_alpha_(index.num_trans * n_lanes, 0.0),
+  denom_(n_lanes, 0.0),
+  count_norm_(n_lanes, 0.0),
+  active_(n_lanes, false),
+  final_round_(n_lanes, false),
+  round_(n_lanes, 0),
+  chcount_(n_lanes, 0),
+  ids_(n_lanes, 0),
+  out_(index.num_trans, 0.0)
+{
+  assert(n_lanes > 0);
+  assert(ecmap_.size() == ctx.num_ecs);
+}
+
+void BatchBootstrap::start_lane(size_t l, size_t seed) {
+  // draw exactly as Bootstrap::run_em does, into column l
+  std::default_random_engine gen(seed);
+  std::discrete_distribution<int> dd;
+
+  for (size_t ec = 0; ec < ctx_.num_ecs; ++ec) {
+    counts_[ec*L_ + l] = 0;
+  }
+  for (int i = 0; i < ctx_.n; ++i) {
+    ++counts_[dd(gen, ctx_.sampler)*L_ + l];
+  }
+
+  for (int t = 0; t < num_trans_; ++t) {
+    alpha_[t*L_ + l] = 1.0/num_trans_;
+  }
+
+  active_[l] = true;
+  final_round_[l] = false;
+  round_[l] = 0;
+}
+
+// one round of EM for all the lanes, see EMAlgorithm::run for the scalar
+// version. Inactive lanes have zero counts, so they stay at zero.
+void BatchBootstrap::em_round() {
+  const double alpha_change_limit = 1e-2;
+  const double alpha_change = 1e-2;
+  const size_t L = L_;
+
+  for (int t = 0; t < num_trans_; ++t) {
+    for (size_t l = 0; l < L; ++l) {
+      next_alpha_[t*L + l] = counts_[t*L + l];
+    }
+  }
 
-    //em.set_start(em_start);
-    em.run(10000, 50, false, false);
-    /* em.compute_rho(); */
+  double *denom = denom_.data();
+  double *count_norm = count_norm_.data();
 
-    return em;
+  for (size_t ec = num_trans_; ec < ecmap_.size(); ++ec) {
+    const int *c = &counts_[ec*L];
+    bool any = false;
+    for (size_t l = 0; l < L; ++l) {
+      any = any || (c[l] != 0);
+    }
+    if (!any) {
+      continue;
+    }
+
+    auto& wv = ctx_.weights[ec];
+    auto& v = ecmap_[ec];
+    auto numEC = v.size();
+
+    std::fill(denom, denom + L, 0.0);
+    for (size_t t_it = 0; t_it < numEC; ++t_it) {
+      const double *a = &alpha_[v[t_it]*L];
+      const double w = wv[t_it];
+      for (size_t l = 0; l < L; ++l) {
+        denom[l] += a[l] * w;
+      }
+    }
+
+    // a zero norm leaves the lane untouched, like the scalar 'continue'
+    for (size_t l = 0; l < L; ++l) {
+      count_norm[l] = (c[l] == 0 || denom[l] < TOLERANCE) ? 0.0 : c[l] / denom[l];
+    }
+
+    for (size_t t_it = 0; t_it < numEC; ++t_it) {
+      const double *a = &alpha_[v[t_it]*L];
+      double *na = &next_alpha_[v[t_it]*L];
+      const double w = wv[t_it];
+      for (size_t l = 0; l < L; ++l) {
+        na[l] += (w * a[l]) * count_norm[l];
+      }
+    }
+  }
+
+  std::fill(chcount_.begin(), chcount_.end(), 0);
+  for (int t = 0; t < num_trans_; ++t) {
+    double *a = &alpha_[t*L];
+    double *na = &next_alpha_[t*L];
+    for (size_t l = 0; l < L; ++l) {
+      if (na[l] > alpha_change_limit && (std::fabs(na[l] - a[l]) / na[l]) > alpha_change) {
+        chcount_[l]++;
+      }
+      a[l] = na[l];
+      na[l] = 0.0;
+    }
+  }
 }
 
 BootstrapThreadPool::BootstrapThreadPool(
     size_t n_threads,
     std::vector<size_t> seeds,
-    const std::vector<int>& true_counts,
+    const BootstrapContext& ctx,
     const KmerIndex& index,
     const MinCollector& tc,
     const std::vector<double>& eff_lens,
@@ -25,7 +166,7 @@ BootstrapThreadPool::BootstrapThreadPool(
   n_threads_(n_threads),
   seeds_(seeds),
   n_complete_(0),
-  true_counts_(true_counts),
+  ctx_(ctx),
   index_(index),
   tc_(tc),
   eff_lens_(eff_lens),
@@ -44,48 +185,56 @@ BootstrapThreadPool::~BootstrapThreadPool() {
   }
 }
 
+bool BootstrapThreadPool::next_seed(size_t& seed, size_t& id) {
+  std::unique_lock<std::mutex> lock(seeds_mutex_);
+
+  if (seeds_.empty()) {
+    // no more bootstraps to perform
+    return false;
+  }
+
+  id = seeds_.size() - 1;
+  seed = seeds_.back();
+  seeds_.pop_back();
+  return true;
+}
+
+void BootstrapThreadPool::write(const std::vector<double>& alpha, size_t id) {
+  if (!opt_.plaintext) {
+    // compress on this thread, only the write itself goes through the lock
+    H5Chunk chunk;
+    writer_.compress_bootstrap(alpha, chunk);
+    std::unique_lock<std::mutex> lock(write_lock_);
+    ++n_complete_;
+    std::cerr << "[bstrp] number of EM bootstraps complete: " << n_complete_ << "\r";
+    writer_.write_bootstrap(chunk, id);
+    // release write lock
+  } else {
+    // can write out plaintext in parallel
+    plaintext_writer(opt_.output + "/bs_abundance_" +
+        std::to_string(id) + ".tsv",
+        index_.target_names_, alpha,
+        eff_lens_, index_.target_lens_);
+  }
+}
+
 void BootstrapWorker::operator() (){
-  while (true) {
-    size_t cur_seed;
-    size_t cur_id;
+  size_t cur_seed;
+  size_t cur_id;
 
-    // acquire a seed
-    {
-      std::unique_lock<std::mutex> lock(pool_.seeds_mutex_);
+  if (pool_.opt_.bootstrap_batch > 1) {
+    BatchBootstrap bs(pool_.ctx_, pool_.index_, pool_.opt_.bootstrap_batch);
+    bs.run(
+        [&](size_t& seed, size_t& id) { return pool_.next_seed(seed, id); },
+        [&](const std::vector<double>& alpha, size_t id) { pool_.write(alpha, id); });
+    return;
+  }
 
-      if (pool_.seeds_.empty()) {
-        // no more bootstraps to perform, this thread is done
-        return;
-      }
+  // scratch space reused by every replicate this thread runs
+  Bootstrap bs(pool_.ctx_, pool_.index_, pool_.tc_, pool_.mean_fls_, pool_.opt_);
 
-      cur_id = pool_.seeds_.size() - 1;
-      cur_seed = pool_.seeds_.back();
-      pool_.seeds_.pop_back();
-      // std::cout << "cur seed from thread (" << thread_id_ << "): " <<
-      //   cur_seed <<  " id: " << cur_id << std::endl;
-    } // release lock
-
-    Bootstrap bs(pool_.true_counts_,
-        pool_.index_,
-        pool_.tc_,
-        pool_.eff_lens_,
-        cur_seed,
-        pool_.mean_fls_, pool_.opt_);
-
-    auto res = bs.run_em();
-
-    if (!pool_.opt_.plaintext) {
-      std::unique_lock<std::mutex> lock(pool_.write_lock_);
-      ++pool_.n_complete_;
-      std::cerr << "[bstrp] number of EM bootstraps complete: " << pool_.n_complete_ << "\r";
-      pool_.writer_.write_bootstrap(res, cur_id);
-      // release write lock
-    } else {
-      // can write out plaintext in parallel
-      plaintext_writer(pool_.opt_.output + "/bs_abundance_" +
-          std::to_string(cur_id) + ".tsv",
-          pool_.index_.target_names_, res.alpha_,
-          pool_.eff_lens_, pool_.index_.target_lens_);
-    }
+  while (pool_.next_seed(cur_seed, cur_id)) {
+    const auto& res = bs.run_em(cur_seed);
+    pool_.write(res.alpha_, cur_id);
   }
 }
@@ -2,53 +2,160 @@
 #define KALLISTO_BOOTSTRAP_H
 
 #include <mutex>
+#include <random>
 #include <thread>
 
 #include "KmerIndex.h"
 #include "MinCollector.h"
 #include "weights.h"
 #include "EMAlgorithm.h"
-#include "Multinomial.hpp"
 #include "H5Writer.h"
 
+// Everything a bootstrap replicate needs that doesn't change between
+// replicates. It is built once and shared read-only by all the workers.
+struct BootstrapContext {
+  BootstrapContext(const std::vector<int>& true_counts,
+                   const KmerIndex& index,
+                   const MinCollector& tc,
+                   const std::vector<double>& mean_fls);
+
+  std::vector<double> eff_lens; // effective lengths used by the EM
+  WeightMap weights; // weights in the same orientation as the ec map
+  std::discrete_distribution<int>::param_type sampler; // multinomial table
+  size_t num_ecs;
+  int n; // number of draws per replicate
+  const EcTable& ecs; // of the run being bootstrapped
+};
+
 class Bootstrap {
     // needs:
-    // - "true" counts
+    // - the shared context
     // - ecmap
     // - target_names
-    // - eff_lens
 public:
-  Bootstrap(const std::vector<int>& true_counts,
+  Bootstrap(const BootstrapContext& ctx,
             const KmerIndex& index,
             const MinCollector& tc,
-            const std::vector<double>& eff_lens,
-            size_t seed,
             const std::vector<double>& mean_fls,
             const ProgramOptions& opt) :
-    index_(index),
-    tc_(tc),
-    eff_lens_(eff_lens),
-    seed_(seed),
-    mult_(true_counts, seed_),
-    mean_fls_(mean_fls),
-    opt(opt)
+    ctx_(ctx),
+    counts_(ctx.num_ecs, 0),
+    em_(counts_, index, tc, mean_fls, ctx.eff_lens, ctx.weights, opt)
     {}
 
-  // EM Algorithm generates a sample from the Multinomial, then returns
-  // an "EMAlgorithm" that has already run the EM as well as compute the
-        // rho values
-  EMAlgorithm run_em();
+  // generates a sample from the Multinomial using 'seed', then returns an
+  // "EMAlgorithm" that has already run the EM on it. The counts and the
+  // EMAlgorithm are scratch space owned by this object, so the result is only
+  // valid until the next call.
+  const EMAlgorithm& run_em(size_t seed);
+
+private:
+  const BootstrapContext& ctx_;
+  std::vector<int> counts_;
+  EMAlgorithm em_;
+};
+
+// Runs several bootstrap replicates side by side. The alphas and counts are
+// stored as small matrices with the replicates ("lanes") contiguous for each
+// target/EC, so every EM round streams the ec map and the weights once for all
+// the lanes instead of once per replicate. A lane that converges is handed the
+// next seed straight away, and every lane gives the same result as running
+// Bootstrap::run_em on its seed.
+class BatchBootstrap {
+public:
+  BatchBootstrap(const BootstrapContext& ctx,
+                 const KmerIndex& index,
+                 size_t n_lanes,
+                 size_t n_iter = 10000,
+                 size_t min_rounds = 50);
+
+  // next_seed(seed, id) returns false when there are no more replicates to
+  // run, done(alpha, id) is called with the estimates of every replicate
+  template <typename NextSeed, typename Done>
+  void run(NextSeed next_seed, Done done);
 
 private:
-  const KmerIndex& index_;
-  const MinCollector& tc_;
-  const std::vector<double>& eff_lens_;
-  size_t seed_;
-  Multinomial mult_;
-  const std::vector<double>& mean_fls_;
-  const ProgramOptions& opt;
+  void start_lane(size_t l, size_t seed);
+  void em_round();
+
+  const BootstrapContext& ctx_;
+  const EcTable& ecmap_;
+  const size_t L_; // number of lanes
+  const int num_trans_;
+  const size_t n_iter_;
+  const size_t min_rounds_;
+
+  std::vector<int> counts_; // ec x lane
+  std::vector<double> alpha_; // target x lane
+  std::vector<double> next_alpha_; // target x lane
+  std::vector<double> denom_; // per lane scratch
+  std::vector<double> count_norm_; // per lane scratch
+
+  std::vector<bool> active_;
+  std::vector<bool> final_round_;
+  std::vector<size_t> round_;
+  std::vector<int> chcount_;
+  std::vector<size_t> ids_;
+
+  std::vector<double> out_; // estimates of a finished lane
 };
 
+template <typename NextSeed, typename Done>
+void BatchBootstrap::run(NextSeed next_seed, Done done) {
+  size_t n_active = 0;
+  for (size_t l = 0; l < L_; ++l) {
+    size_t seed;
+    if (next_seed(seed, ids_[l])) {
+      start_lane(l, seed);
+      ++n_active;
+    }
+  }
+
+  const double alpha_limit = 1e-7;
+
+  while (n_active > 0) {
+    em_round();
+
+    for (size_t l = 0; l < L_; ++l) {
+      if (!active_[l]) {
+        continue;
+      }
+
+      // same stopping rule as EMAlgorithm::run, per lane
+      bool finished = final_round_[l];
+      if (!finished && chcount_[l] == 0 && round_[l] > min_rounds_) {
+        final_round_[l] = true;
+        for (int t = 0; t < num_trans_; ++t) {
+          if (alpha_[t*L_ + l] < alpha_limit/10.0) {
+            alpha_[t*L_ + l] = 0.0;
+          }
+        }
+      }
+      if (++round_[l] == n_iter_) {
+        finished = true;
+      }
+
+      if (finished) {
+        for (int t = 0; t < num_trans_; ++t) {
+          out_[t] = alpha_[t*L_ + l];
+        }
+        done(out_, ids_[l]);
+
+        size_t seed;
+        if (next_seed(seed, ids_[l])) {
+          start_lane(l, seed);
+        } else {
+          active_[l] = false;
+          for (size_t ec = 0; ec < ctx_.num_ecs; ++ec) {
+            counts_[ec*L_ + l] = 0;
+          }
+          --n_active;
+        }
+      }
+    }
+  }
+}
+
 class BootstrapThreadPool {
   friend class BootstrapWorker;
 
@@ -56,7 +163,7 @@ class BootstrapThreadPool {
     BootstrapThreadPool(
         size_t n_threads,
         std::vector<size_t> seeds,
-        const std::vector<int>& true_counts,
+        const BootstrapContext& ctx,
         const KmerIndex& index,
         const MinCollector& tc,
         const std::vector<double>& eff_lens,
@@ -69,6 +176,10 @@ class BootstrapThreadPool {
 
     ~BootstrapThreadPool();
   private:
+    // hands out the next replicate, returns false when there are none left
+    bool next_seed(size_t& seed, size_t& id);
+    void write(const std::vector<double>& alpha, size_t id);
+
     std::vector<size_t> seeds_;
     size_t n_threads_;
 
@@ -79,7 +190,7 @@ class BootstrapThreadPool {
     size_t n_complete_;
 
     // things to run bootstrap
-    const std::vector<int> true_counts_;
+    const BootstrapContext& ctx_;
     const KmerIndex& index_;
     const MinCollector& tc_;
     const std::vector<double>& eff_lens_;
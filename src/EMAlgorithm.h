@@ -4,6 +4,7 @@
 #include "common.h"
 #include "KmerIndex.h"
 #include "MinCollector.h"
+#include "RunStats.h"
 #include "weights.h"
 
 #include <algorithm>
@@ -19,7 +20,7 @@
 const double TOLERANCE = std::numeric_limits<double>::denorm_min();
 
 struct EMAlgorithm {
-  // ecmap is the ecmap from KmerIndex
+  // ecmap is the EcTable of the MinCollector
   // counts is vector from collector, with indices corresponding to ec ids
   // target_names is the target_names_ from collector
   // TODO: initialize alpha a bit more intelligently
@@ -31,7 +32,7 @@ struct EMAlgorithm {
     index_(index),
     tc_(tc),
     num_trans_(index.target_names_.size()),
-    ecmap_(index.ecmap),
+    ecmap_(tc.ecs),
     counts_(counts),
     target_names_(index.target_names_),
     post_bias_(4096,1.0),
@@ -47,12 +48,50 @@ struct EMAlgorithm {
     assert(target_names_.size() == eff_lens_.size());
   }
 
+  // construct from effective lengths and weights that have already been
+  // computed, e.g. shared read-only by every bootstrap replicate. weights
+  // must outlive this object. post_bias_ is left empty since the effective
+  // lengths can't be recomputed in this mode.
+  EMAlgorithm(const std::vector<int>& counts,
+              const KmerIndex& index,
+              const MinCollector& tc,
+              const std::vector<double>& all_means,
+              const std::vector<double>& eff_lens,
+              const WeightMap& weights,
+              const ProgramOptions& opt) :
+    index_(index),
+    tc_(tc),
+    num_trans_(index.target_names_.size()),
+    ecmap_(tc.ecs),
+    counts_(counts),
+    target_names_(index.target_names_),
+    eff_lens_(eff_lens),
+    shared_weights_(&weights),
+    alpha_(num_trans_, 1.0/num_trans_),
+    rho_(num_trans_, 0.0),
+    rho_set_(false),
+    all_fl_means(all_means),
+    opt(opt)
+  {
+    assert(target_names_.size() == eff_lens_.size());
+    assert(weights.size() == ecmap_.size());
+  }
+
   ~EMAlgorithm() {}
 
+  // restore the uniform starting point so the object can be run again after
+  // the counts it references have changed
+  void reset() {
+    std::fill(alpha_.begin(), alpha_.end(), 1.0/num_trans_);
+    std::fill(rho_.begin(), rho_.end(), 0.0);
+    rho_set_ = false;
+  }
+
   void run(size_t n_iter = 10000, size_t min_rounds=50, bool verbose = true, bool recomputeEffLen = true) {
     std::vector<double> next_alpha(alpha_.size(), 0.0);
 
-    assert(weight_map_.size() <= counts_.size());
+    assert(shared_weights_ == nullptr || !recomputeEffLen);
+    assert(weights().size() <= counts_.size());
 
     double denom;
     const double alpha_limit = 1e-7;
@@ -67,9 +106,15 @@ struct EMAlgorithm {
     int i;
     for (i = 0; i < n_iter; ++i) {
       if (recomputeEffLen && (i == min_rounds || i == min_rounds + 500)) {
-        eff_lens_ = update_eff_lens(all_fl_means, tc_, index_, alpha_, eff_lens_, post_bias_, opt);
+        double t = wallSeconds();
+        eff_lens_ = update_eff_lens(all_fl_means, tc_, index_, alpha_, eff_lens_, post_bias_, bias_hist_, opt);
         weight_map_ = calc_weights (tc_.counts, ecmap_, eff_lens_);
+        eff_len_seconds_ += wallSeconds() - t;
+        if (i == min_rounds + 500) {
+          bias_hist_.clear(); // last update
+        }
       }
+      const WeightMap& weight_map = weights();
 
 
       //for (auto& ec_kv : ecmap_ ) {
@@ -87,7 +132,7 @@ struct EMAlgorithm {
 
         // first, compute the denominator: a normalizer
         // iterate over targets in EC map
-        auto& wv = weight_map_[ec];
+        auto& wv = weight_map[ec];
 
         // everything in ecmap should be in weight_map
         //assert( w_search != weight_map_.end() );
@@ -169,6 +214,8 @@ struct EMAlgorithm {
 
     }
 
+    rounds_ = i;
+
     // ran for the maximum number of iterations
     if (n_iter == i) {
       alpha_before_zeroes_.resize( alpha_.size() );
@@ -276,20 +323,28 @@ struct EMAlgorithm {
   }
 
 
+  const WeightMap& weights() const {
+    return (shared_weights_ != nullptr) ? *shared_weights_ : weight_map_;
+  }
+
   int num_trans_;
   const KmerIndex& index_;
   const MinCollector& tc_;
-  const EcMap& ecmap_;
+  const EcTable& ecmap_;
   const std::vector<int>& counts_;
   const std::vector<std::string>& target_names_;
   const std::vector<double>& all_fl_means;
   std::vector<double> eff_lens_;
   std::vector<double> post_bias_;
+  HexamerHistograms bias_hist_;
   WeightMap weight_map_;
+  const WeightMap* shared_weights_ = nullptr; // if set, used instead of weight_map_
   std::vector<double> alpha_;
   std::vector<double> alpha_before_zeroes_;
   std::vector<double> rho_;
   bool rho_set_;
+  size_t rounds_ = 0; // of the last run
+  double eff_len_seconds_ = 0.0; // spent updating the effective lengths for the bias
   const ProgramOptions& opt;
 };
 
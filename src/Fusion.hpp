@@ -1,5 +1,9 @@
-#include <sstream>
-#include <set>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "NumberFormat.h"
 
 /** -- fusion functions -- **/
 
@@ -24,10 +28,34 @@ split within the read.
 POS1 and POS2 are comma separated lists of locations of SEQ1 and SEQ2 respectively. Each position is of
 the form (tx_name,pos,strand) where pos is 0-based from the start of the transcript tx_name and strand
 is either FW or RE depending on whether the read aligns to the forward or reverse of the transcript.
+
+Candidates are also collapsed by (NAME1, NAME2, TYPE), over every pair of transcripts from POS1
+and POS2, into OUT_DIR/fusion_summary.txt with the columns
+TYPE  NAME1  NAME2  COUNT  POS1  POS2
+COUNT is the number of supporting reads, POS1 and POS2 are histograms of the positions of the
+supporting reads on NAME1 and NAME2, as pos:count separated by ';'. The breakpoint lies between
+(PAIR) or at the split of (SPLIT) those positions.
+
+With --fusion-dump=binary the per-read candidates are written to OUT_DIR/fusion.bin instead of
+fusion.txt. All integers are little endian:
+  "KFUS", uint32 version (1), uint32 number of targets, then for each target
+  uint32 name length and the name
+followed by one record per candidate
+  uint64 read  (0-based number of the read pair in the input)
+  uint8  type  (0 PAIR, 1 SPLIT)
+  uint8  split read (0 or 1, 255 for PAIR), uint16 split position
+  int32  KPOS1 (2 values), int32 KPOS2 (2 values)
+  uint32 n1, uint32 n2, then n1 + n2 times: int32 target, int32 pos, uint8 strand (1 FW, 0 RC)
 **/
 
-void printTranscripts(const KmerIndex& index, std::stringstream& o, const std::string s,
-  const std::vector<std::pair<KmerEntry,int>>& v, const std::vector<int> u) {
+static void appendInt(std::string& o, int x) {
+  char buf[FORMAT_MAX_CHARS];
+  o.append(buf, format_int(buf, x) - buf);
+}
+
+// position and strand of the read on each target in u
+void fusionTargets(const KmerIndex& index, const char *s,
+  const std::vector<std::pair<KmerEntry,int>>& v, const std::vector<int>& u, std::vector<FusionTarget>& t) {
 
   Kmer km;
   KmerEntry val;
@@ -36,46 +64,199 @@ void printTranscripts(const KmerIndex& index, std::stringstream& o, const std::s
   // find first mapping k-mer
   if (!v.empty()) {
     p = findFirstMappingKmer(v,val);
-    km = Kmer((s.c_str()+p));
+    km = Kmer((s+p));
   }
   
 
+  t.clear();
   for (int i = 0; i < u.size(); i++) {
     int tr = u[i];
+    std::pair<int, bool> xp = index.findPosition(tr, km, val, p);
+    t.push_back({tr, xp.first, xp.second});
+  }
+}
+
+void printTranscripts(const KmerIndex& index, std::string& o, const std::vector<FusionTarget>& t) {
+  for (int i = 0; i < t.size(); i++) {
     if (i > 0) {
-      o << ";";
+      o += ';';
     }
-    std::pair<int, bool> xp = index.findPosition(tr, km, val, p);
-    o << "(" << index.target_names_[tr] << "," << xp.first << ",";
-    if (xp.second) {
-      o << "FW)";
+    o += '(';
+    o += index.target_names_[t[i].tr];
+    o += ',';
+    appendInt(o, t[i].pos);
+    o += ',';
+    if (t[i].fw) {
+      o += "FW)";
     } else {
-      o << "RC)";
+      o += "RC)";
+    }
+  }
+}
+
+template <typename T>
+static void appendBinary(std::string& o, T x) {
+  o.append((const char*) &x, sizeof(x));
+}
+
+// writes one candidate to the per-read dump and adds it to the summary table,
+// splitRead is -1 for PAIR
+void emitFusion(const KmerIndex& index, const ProgramOptions& opt, FusionOutput& out, uint64_t read,
+  const char *n1, const char *s1, const std::pair<int,int>& p1,
+  const char *n2, const char *s2, const std::pair<int,int>& p2, bool paired,
+  int splitRead, int splitPos, const std::vector<FusionTarget>& t1, const std::vector<FusionTarget>& t2) {
+
+  bool split = (splitRead >= 0);
+  std::string& o = out.dump;
+  if (opt.fusion_dump == "text") {
+    o += split ? "SPLIT\t" : "PAIR\t";
+    o += n1; o += '\t';
+    o += s1; o += '\t';
+    appendInt(o, p1.first); o += ','; appendInt(o, p1.second); o += '\t';
+    if (paired) {
+      o += n2; o += '\t';
+      o += s2; o += '\t';
+      appendInt(o, p2.first); o += ','; appendInt(o, p2.second); o += split ? "\t" : "\t\tNA\t";
+    } else {
+      o += split ? "\t\t\t" : "\t\t\tNA\t";
+    }
+    if (split) {
+      o += "splitat=(";
+      appendInt(o, splitRead); o += ',';
+      appendInt(o, splitPos); o += ")\t";
+    }
+    printTranscripts(index, o, t1); o += '\t'; printTranscripts(index, o, t2);
+    o += '\n';
+  } else if (opt.fusion_dump == "binary") {
+    appendBinary<uint64_t>(o, read);
+    appendBinary<uint8_t>(o, split ? 1 : 0);
+    appendBinary<uint8_t>(o, split ? splitRead : 255);
+    appendBinary<uint16_t>(o, split ? splitPos : 0);
+    for (int x : {p1.first, p1.second, p2.first, p2.second}) {
+      appendBinary<int32_t>(o, x);
     }
+    appendBinary<uint32_t>(o, t1.size());
+    appendBinary<uint32_t>(o, t2.size());
+    for (const auto* t : {&t1, &t2}) {
+      for (const auto& x : *t) {
+        appendBinary<int32_t>(o, x.tr);
+        appendBinary<int32_t>(o, x.pos);
+        appendBinary<uint8_t>(o, x.fw ? 1 : 0);
+      }
+    }
+  }
+
+  // which mate came first means nothing for PAIR, so A B and B A count as
+  // one candidate with the lower target id first. For SPLIT the order is
+  // the order along the read.
+  for (const auto& a : t1) {
+    for (const auto& b : t2) {
+      bool swap = !split && b.tr < a.tr;
+      const auto& x = swap ? b : a;
+      const auto& y = swap ? a : b;
+      auto& st = out.table[std::make_tuple(x.tr, y.tr, split ? 1 : 0)];
+      ++st.count;
+      ++st.pos1[x.pos];
+      ++st.pos2[y.pos];
+    }
+  }
+}
+
+// the header of fusion.txt or fusion.bin
+void writeFusionHeader(const KmerIndex& index, const ProgramOptions& opt, std::ofstream& of) {
+  if (opt.fusion_dump == "text") {
+    of << "TYPE\tNAME1\tSEQ1\tKPOS1\tNAME2\tSEQ2\tKPOS2\tINFO\tPOS1\tPOS2\n";
+  } else if (opt.fusion_dump == "binary") {
+    std::string h = "KFUS";
+    appendBinary<uint32_t>(h, 1);
+    appendBinary<uint32_t>(h, index.num_trans);
+    for (int i = 0; i < index.num_trans; i++) {
+      appendBinary<uint32_t>(h, index.target_names_[i].size());
+      h += index.target_names_[i];
+    }
+    of.write(h.data(), h.size());
+  }
+}
+
+void writeFusionSummary(const KmerIndex& index, const std::string& fname, const FusionTable& table) {
+  std::vector<FusionTable::const_iterator> order;
+  for (auto it = table.begin(); it != table.end(); ++it) {
+    order.push_back(it);
+  }
+  // most supported first, ties in table order
+  std::stable_sort(order.begin(), order.end(), [](FusionTable::const_iterator a, FusionTable::const_iterator b) {
+    return a->second.count > b->second.count;
+  });
+
+  BufferedWriter of;
+  if (!of.open(fname)) {
+    std::cerr << "Error: Couldn't open file: " << fname << std::endl;
+    exit(1);
+  }
+  of << "TYPE\tNAME1\tNAME2\tCOUNT\tPOS1\tPOS2\n";
+  auto hist = [&](const std::map<int,int>& h) {
+    bool first = true;
+    for (const auto& x : h) {
+      if (!first) {
+        of << ';';
+      }
+      first = false;
+      of << x.first << ':' << x.second;
+    }
+  };
+  for (auto it : order) {
+    of << (std::get<2>(it->first) ? "SPLIT" : "PAIR") << '\t'
+       << index.target_names_[std::get<0>(it->first)] << '\t'
+       << index.target_names_[std::get<1>(it->first)] << '\t'
+       << it->second.count << '\t';
+    hist(it->second.pos1);
+    of << '\t';
+    hist(it->second.pos2);
+    of << '\n';
   }
+  of.close();
 }
 
-std::vector<int> simpleIntersect(const KmerIndex& index, const std::vector<std::pair<KmerEntry,int>>& v) {
+// u is set to the intersection of the ecs of the k-mers in v, computed in place
+void simpleIntersect(const KmerIndex& index, const std::vector<std::pair<KmerEntry,int>>& v, std::vector<int>& u) {
+  u.clear();
   if (v.empty()) {
-    return {};
+    return;
   }
   int ec = index.dbGraph.ecs[v[0].first.contig];
   int lastEC = ec;
-  std::vector<int> u = index.ecmap[ec];
+  u.assign(index.ecmap[ec].begin(), index.ecmap[ec].end());
 
   for (int i = 1; i < v.size(); i++) {
     if (v[i].first.contig != v[i-1].first.contig) {
       ec = index.dbGraph.ecs[v[i].first.contig];
       if (ec != lastEC) {
-        u = index.intersect(ec, u);
+        if (ec < 0 || ec >= index.ecmap.size()) {
+          u.clear();
+          return;
+        }
+        const auto& w = index.ecmap[ec];
+        auto b = w.begin();
+        size_t n = 0;
+        for (size_t a = 0; a < u.size() && b != w.end(); ) {
+          if (u[a] < *b) {
+            ++a;
+          } else if (*b < u[a]) {
+            ++b;
+          } else {
+            u[n++] = u[a];
+            ++a;
+            ++b;
+          }
+        }
+        u.resize(n);
         lastEC = ec;
         if (u.empty()) {
-          return u;
+          return;
         }
       }
     }
   }
-  return u;
 }
 
 
@@ -95,6 +276,7 @@ bool checkMapability(const KmerIndex& index, const std::string &s, const std::ve
   }
   
   std::vector<int> vtmp; vtmp.reserve(u.size());
+  std::string rs; // reverse complement, made once on first use
   
   for (auto tr : u) {
     auto trpos = index.findPosition(tr, km, val, p);
@@ -122,12 +304,14 @@ bool checkMapability(const KmerIndex& index, const std::string &s, const std::ve
       if (tpos > index.target_seqs_[tr].size() || tpos - sz < 1) {
         add = false;
       } else {      
-        std::string rs = revcomp(s);
+        if (rs.empty()) {
+          rs = revcomp(s);
+        }
         //std::cout << index.target_seqs_[tr].substr(tpos - sz, sz) << std::endl;
         //std::cout << rs << std::endl;
         int mis = 0;
         for (int i = sz-1; i >= maxSoftclip; i--) {
-          if (index.target_seqs_[tr][tpos-sz+i] != rs[sz]) {
+          if (index.target_seqs_[tr][tpos-sz+i] != rs[i]) {
             ++mis;
             if (mis > maxMismatch) {
               break;
@@ -157,68 +341,68 @@ bool checkMapability(const KmerIndex& index, const std::string &s, const std::ve
   
 }
 
-// returns true if the intersection of the union of EC classes for v1 and v2 respectively is empty
-bool checkUnionIntersection(const KmerIndex& index, const std::string &s1, const std::string &s2, std::pair<int,int> &p1, std::pair<int,int> &p2) { 
-//const std::vector<std::pair<KmerEntry,int>>& v1, const std::vector<std::pair<KmerEntry,int>>& v2) {
-  
-  std::set<int> su1,su2;
-  
-  auto union_set = [&](const std::string &s, std::pair<int,int> &p) {
-    p = {-1,-1};
-    std::set<int> su;
-    
-    KmerIterator kit(s.c_str()), kit_end;
-    int lastEC = -1;
-    for (int i = 0; kit != kit_end; ++i,++kit) {
-      auto search = index.kmap.find(kit->first.rep());
-      if (search != index.kmap.end()) {
-        if (p.first == -1) {
-          p.first = kit->second;
-          p.second = p.first +1;
-        } else {
-          if (p.second + 1 == kit->second) {
-            p.second++;
-          }
-        }
-        const KmerEntry &val = search->second;
-        int ec = index.dbGraph.ecs[val.contig];
-        if (ec != -1 && ec != lastEC) {
-          su.insert(index.ecmap[ec].begin(), index.ecmap[ec].end());
-          lastEC = ec;
-        }
-      }
+// every k-mer of s found in the index as (read position, ec). match skips
+// along contigs, the union test below needs all of them, so the read is
+// looked up once and the list reused for every split point.
+void fusionKmerHits(const KmerIndex& index, const char *s, std::vector<std::pair<int,int>>& hits) {
+  hits.clear();
+  KmerIterator kit(s), kit_end;
+  for (; kit != kit_end; ++kit) {
+    auto search = index.kmap.find(kit->first.rep());
+    if (search != index.kmap.end()) {
+      hits.push_back({kit->second, index.dbGraph.ecs[search->second.contig]});
     }
-    
-    /*
-    int ec = index.dbGraph.ecs[v[0].first.contig];
-    int lastEC = ec;
-    //const std::vector<int> &u = index.ecmap[ec];
-    s.insert(index.ecmap[ec].begin(), index.ecmap[ec].end());
-    for (int i = 1; i < v.size(); i++) {
-      if (v[i].first.contig != v[i-1].first.contig) {
-        ec = index.dbGraph.ecs[v[i].first.contig];
-        if (ec != lastEC) {
-          s.insert(index.ecmap[ec].begin(), index.ecmap[ec].end());
-          lastEC = ec;
-        }
+  }
+}
+
+// the union of the ecs of the hits that start before maxpos, sorted and
+// unique in su. p is the first hit position and the end of the run of
+// consecutive hits after it.
+void unionKmerHits(const KmerIndex& index, const std::vector<std::pair<int,int>>& hits, int maxpos,
+  std::vector<int>& su, std::pair<int,int>& p) {
+  p = {-1,-1};
+  su.clear();
+  int lastEC = -1;
+  for (const auto& h : hits) {
+    if (h.first > maxpos) {
+      break;
+    }
+    if (p.first == -1) {
+      p.first = h.first;
+      p.second = p.first +1;
+    } else {
+      if (p.second + 1 == h.first) {
+        p.second++;
       }
     }
-    */
-    return su;
-  };
+    int ec = h.second;
+    if (ec != -1 && ec != lastEC) {
+      su.insert(su.end(), index.ecmap[ec].begin(), index.ecmap[ec].end());
+      lastEC = ec;
+    }
+  }
+  std::sort(su.begin(), su.end());
+  su.erase(std::unique(su.begin(), su.end()), su.end());
+}
 
-  su1 = union_set(s1,p1);
-  su2 = union_set(s2,p2);
+// returns true if the intersection of the union of EC classes for the reads is empty,
+// only k-mers starting at or before maxpos1 and maxpos2 are used
+bool checkUnionIntersection(const KmerIndex& index, FusionScratch& fs, int maxpos1, int maxpos2, std::pair<int,int> &p1, std::pair<int,int> &p2) { 
+  unionKmerHits(index, fs.hits1, maxpos1, fs.su1, p1);
+  unionKmerHits(index, fs.hits2, maxpos2, fs.su2, p2);
   
-  if (su1.empty() || su2.empty()) {
+  if (fs.su1.empty() || fs.su2.empty()) {
     return false; // TODO, decide on this
   }
   
-  if (su2.size() < su1.size()) {
-    swap(su1,su2);
-  }
-  for (auto x : su1) {
-    if (su2.count(x) != 0) {
+  auto a = fs.su1.begin();
+  auto b = fs.su2.begin();
+  while (a != fs.su1.end() && b != fs.su2.end()) {
+    if (*a < *b) {
+      ++a;
+    } else if (*b < *a) {
+      ++b;
+    } else {
       return false;
     }
   }
@@ -228,44 +412,40 @@ bool checkUnionIntersection(const KmerIndex& index, const std::string &s1, const
 
 void searchFusion(const KmerIndex &index, const ProgramOptions& opt,
   const MinCollector& tc, MasterProcessor& mp, int ec,
-  const std::string &n1, const std::string &s1, std::vector<std::pair<KmerEntry,int>> &v1,
-  const std::string &n2, const std::string &s2, std::vector<std::pair<KmerEntry,int>> &v2, bool paired) {
+  const char *n1, const char *s1, std::vector<std::pair<KmerEntry,int>> &v1,
+  const char *n2, const char *s2, std::vector<std::pair<KmerEntry,int>> &v2, bool paired,
+  FusionScratch& fs, FusionOutput& out, uint64_t read) {
 
   bool partialMap = false;
   if (ec != -1) {
     partialMap = true;
   }
-  std::stringstream o;
   
   // no mapping information
   if (v1.empty() && v2.empty()) {
     return; // consider splitting in case either is empty
   }
 
-
-  auto u1 = simpleIntersect(index, v1);
-  auto u2 = simpleIntersect(index, v2);
+  const int k = Kmer::k;
+  const int nopos = std::numeric_limits<int>::max();
+  auto& u1 = fs.u1;
+  auto& u2 = fs.u2;
+  simpleIntersect(index, v1, u1);
+  simpleIntersect(index, v2, u2);
+  bool walked = false; // hits1 and hits2 are filled in
 
   // discordant pairs
   if (!v1.empty() && !v2.empty()) {
     if (!u1.empty() && !u2.empty()) {
       std::pair<int,int> p1,p2;
-      if (checkUnionIntersection(index, s1, s2, p1, p2)) {
+      fusionKmerHits(index, s1, fs.hits1);
+      fusionKmerHits(index, s2, fs.hits2);
+      walked = true;
+      if (checkUnionIntersection(index, fs, nopos, nopos, p1, p2)) {
         // each pair maps to either end
-        // each pair maps to either end
-        o << "PAIR\t";
-        o << n1 << "\t";
-        o << s1 << "\t";
-        o << p1.first << "," << p1.second << "\t"; 
-        if (paired) {
-          o << n2 << "\t";
-          o << s2 << "\t";
-          o << p2.first << "," << p2.second << "\t\tNA\t";
-        } else {
-          o << "\t\t\tNA\t";
-        }
-        printTranscripts(index, o, s1, v1, u1); o << "\t"; printTranscripts(index, o, s2, v2, u2);
-        mp.outputFusion(o);
+        fusionTargets(index, s1, v1, u1, fs.t1);
+        fusionTargets(index, s2, v2, u2, fs.t2);
+        emitFusion(index, opt, out, read, n1, s1, p1, n2, s2, p2, paired, -1, 0, fs.t1, fs.t2);
         return;
       }
     }
@@ -279,7 +459,10 @@ void searchFusion(const KmerIndex &index, const ProgramOptions& opt,
 
   // ok so ec == -1 and not both v1 and v2 are empty
   // exactly one of u1 and u2 are empty
-  std::vector<std::pair<KmerEntry,int>> vsafe, vsplit;
+  auto& vsafe = fs.vsafe;
+  auto& vsplit = fs.vsplit;
+  vsafe.clear();
+  vsplit.clear();
   // sort v1 and v2 by read position
   auto vsorter =  [&](std::pair<KmerEntry, int> a, std::pair<KmerEntry, int> b) {
     return a.second < b.second;
@@ -315,48 +498,37 @@ void searchFusion(const KmerIndex &index, const ProgramOptions& opt,
 
 
   // now we look for a split j s.t. vsplit[0:j] and vsplit[j:] + vsafe both have nonempty ec
+  auto& ut1 = fs.ut1;
+  auto& ut2 = fs.ut2;
   int j = vsplit.size()-1;
   while (!vsplit.empty()) {
     auto x = vsplit.back();
     vsplit.pop_back();
     vsafe.push_back(x);
 
-    auto ut1 = simpleIntersect(index,vsplit);
-    auto ut2 = simpleIntersect(index,vsafe);
+    simpleIntersect(index,vsplit,ut1);
+    simpleIntersect(index,vsafe,ut2);
 
     if (!ut1.empty() && !ut2.empty()) {
       std::pair<int,int> p1,p2;
-      std::string st1,st2;
-      if (u1.empty()) {
-        st1 = s1.substr(0,vsafe.back().second);
-        st2 = s2;
-      } else {
-        st1 = s1;
-        st2 = s2.substr(0,vsafe.back().second);
+      if (!walked) {
+        fusionKmerHits(index, s1, fs.hits1);
+        fusionKmerHits(index, s2, fs.hits2);
+        walked = true;
       }
-      if (checkUnionIntersection(index, st1, st2, p1, p2)) { // need to check this more carefully
-        o << "SPLIT\t";
-        o << n1 << "\t" << s1 << "\t" << p1.first << "," << p1.second << "\t";
-        // what to put as info?
-        if (paired) {
-          o << n2 << "\t" << s2 << "\t" << p2.first << "," << p2.second << "\t";
-        } else {
-          o << "\t\t\t";
-        }
-        o << "splitat=";
-        if (u1.empty()) {
-          o << "(0,";
-        } else {
-          o << "(1,";
-        }
-        o << vsafe.back().second << ")\t";
+      // the split read is cut before the split point
+      int cut = vsafe.back().second - k;
+      if (checkUnionIntersection(index, fs, u1.empty() ? cut : nopos, u1.empty() ? nopos : cut, p1, p2)) { // need to check this more carefully
         // fix this
         if (split1) {
-          printTranscripts(index, o, s1, vsplit, ut1); o << "\t"; printTranscripts(index, o, s2, vsafe, ut2);
+          fusionTargets(index, s1, vsplit, ut1, fs.t1);
+          fusionTargets(index, s2, vsafe, ut2, fs.t2);
         } else {
-          printTranscripts(index, o, s1, vsafe, ut2); o << "\t"; printTranscripts(index, o, s2, vsplit, ut1);
+          fusionTargets(index, s1, vsafe, ut2, fs.t1);
+          fusionTargets(index, s2, vsplit, ut1, fs.t2);
         }
-        mp.outputFusion(o);
+        emitFusion(index, opt, out, read, n1, s1, p1, n2, s2, p2, paired,
+          u1.empty() ? 0 : 1, vsafe.back().second, fs.t1, fs.t2);
         return;
       }
     } else {
@@ -1,13 +1,56 @@
 #include "H5Writer.h"
+#include "NumberFormat.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// the HDF5 library isn't built thread-safe, runs sharing a process (kallisto
+// serve) each have their own H5Writer so the calls are serialized here
+static std::mutex h5_writer_lock;
+
+// memory for the rows of the bootstrap matrices h5dump holds at once, as
+// est_counts and tpm of every bootstrap
+static const size_t BS_MATRIX_MEMORY = 256 << 20;
+
+// blocks until all n threads have called wait, the last one to arrive runs
+// done before letting the others go
+class Barrier {
+  public:
+    explicit Barrier(int n) : n_(n), waiting_(0), generation_(0) {}
+
+    template <typename F>
+    void wait(F done) {
+      std::unique_lock<std::mutex> lock(lock_);
+      int generation = generation_;
+      if (++waiting_ == n_) {
+        done();
+        waiting_ = 0;
+        ++generation_;
+        cv_.notify_all();
+      } else {
+        cv_.wait(lock, [&] { return generation != generation_; });
+      }
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    int n_, waiting_, generation_;
+};
 
 void H5Writer::init(const std::string& fname, int num_bootstrap, int num_processed,
   const std::vector<int>& fld,const std::vector<int>& preBias, const std::vector<double>& postBias,
   uint compression, size_t index_version,
-  const std::string& shell_call, const std::string& start_time)
+  const std::string& shell_call, const std::string& start_time,
+  bool bootstrap_matrix)
 {
+  std::lock_guard<std::mutex> lock(h5_writer_lock);
   primed_ = true;
   num_bootstrap_ = num_bootstrap;
   compression_ = compression;
+  bootstrap_matrix_ = bootstrap_matrix && num_bootstrap > 0;
   file_id_ = H5Fcreate(fname.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
   root_ = H5Gopen(file_id_, "/", H5P_DEFAULT);
   aux_ = H5Gcreate(file_id_, "/aux", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
@@ -44,6 +87,10 @@ H5Writer::~H5Writer() {
   if (!primed_) {
     return;
   }
+  std::lock_guard<std::mutex> lock(h5_writer_lock);
+  if (bootstrap_matrix_) {
+    H5Dclose(bs_matrix_);
+  }
   if (num_bootstrap_ > 0) {
     H5Gclose(bs_);
   }
@@ -55,16 +102,45 @@ H5Writer::~H5Writer() {
 void H5Writer::write_main(const EMAlgorithm& em,
     const std::vector<std::string>& targ_ids,
     const std::vector<int>& lengths) {
+  std::lock_guard<std::mutex> lock(h5_writer_lock);
   vector_to_h5(em.alpha_, root_, "est_counts", false, compression_);
 
   vector_to_h5(targ_ids, aux_, "ids", true, compression_);
   vector_to_h5(em.eff_lens_, aux_, "eff_lengths", false, compression_);
   vector_to_h5(lengths, aux_, "lengths", false, compression_);
+
+  if (bootstrap_matrix_) {
+    bs_matrix_ = create_chunked_dataset(bs_, "matrix", num_bootstrap_,
+        em.alpha_.size(), compression_);
+  }
 }
 
 void H5Writer::write_bootstrap(const EMAlgorithm& em, int bs_id) {
+  write_bootstrap(em.alpha_, bs_id);
+}
+
+void H5Writer::write_bootstrap(const std::vector<double>& alpha, int bs_id) {
+  H5Chunk chunk;
+  compress_bootstrap(alpha, chunk);
+  write_bootstrap(chunk, bs_id);
+}
+
+void H5Writer::compress_bootstrap(const std::vector<double>& alpha, H5Chunk& chunk) const {
+  deflate_chunk(alpha, compression_, chunk);
+}
+
+void H5Writer::write_bootstrap(const H5Chunk& chunk, int bs_id) {
+  std::lock_guard<std::mutex> lock(h5_writer_lock);
+  if (bootstrap_matrix_) {
+    write_chunk(bs_matrix_, bs_id, chunk);
+    return;
+  }
+
   std::string bs_id_str("bs" + std::to_string( bs_id ));
-  vector_to_h5(em.alpha_, bs_, bs_id_str.c_str(), false, compression_);
+  hid_t dataset_id = create_chunked_dataset(bs_, bs_id_str, 0, chunk.n,
+      compression_);
+  write_chunk(dataset_id, 0, chunk);
+  H5Dclose(dataset_id);
 }
 
 /**********************************************************************/
@@ -103,8 +179,12 @@ H5Converter::H5Converter(const std::string& h5_fname, const std::string& out_dir
 
   std::cerr << "[h5dump] number of bootstraps: " << n_bs_ << std::endl;
   // </aux info>
+  bs_matrix_ = -1;
   if (n_bs_ > 0) {
     bs_ = H5Gopen(file_id_, "/bootstrap", H5P_DEFAULT);
+    if (H5Lexists(bs_, "matrix", H5P_DEFAULT) > 0) {
+      bs_matrix_ = H5Dopen(bs_, "matrix", H5P_DEFAULT);
+    }
   }
 
   std::vector<std::string> tmp;
@@ -136,6 +216,9 @@ H5Converter::H5Converter(const std::string& h5_fname, const std::string& out_dir
 }
 
 H5Converter::~H5Converter() {
+  if (bs_matrix_ >= 0) {
+    H5Dclose(bs_matrix_);
+  }
   if (n_bs_ > 0) {
     H5Gclose(bs_);
   }
@@ -159,27 +242,202 @@ void H5Converter::write_aux() {
       );
 }
 
-void H5Converter::convert() {
+void H5Converter::convert(int n_threads, bool bs_matrix) {
 
   std::cerr << "[h5dump] writing abundance file: " << out_dir_ << "/abundance.tsv" << std::endl;
   rw_from_counts(root_, "est_counts", out_dir_ + "/abundance.tsv");
 
-  if (n_bs_ > 0) {
-    std::cerr << "[h5dump] writing bootstrap abundance files: " << out_dir_ << "/bs_abundance_*.tsv" << std::endl;
+  if (n_bs_ <= 0) {
+    return;
+  }
+
+  if (bs_matrix) {
+    std::cerr << "[h5dump] writing bootstrap matrices: " << out_dir_ << "/bs_est_counts.tsv, "
+      << out_dir_ << "/bs_tpm.tsv" << std::endl;
+    write_matrices(n_threads);
+    return;
   }
-  int i;
-  for (i = 0; i < n_bs_; ++i) {
-    if (i % 50 == 0 && i > 0) {
-      std::cerr << std::endl;
+
+  std::cerr << "[h5dump] writing bootstrap abundance files: " << out_dir_ << "/bs_abundance_*.tsv" << std::endl;
+
+  std::atomic<int> next_bs(0);
+  std::mutex progress_lock;
+  int n_done = 0;
+
+  auto worker = [&]() {
+    // per-thread buffers
+    H5Chunk chunk;
+    std::vector<double> alpha;
+
+    int i;
+    while ((i = next_bs++) < n_bs_) {
+      read_bootstrap(i, chunk, alpha);
+
+      std::string bs_out_fname( out_dir_ + "/bs_abundance_" + std::to_string(i) +
+          ".tsv" );
+      plaintext_writer(bs_out_fname, targ_ids_, alpha, eff_lengths_, lengths_);
+
+      std::lock_guard<std::mutex> lock(progress_lock);
+      if (n_done % 50 == 0 && n_done > 0) {
+        std::cerr << std::endl;
+      }
+      ++n_done;
+      std::cerr << ".";
+      std::cerr.flush();
+    }
+  };
+
+  n_threads = std::max(1, std::min(n_threads, n_bs_));
+  std::vector<std::thread> workers;
+  for (int t = 1; t < n_threads; ++t) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  if (n_done-1 % 50 != 0 && n_done > 0) {
+    std::cerr << std::endl;
+  }
+}
+
+void H5Converter::read_bootstrap(int i, H5Chunk& chunk, std::vector<double>& alpha) {
+  bool raw = false;
+  {
+    std::lock_guard<std::mutex> lock(h5_lock_);
+    if (bs_matrix_ >= 0) {
+      raw = read_raw_chunk(bs_matrix_, i, chunk);
+      if (!raw) {
+        read_row(bs_matrix_, i, alpha);
+      }
+    } else {
+      std::string name("bs" + std::to_string(i));
+      hid_t dataset_id = H5Dopen(bs_, name.c_str(), H5P_DEFAULT);
+      raw = read_raw_chunk(dataset_id, 0, chunk);
+      H5Dclose(dataset_id);
+      if (!raw) {
+        alpha.clear();
+        read_dataset(bs_, name, alpha);
+      }
+    }
+  }
+
+  if (raw && !inflate_chunk(chunk, alpha)) {
+    std::cerr << "Error: could not decompress bootstrap " << i << std::endl;
+    exit(1);
+  }
+  assert( alpha.size() == n_targs_ );
+}
+
+void H5Converter::write_matrices(int n_threads) {
+  BufferedWriter counts_of(out_dir_ + "/bs_est_counts.tsv");
+  BufferedWriter tpm_of(out_dir_ + "/bs_tpm.tsv");
+  for (auto* of : {&counts_of, &tpm_of}) {
+    if (!of->is_open()) {
+      std::cerr << "Error: Couldn't open file: " << (of == &counts_of ? "bs_est_counts.tsv" : "bs_tpm.tsv")
+        << " in " << out_dir_ << std::endl;
+      exit(1);
+    }
+    *of << "target_id";
+    for (int j = 0; j < n_bs_; ++j) {
+      *of << "\tbs" << j;
     }
-    std::cerr << ".";
-    std::cerr.flush();
-    std::string bs_out_fname( out_dir_ + "/bs_abundance_" + std::to_string(i) +
-        ".tsv" );
-    rw_from_counts(bs_, "bs" + std::to_string(i), bs_out_fname);
+    *of << '\n';
+  }
+
+  // rows are targets and every row needs all the bootstraps, so each pass
+  // reads every bootstrap and keeps the rows [lo, hi) of it. With the whole
+  // matrix under BS_MATRIX_MEMORY that is a single pass.
+  size_t rows = std::max<size_t>(1, BS_MATRIX_MEMORY / (2 * sizeof(double) * n_bs_));
+  size_t n_passes = (n_targs_ + rows - 1) / rows;
+  if (n_passes > 1) {
+    std::cerr << "[h5dump] reading the bootstraps " << n_passes << " times, "
+      << rows << " targets at a time" << std::endl;
+  }
+  std::vector<std::vector<double>> counts(n_bs_), tpm(n_bs_);
+
+  n_threads = std::max(1, std::min(n_threads, n_bs_));
+  Barrier barrier(n_threads);
+  std::atomic<int> next_bs(0);
+  std::atomic<size_t> next_block(0);
+  std::mutex write_lock; // also guards n_done
+  std::condition_variable write_cv;
+  size_t next_write = 0;
+  int n_done = 0;
+  const size_t block = 1024;
+
+  auto worker = [&]() {
+    H5Chunk chunk;
+    std::vector<double> alpha;
+    std::string counts_buf, tpm_buf;
+    char num[FORMAT_MAX_CHARS];
+
+    for (size_t pass = 0; pass < n_passes; ++pass) {
+      size_t lo = pass * rows;
+      size_t hi = std::min(n_targs_, lo + rows);
+
+      int i;
+      while ((i = next_bs++) < n_bs_) {
+        read_bootstrap(i, chunk, alpha);
+        std::vector<double> t = counts_to_tpm(alpha, eff_lengths_);
+        counts[i].assign(alpha.begin() + lo, alpha.begin() + hi);
+        tpm[i].assign(t.begin() + lo, t.begin() + hi);
+        if (pass == 0) {
+          std::lock_guard<std::mutex> lock(write_lock);
+          if (n_done % 50 == 0 && n_done > 0) {
+            std::cerr << std::endl;
+          }
+          ++n_done;
+          std::cerr << ".";
+          std::cerr.flush();
+        }
+      }
+      barrier.wait([&] { next_bs = 0; });
+
+      // format blocks of rows in parallel, written out in order
+      size_t b;
+      while ((b = next_block++) * block < hi - lo) {
+        counts_buf.clear();
+        tpm_buf.clear();
+        size_t end = std::min(hi - lo, (b + 1) * block);
+        for (size_t r = b * block; r < end; ++r) {
+          counts_buf += targ_ids_[lo + r];
+          tpm_buf += targ_ids_[lo + r];
+          for (int j = 0; j < n_bs_; ++j) {
+            counts_buf += '\t';
+            counts_buf.append(num, format_double(num, counts[j][r]));
+            tpm_buf += '\t';
+            tpm_buf.append(num, format_double(num, tpm[j][r]));
+          }
+          counts_buf += '\n';
+          tpm_buf += '\n';
+        }
+        std::unique_lock<std::mutex> lock(write_lock);
+        write_cv.wait(lock, [&] { return next_write == b; });
+        counts_of.write(counts_buf.data(), counts_buf.size());
+        tpm_of.write(tpm_buf.data(), tpm_buf.size());
+        ++next_write;
+        write_cv.notify_all();
+      }
+      // the next pass overwrites counts and tpm
+      barrier.wait([&] {
+        next_block = 0;
+        next_write = 0;
+      });
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 1; t < n_threads; ++t) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
   }
 
-  if (i-1 % 50 != 0 && i > 0) {
+  if (n_done > 0) {
     std::cerr << std::endl;
   }
 }
@@ -1,6 +1,8 @@
 #ifndef KALLISTO_H5WRITER_H
 #define KALLISTO_H5WRITER_H
 
+#include <mutex>
+
 #include "EMAlgorithm.h"
 
 #include "h5utils.h"
@@ -8,24 +10,34 @@
 
 class H5Writer {
   public:
-    H5Writer() : primed_(false) {}
+    H5Writer() : primed_(false), bootstrap_matrix_(false) {}
     ~H5Writer();
 
     void init(const std::string& fname, int num_bootstrap, int num_processed,
       const std::vector<int>& fld, const std::vector<int>& preBias, const std::vector<double>& postBias, uint compression, size_t index_version,
-      const std::string& shell_call, const std::string& start_time);
+      const std::string& shell_call, const std::string& start_time,
+      bool bootstrap_matrix = false);
 
     void write_main(const EMAlgorithm& em,
         const std::vector<std::string>& targ_ids,
         const std::vector<int>& lengths);
 
     void write_bootstrap(const EMAlgorithm& em, int bs_id);
+    void write_bootstrap(const std::vector<double>& alpha, int bs_id);
+
+    // compress a bootstrap without touching the file, safe to call from
+    // several threads at once. only write_bootstrap needs to be serialized.
+    void compress_bootstrap(const std::vector<double>& alpha, H5Chunk& chunk) const;
+    void write_bootstrap(const H5Chunk& chunk, int bs_id);
 
   private:
     bool primed_;
 
     int num_bootstrap_;
     uint compression_;
+    // all bootstraps in one num_bootstrap x num_targets dataset
+    bool bootstrap_matrix_;
+    hid_t bs_matrix_;
 
     hid_t file_id_;
     hid_t root_;
@@ -40,12 +52,22 @@ class H5Converter {
     ~H5Converter();
 
     void write_aux();
-    void convert();
+    // bs_matrix: write the bootstraps as one targets x bootstraps matrix of
+    // est_counts and one of tpm instead of a file per bootstrap
+    void convert(int n_threads = 1, bool bs_matrix = false);
 
   private:
     void rw_from_counts(hid_t group_id, const std::string& count_name,
         const std::string& out_fname);
 
+    // read bootstrap 'i' into 'alpha', the HDF5 calls are serialized and
+    // the decompression is done by the calling thread
+    void read_bootstrap(int i, H5Chunk& chunk, std::vector<double>& alpha);
+
+    // bs_est_counts.tsv and bs_tpm.tsv, streamed in blocks of rows with
+    // one pool of threads, holding at most BS_MATRIX_MEMORY of the matrices
+    void write_matrices(int n_threads);
+
     std::string out_dir_;
 
     // run info
@@ -68,6 +90,8 @@ class H5Converter {
     hid_t root_;
     hid_t aux_;
     hid_t bs_;
+    hid_t bs_matrix_; // -1 if the bootstraps are in separate datasets
+    std::mutex h5_lock_;
 
     int n_bs_;
     int n_proc_;
@@ -4,6 +4,7 @@
 #include <iostream>
 
 #include "KmerIndex.h"
+#include "NumberFormat.h"
 
 using namespace std;
 
@@ -198,8 +199,11 @@ void InspectIndex(const KmerIndex& index, const std::string& gfa) {
 
 
   if (!gfa.empty()) {
-    std::ofstream out;
-    out.open(gfa);
+    BufferedWriter out;
+    if (!out.open(gfa)) {
+      std::cerr << "Error: Couldn't open file: " << gfa << std::endl;
+      exit(1);
+    }
     out << "H\tVN:Z:1.0\n";
     int i = 0;
     for (auto& c : index.dbGraph.contigs) {
@@ -251,8 +255,6 @@ void InspectIndex(const KmerIndex& index, const std::string& gfa) {
       i++;
     }
 
-    out.flush();
-    
     out.close();
   }
 
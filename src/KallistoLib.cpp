@@ -0,0 +1,251 @@
+#include "KallistoLib.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "EMAlgorithm.h"
+#include "PlaintextWriter.h"
+#include "ProcessReads.h"
+#include "weights.h"
+
+namespace kallisto {
+
+namespace {
+
+// Kmer::k is set by the first index that is loaded
+std::mutex load_lock;
+
+const int FRAG_LEN_GOAL = 10000; // pairs used to estimate the fragment length
+const int MAX_BIAS_COUNT = 1000000; // reads used for the bias
+
+}
+
+Index::Index() : index_(new KmerIndex(opt_)), loaded_(false) {}
+
+bool Index::load(const std::string& fname) {
+  if (loaded_) {
+    std::cerr << "Error: an index has already been loaded into this object" << std::endl;
+    return false;
+  }
+
+  // check the header here, a k that differs must not reach Kmer::k
+  std::ifstream in(fname, std::ios::in | std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Error: index input file could not be opened: " << fname << std::endl;
+    return false;
+  }
+  size_t version = 0;
+  int k = 0;
+  in.read((char *)&version, sizeof(version));
+  in.read((char *)&k, sizeof(k));
+  if (!in) {
+    std::cerr << "Error: " << fname << " is not a kallisto index" << std::endl;
+    return false;
+  }
+  in.close();
+  if (version != index_->INDEX_VERSION) {
+    std::cerr << "Error: incompatible indices. Found version " << version
+              << ", expected version " << index_->INDEX_VERSION << std::endl;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(load_lock);
+  if (Kmer::k != 0 && Kmer::k != k) {
+    std::cerr << "Error: " << fname << " has k = " << k
+              << ", but an index with k = " << Kmer::k << " is already loaded" << std::endl;
+    return false;
+  }
+  opt_.index = fname;
+  if (!index_->tryLoad(opt_)) {
+    return false;
+  }
+  loaded_ = true;
+  return true;
+}
+
+namespace {
+
+ProgramOptions sessionProgramOptions(const ProgramOptions& iopt, const SessionOptions& sopt) {
+  ProgramOptions opt;
+  opt.k = iopt.k;
+  opt.index = iopt.index;
+  opt.threads = std::max(1, sopt.threads);
+  opt.single_end = !sopt.paired;
+  opt.fld = sopt.fragment_length;
+  opt.sd = sopt.sd;
+  opt.bias = sopt.bias;
+  opt.strand_specific = (sopt.strand != SessionOptions::Strand::None);
+  opt.strand = (sopt.strand == SessionOptions::Strand::FR) ? ProgramOptions::StrandType::FR
+             : (sopt.strand == SessionOptions::Strand::RF) ? ProgramOptions::StrandType::RF
+             : ProgramOptions::StrandType::None;
+  return opt;
+}
+
+}
+
+Session::Session(const Index& index, const SessionOptions& opt)
+  : index_(*index.index_),
+    opt_(sessionProgramOptions(index.opt_, opt)),
+    tc_(*index.index_, opt_),
+    num_reads_(0), num_mapped_(0), tlencount_(0), bias_count_(0) {}
+
+// what one thread collects from its part of a push, merged by pushReads
+struct Session::Worker {
+  std::vector<int> counts;
+  EcMapInv newEcs; // ecs that are not in tc_ yet, with their counts
+  std::vector<int> flens;
+  std::vector<int> bias5;
+  size_t mapped = 0;
+};
+
+size_t Session::push(const std::vector<std::string>& seqs) {
+  if (!opt_.single_end) {
+    std::cerr << "Error: single-end reads pushed to a paired-end session" << std::endl;
+    return 0;
+  }
+  return pushReads(seqs, nullptr);
+}
+
+size_t Session::pushPaired(const std::vector<std::string>& seqs1, const std::vector<std::string>& seqs2) {
+  if (opt_.single_end) {
+    std::cerr << "Error: paired-end reads pushed to a single-end session" << std::endl;
+    return 0;
+  }
+  if (seqs1.size() != seqs2.size()) {
+    std::cerr << "Error: pushed " << seqs1.size() << " first reads but "
+              << seqs2.size() << " second reads" << std::endl;
+    return 0;
+  }
+  return pushReads(seqs1, &seqs2);
+}
+
+size_t Session::pushReads(const std::vector<std::string>& seqs1, const std::vector<std::string>* seqs2) {
+  const bool paired = (seqs2 != nullptr);
+  const size_t n = seqs1.size();
+  const int nt = (int) std::max<size_t>(1, std::min<size_t>(opt_.threads, n / 1000));
+  const int flengoal = (opt_.fld == 0.0 && paired) ? std::max(0, FRAG_LEN_GOAL - tlencount_) : 0;
+  const int biasgoal = opt_.bias ? std::max(0, MAX_BIAS_COUNT - bias_count_) : 0;
+
+  std::vector<Worker> workers(nt);
+  auto work = [&](size_t begin, size_t end, Worker& w) {
+    std::vector<std::pair<KmerEntry,int>> v1, v2;
+    std::vector<int> u, vtmp;
+    w.counts.assign(tc_.counts.size(), 0);
+    if (flengoal > 0) {
+      w.flens.assign(tc_.flens.size(), 0);
+    }
+    if (biasgoal > 0) {
+      w.bias5.assign(tc_.bias5.size(), 0);
+    }
+    int fleft = flengoal, bleft = biasgoal;
+
+    for (size_t i = begin; i < end; i++) {
+      const char *s1 = seqs1[i].c_str(), *s2 = nullptr;
+      int l1 = seqs1[i].size(), l2 = 0;
+      v1.clear();
+      v2.clear();
+      u.clear();
+
+      index_.match(s1, l1, v1);
+      if (paired) {
+        s2 = (*seqs2)[i].c_str();
+        l2 = (*seqs2)[i].size();
+        index_.match(s2, l2, v2);
+      }
+      tc_.intersectKmers(v1, v2, !paired, u);
+      filterPseudoalignment(index_, tc_, opt_, s1, v1, s2, v2, paired, u, vtmp);
+      if (u.empty()) {
+        continue;
+      }
+
+      int ec = tc_.findEC(u);
+      ++w.mapped;
+      if (ec == -1) {
+        ++w.newEcs[u];
+      } else {
+        ++w.counts[ec];
+      }
+
+      if (bleft > 0 && tc_.countBias(s1, s2, v1, v2, paired, w.bias5)) {
+        bleft--;
+      }
+      if (fleft > 0 && 0 <= ec && ec < index_.num_trans && !v1.empty() && !v2.empty()) {
+        int tl = index_.mapPair(s1, l1, s2, l2, ec);
+        if (0 < tl && tl < w.flens.size()) {
+          w.flens[tl]++;
+          fleft--;
+        }
+      }
+    }
+  };
+
+  if (nt == 1) {
+    work(0, n, workers[0]);
+  } else {
+    std::vector<std::thread> threads;
+    size_t chunk = (n + nt - 1) / nt;
+    for (int t = 0; t < nt; t++) {
+      threads.emplace_back(work, std::min(n, t * chunk), std::min(n, (t + 1) * chunk), std::ref(workers[t]));
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  size_t mapped = 0;
+  for (auto& w : workers) {
+    for (size_t i = 0; i < w.counts.size(); i++) {
+      tc_.counts[i] += w.counts[i];
+    }
+    for (size_t i = 0; i < w.flens.size(); i++) {
+      tc_.flens[i] += w.flens[i];
+      tlencount_ += w.flens[i];
+    }
+    for (size_t i = 0; i < w.bias5.size(); i++) {
+      tc_.bias5[i] += w.bias5[i];
+      bias_count_ += w.bias5[i];
+    }
+    // new ecs go in the session's table, the next push finds them there
+    for (auto& t : w.newEcs) {
+      int ec = tc_.increaseCount(t.first);
+      if (ec != -1 && t.second > 1) {
+        tc_.counts[ec] += (t.second - 1);
+      }
+    }
+    mapped += w.mapped;
+  }
+  num_reads_ += n;
+  num_mapped_ += mapped;
+  return mapped;
+}
+
+bool Session::quantify(QuantResult& res) {
+  if (opt_.fld == 0.0) {
+    if (opt_.single_end) {
+      std::cerr << "Error: single-end sessions need a fragment length" << std::endl;
+      return false;
+    }
+    if (tlencount_ == 0) {
+      std::cerr << "Error: could not determine mean fragment length from paired end reads, no pairs mapped to a unique transcript." << std::endl;
+      return false;
+    }
+    tc_.compute_mean_frag_lens_trunc();
+  } else {
+    tc_.init_mean_fl_trunc(opt_.fld, opt_.sd);
+  }
+
+  auto fl_means = get_frag_len_means(index_.target_lens_, tc_.mean_fl_trunc);
+  EMAlgorithm em(tc_.counts, index_, tc_, fl_means, opt_);
+  em.run(10000, 50, false, opt_.bias);
+
+  res.est_counts = em.alpha_;
+  res.eff_lens = em.eff_lens_;
+  res.tpm = counts_to_tpm(em.alpha_, em.eff_lens_);
+  return true;
+}
+
+}
@@ -0,0 +1,116 @@
+#ifndef KALLISTO_KALLISTOLIB_H
+#define KALLISTO_KALLISTOLIB_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "KmerIndex.h"
+#include "MinCollector.h"
+
+// Library interface to kallisto_core, for programs that get their reads from
+// somewhere other than FASTQ files. Load an Index once, open a Session on it
+// for every sample, push batches of reads held in memory and quantify. Sessions
+// never touch the file system, all their state is in the Session object, and
+// any number of them can run on one Index at the same time.
+//
+//   kallisto::Index index;
+//   if (!index.load("transcripts.idx")) { ... }
+//   kallisto::SessionOptions sopt;
+//   sopt.paired = true;
+//   kallisto::Session session(index, sopt);
+//   session.pushPaired(reads1, reads2); // as often as needed
+//   kallisto::QuantResult res;
+//   session.quantify(res);
+//
+// Errors are reported on std::cerr and by the return value, none of these
+// functions exit the process. Index::load checks the whole file, but bias
+// sessions read the target sequences from it again later, so the index file
+// must stay in place and unchanged while it is in use.
+//
+// The k-mer length is still process wide (Kmer::k), so every index loaded by
+// one process must have the same k. Index::load checks this.
+
+namespace kallisto {
+
+class Index {
+public:
+  Index();
+
+  // false if fname is not a readable index for this version of kallisto, or
+  // if its k differs from that of an index that is already loaded
+  bool load(const std::string& fname);
+
+  bool loaded() const { return loaded_; }
+  int k() const { return index_->k; }
+  int numTargets() const { return index_->num_trans; }
+  // the ecs of the index, a Session numbers the ones it finds after these
+  size_t numECs() const { return index_->ecmap.size(); }
+  const std::vector<std::string>& targetNames() const { return index_->target_names_; }
+  const std::vector<int>& targetLengths() const { return index_->target_lens_; }
+
+private:
+  friend class Session;
+  ProgramOptions opt_;
+  std::unique_ptr<KmerIndex> index_;
+  bool loaded_;
+};
+
+struct SessionOptions {
+  enum class Strand {None, FR, RF};
+
+  bool paired = false;
+  double fragment_length = 0.0; // mean, estimated from the pairs if 0
+  double sd = 0.0; // needed with fragment_length
+  bool bias = false;
+  Strand strand = Strand::None;
+  int threads = 1; // for pushing reads and for the EM
+};
+
+struct QuantResult {
+  std::vector<double> est_counts;
+  std::vector<double> eff_lens;
+  std::vector<double> tpm;
+};
+
+// A Session is used by one thread at a time, threads within a push are
+// started by the Session itself.
+class Session {
+public:
+  // index must be loaded and outlive the session
+  Session(const Index& index, const SessionOptions& opt);
+
+  // pseudoaligns single-end reads, returns how many of them pseudoaligned
+  size_t push(const std::vector<std::string>& seqs);
+  // the same for pairs, seqs1[i] and seqs2[i] are the ends of a fragment
+  size_t pushPaired(const std::vector<std::string>& seqs1, const std::vector<std::string>& seqs2);
+
+  size_t numReads() const { return num_reads_; }
+  size_t numPseudoaligned() const { return num_mapped_; }
+
+  // count of every ec, ids past Index::numECs are ecs found by this session
+  const std::vector<int>& ecCounts() const { return tc_.counts; }
+  // the sorted targets of an ec
+  const std::vector<int>& ecTargets(int ec) const { return tc_.ecs[ec]; }
+
+  // runs the EM on the reads pushed so far, false if the fragment length
+  // can't be determined (single-end reads need SessionOptions::fragment_length)
+  bool quantify(QuantResult& res);
+
+private:
+  struct Worker;
+  size_t pushReads(const std::vector<std::string>& seqs1, const std::vector<std::string>* seqs2);
+
+  const KmerIndex& index_;
+  ProgramOptions opt_;
+  MinCollector tc_;
+  size_t num_reads_;
+  size_t num_mapped_;
+  int tlencount_; // pairs in tc_.flens
+  int bias_count_; // reads in tc_.bias5
+};
+
+}
+
+#endif // KALLISTO_KALLISTOLIB_H
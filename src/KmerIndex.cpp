@@ -4,6 +4,11 @@
 #include <ctype.h>
 #include <zlib.h>
 #include <unordered_set>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "kseq.h"
 
 #ifndef KSEQ_INIT_READY
@@ -177,6 +182,10 @@ void KmerIndex::BuildTranscripts(const ProgramOptions& opt) {
   BuildEquivalenceClasses(opt, seqs);
   //BuildEdges(opt);
 
+  // keep the sequences around so write() can store them
+  target_seqs_ = std::move(seqs);
+  target_seqs_loaded = true;
+
 }
 
 void KmerIndex::BuildDeBruijnGraph(const ProgramOptions& opt, const std::vector<std::string>& seqs) {
@@ -620,7 +629,7 @@ void KmerIndex::FixSplitContigs(const ProgramOptions& opt, std::vector<std::vect
 
 
 
-void KmerIndex::write(const std::string& index_out, bool writeKmerTable) {
+void KmerIndex::write(const std::string& index_out, bool writeKmerTable, const EcMap& added_ecs) {
   std::ofstream out;
   out.open(index_out, std::ios::out | std::ios::binary);
 
@@ -664,14 +673,14 @@ void KmerIndex::write(const std::string& index_out, bool writeKmerTable) {
   }
   // 7. write number of equivalence classes
   size_t tmp_size;
-  tmp_size = ecmap.size();
-  out.write((char *)&tmp_size, sizeof(tmp_size));
+  size_t num_ecs = ecmap.size() + added_ecs.size();
+  out.write((char *)&num_ecs, sizeof(num_ecs));
 
   // 8. write out each equiv class
   //  for (auto& kv : ecmap) {
-  for (int ec = 0; ec < ecmap.size(); ec++) {
+  for (int ec = 0; ec < num_ecs; ec++) {
     out.write((char *)&ec, sizeof(ec));
-    auto& v = ecmap[ec];
+    auto& v = (ec < ecmap.size()) ? ecmap[ec] : added_ecs[ec - ecmap.size()];
     // 8.1 write out the size of equiv class
     tmp_size = v.size();
     out.write((char *)&tmp_size, sizeof(tmp_size));
@@ -724,6 +733,37 @@ void KmerIndex::write(const std::string& index_out, bool writeKmerTable) {
       out.write((char*)&ec, sizeof(ec));
     }
 
+    // 12. write out the target sequences, 2-bit packed, each target starting
+    // on a new byte. This section is optional, readers that don't find it
+    // rebuild the sequences from the contigs.
+    loadTranscriptSequences();
+    assert(target_seqs_.size() == num_trans);
+    tmp_size = target_seqs_.size();
+    out.write((char*)&tmp_size, sizeof(tmp_size));
+    size_t packed_size = 0;
+    for (auto& seq : target_seqs_) {
+      // 12.1 write out the length of each target
+      tmp_size = seq.size();
+      out.write((char*)&tmp_size, sizeof(tmp_size));
+      packed_size += (seq.size() + 3) / 4;
+    }
+    // 12.2 write the number of bytes, followed by the sequences
+    out.write((char*)&packed_size, sizeof(packed_size));
+    std::vector<char> packed;
+    for (auto& seq : target_seqs_) {
+      packed.assign((seq.size() + 3) / 4, 0);
+      for (size_t j = 0; j < seq.size(); j++) {
+        int x = 0;
+        switch (seq[j]) {
+        case 'C': x = 1; break;
+        case 'G': x = 2; break;
+        case 'T': x = 3; break;
+        }
+        packed[j/4] |= (x << (2*(j%4)));
+      }
+      out.write(packed.data(), packed.size());
+    }
+
 
   } else {
     // write empty dBG
@@ -782,6 +822,12 @@ bool KmerIndex::fwStep(Kmer km, Kmer& end) const {
 }
 
 void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
+  if (!tryLoad(opt, loadKmerTable)) {
+    exit(1);
+  }
+}
+
+bool KmerIndex::tryLoad(ProgramOptions& opt, bool loadKmerTable) {
 
   std::string& index_in = opt.index;
   std::ifstream in;
@@ -790,23 +836,30 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   in.open(index_in, std::ios::in | std::ios::binary);
 
   if (!in.is_open()) {
-    // TODO: better handling
-    std::cerr << "Error: index input file could not be opened!";
-    exit(1);
+    std::cerr << "Error: index input file could not be opened: " << index_in << std::endl;
+    return false;
   }
 
+  auto corrupt = [&]() {
+    std::cerr << "Error: index file " << index_in << " is truncated or corrupt" << std::endl;
+    return false;
+  };
+
   // 1. read version
   size_t header_version = 0;
   in.read((char *)&header_version, sizeof(header_version));
 
   if (header_version != INDEX_VERSION) {
     std::cerr << "Error: incompatible indices. Found version " << header_version << ", expected version " << INDEX_VERSION << std::endl
-              << "Rerun with index to regenerate";
-    exit(1);
+              << "Rerun with index to regenerate" << std::endl;
+    return false;
   }
 
   // 2. read k
   in.read((char *)&k, sizeof(k));
+  if (!in) {
+    return corrupt();
+  }
   if (Kmer::k == 0) {
     //std::cerr << "[index] no k has been set, setting k = " << k << std::endl;
     Kmer::set_k(k);
@@ -817,11 +870,14 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   } else {
     std::cerr << "Error: Kmer::k was already set to = " << Kmer::k << std::endl
               << "       conflicts with value of k  = " << k << std::endl;
-    exit(1);
+    return false;
   }
 
   // 3. read in number of targets
   in.read((char *)&num_trans, sizeof(num_trans));
+  if (!in || num_trans < 0) {
+    return corrupt();
+  }
 
   // 4. read in length of targets
   target_lens_.clear();
@@ -836,6 +892,9 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   // 5. read number of k-mers
   size_t kmap_size;
   in.read((char *)&kmap_size, sizeof(kmap_size));
+  if (!in) {
+    return corrupt();
+  }
 
   std::cerr << "[index] k-mer length: " << k << std::endl;
   std::cerr << "[index] number of targets: " << pretty_num(num_trans)
@@ -854,6 +913,9 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   for (size_t i = 0; i < kmap_size; ++i) {
     in.read((char *)&tmp_kmer, sizeof(tmp_kmer));
     in.read((char *)&tmp_val, sizeof(tmp_val));
+    if (!in) {
+      return corrupt();
+    }
 
     if (loadKmerTable) {
       kmap.insert({tmp_kmer, tmp_val});
@@ -863,6 +925,10 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   // 7. read number of equivalence classes
   size_t ecmap_size;
   in.read((char *)&ecmap_size, sizeof(ecmap_size));
+  // every target has its own ec
+  if (!in || ecmap_size < (size_t) num_trans) {
+    return corrupt();
+  }
 
   std::cerr << "[index] number of equivalence classes: "
     << pretty_num(ecmap_size) << std::endl;
@@ -876,6 +942,9 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
 
     // 8.1 read size of equiv class
     in.read((char *)&vec_size, sizeof(vec_size));
+    if (!in || tmp_id < 0 || (size_t) tmp_id >= ecmap_size || vec_size > (size_t) num_trans) {
+      return corrupt();
+    }
 
     // 8.2 read each member
     std::vector<int> tmp_vec;
@@ -884,6 +953,9 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
       in.read((char *)&tmp_ecval, sizeof(tmp_ecval));
       tmp_vec.push_back(tmp_ecval);
     }
+    if (!in) {
+      return corrupt();
+    }
     //ecmap.insert({tmp_id, tmp_vec});
     ecmap[tmp_id] = tmp_vec;
     ecmapinv.insert({tmp_vec, tmp_id});
@@ -894,31 +966,34 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
   target_names_.reserve(num_trans);
 
   size_t tmp_size;
-  size_t bufsz = 1024;
-  char *buffer = new char[bufsz];
+  std::vector<char> buffer(1024);
   for (auto i = 0; i < num_trans; ++i) {
     // 9.1 read in the size
     in.read((char *)&tmp_size, sizeof(tmp_size));
+    if (!in) {
+      return corrupt();
+    }
 
-    if (tmp_size +1 > bufsz) {
-      delete[] buffer;
-      bufsz = 2*(tmp_size+1);
-      buffer = new char[bufsz];
+    if (tmp_size +1 > buffer.size()) {
+      buffer.resize(2*(tmp_size+1));
     }
     
     // clear the buffer 
-    memset(buffer,0,bufsz);
+    std::fill(buffer.begin(), buffer.end(), 0);
     // 9.2 read in the character string
-    in.read(buffer, tmp_size);
+    in.read(buffer.data(), tmp_size);
 
     /* std::string tmp_targ_id( buffer ); */
-    target_names_.push_back(std::string( buffer ));
+    target_names_.push_back(std::string( buffer.data() ));
   }
 
 
   // 10. read contigs
   size_t contig_size;
   in.read((char *)&contig_size, sizeof(contig_size));
+  if (!in) {
+    return corrupt();
+  }
   dbGraph.contigs.clear();
   dbGraph.contigs.reserve(contig_size);
   for (auto i = 0; i < contig_size; i++) {
@@ -926,19 +1001,23 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
     in.read((char *)&c.id, sizeof(c.id));
     in.read((char *)&c.length, sizeof(c.length));
     in.read((char *)&tmp_size, sizeof(tmp_size));
+    if (!in) {
+      return corrupt();
+    }
 
-    if (tmp_size + 1 > bufsz) {
-      delete[] buffer;
-      bufsz = 2*(tmp_size+1);
-      buffer = new char[bufsz];
+    if (tmp_size + 1 > buffer.size()) {
+      buffer.resize(2*(tmp_size+1));
     }
 
-    memset(buffer,0,bufsz);
-    in.read(buffer, tmp_size);
-    c.seq = std::string(buffer); // copy
+    std::fill(buffer.begin(), buffer.end(), 0);
+    in.read(buffer.data(), tmp_size);
+    c.seq = std::string(buffer.data()); // copy
     
     // 10.1 read transcript info
     in.read((char*)&tmp_size, sizeof(tmp_size));
+    if (!in || tmp_size > (size_t) num_trans) {
+      return corrupt();
+    }
     c.transcripts.clear();
     c.transcripts.reserve(tmp_size);
 
@@ -947,6 +1026,9 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
       in.read((char*)&info.trid, sizeof(info.trid));
       in.read((char*)&info.pos, sizeof(info.pos));
       in.read((char*)&info.sense, sizeof(info.sense));
+      if (!in || info.trid < 0 || info.trid >= num_trans) {
+        return corrupt();
+      }
       c.transcripts.push_back(info);
     }
 
@@ -961,12 +1043,37 @@ void KmerIndex::load(ProgramOptions& opt, bool loadKmerTable) {
     in.read((char *)&tmp_ec, sizeof(tmp_ec));
     dbGraph.ecs.push_back(tmp_ec);
   }
+  if (!in) {
+    return corrupt();
+  }
+
+  // 12. packed target sequences, only present in newer indices. Just note
+  // where they are, they're mapped in if something needs them. Their sizes
+  // are checked here so that mapping them in later can't fail.
+  target_seqs_offset_ = 0;
+  target_seqs_bytes_ = 0;
+  if (contig_size > 0 && in.read((char *)&tmp_size, sizeof(tmp_size)) && tmp_size == num_trans) {
+    size_t offset = in.tellg();
+    size_t packed_bytes = 0;
+    for (int i = 0; i < num_trans; i++) {
+      in.read((char *)&tmp_size, sizeof(tmp_size));
+      packed_bytes += (tmp_size + 3) / 4;
+    }
+    size_t packed_size = 0;
+    in.read((char *)&packed_size, sizeof(packed_size));
+    size_t start = in.tellg();
+    in.seekg(0, std::ios::end);
+    size_t file_size = in.tellg();
+    if (!in || packed_bytes > packed_size || start + packed_size > file_size) {
+      return corrupt();
+    }
+    target_seqs_file_ = index_in;
+    target_seqs_offset_ = offset;
+    target_seqs_bytes_ = (num_trans + 1) * sizeof(size_t) + packed_size;
+  }
 
-  // delete the buffer
-  delete[] buffer;
-  buffer=nullptr;
-  
   in.close();
+  return true;
 }
 
 
@@ -1057,12 +1164,15 @@ int KmerIndex::mapPair(const char *s1, int l1, const char *s2, int l2, int ec) c
 // use:  match(s,l,v)
 // pre:  v is initialized
 // post: v contains all equiv classes for the k-mers in s
-void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int>>& v) const {
+void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int>>& v, MatchStats* stats) const {
+  // counted locally, added to stats once at the end
+  uint64_t lookups = 0, jumps = 0, jumps_ok = 0;
   KmerIterator kit(s), kit_end;
   bool backOff = false;
   int nextPos = 0; // nextPosition to check
   for (int i = 0;  kit != kit_end; ++i,++kit) {
     // need to check it
+    ++lookups;
     auto search = kmap.find(kit->first.rep());
     int pos = kit->second;
 
@@ -1093,6 +1203,8 @@ void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int
         kit2.jumpTo(nextPos);
         if (kit2 != kit_end) {
           Kmer rep2 = kit2->first.rep();
+          ++lookups;
+          ++jumps;
           auto search2 = kmap.find(rep2);
           bool found2 = false;
           int  found2pos = pos+dist;
@@ -1104,6 +1216,7 @@ void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int
             found2pos = pos+dist;
           }
           if (found2) {
+            ++jumps_ok;
             // great, a match (or nothing) see if we can move the k-mer forward
             if (found2pos >= l-k) {
               v.push_back({val, l-k}); // push back a fake position
@@ -1124,6 +1237,7 @@ void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int
               KmerEntry val3;
               if (kit3 != kit_end) {
                 Kmer rep3 = kit3->first.rep();
+                ++lookups;
                 auto search3 = kmap.find(rep3);
                 if (search3 != kmap.end()) {
                   middleContig = search3->second.contig;
@@ -1138,6 +1252,7 @@ void KmerIndex::match(const char *s, int l, std::vector<std::pair<KmerEntry, int
 
 
                 if (foundMiddle) {
+                  ++jumps_ok;
                   v.push_back({search3->second, found3pos});
                   if (nextPos >= l-k) {
                     break;
@@ -1174,6 +1289,7 @@ donejumping:
         if (j==0) {
           // need to check it
           Kmer rep = kit->first.rep();
+          ++lookups;
           auto search = kmap.find(rep);
           if (search != kmap.end()) {
             // if k-mer found
@@ -1188,6 +1304,13 @@ donejumping:
       }
     }
   }
+
+  if (stats) {
+    stats->reads++;
+    stats->lookups += lookups;
+    stats->jumps += jumps;
+    stats->jumps_ok += jumps_ok;
+  }
 }
 
 
@@ -1353,42 +1476,122 @@ std::vector<int> KmerIndex::intersect(int ec, const std::vector<int>& v) const {
 }
 
 
-void KmerIndex::loadTranscriptSequences() const {
-  if (target_seqs_loaded) {
+// splits [0,n) into one contiguous range per thread and runs f(begin, end)
+template <typename F>
+static void parallel_for(int n, int threads, F f) {
+  threads = std::max(1, std::min(threads, n));
+  if (threads == 1) {
+    f(0, n);
     return;
   }
+  std::vector<std::thread> workers;
+  int chunk = (n + threads - 1) / threads;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back(f, std::min(n, t*chunk), std::min(n, (t+1)*chunk));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+}
 
+void KmerIndex::loadTranscriptSequences(int threads) const {
+  std::lock_guard<std::mutex> lock(target_seqs_lock_);
+  if (target_seqs_loaded) {
+    return;
+  }
 
-  
-  std::vector<std::vector<std::pair<int, ContigToTranscript>>> trans_contigs(num_trans);
-  for (auto &c : dbGraph.contigs) {
-    for (auto &ct : c.transcripts) {
-      trans_contigs[ct.trid].push_back({c.id, ct});
+  auto &target_seqs = const_cast<std::vector<std::string>&>(target_seqs_);
+  target_seqs.clear();
+  target_seqs.resize(num_trans);
+
+  bool loaded = false;
+  if (target_seqs_offset_ > 0) {
+    // map the packed section of the index file and decode it
+    int fd = open(target_seqs_file_.c_str(), O_RDONLY);
+    if (fd != -1) {
+      // touching a mapped page past the end of the file is a SIGBUS, so a
+      // truncated index has to be caught here
+      struct stat st;
+      if (fstat(fd, &st) != 0 || (size_t) st.st_size < target_seqs_offset_ + target_seqs_bytes_) {
+        std::cerr << "Error: the target sequences in " << target_seqs_file_
+                  << " are truncated, the index file is damaged" << std::endl;
+        exit(1);
+      }
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t start = target_seqs_offset_ - (target_seqs_offset_ % page);
+      size_t len = target_seqs_bytes_ + (target_seqs_offset_ - start);
+      void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, start);
+      if (map != MAP_FAILED) {
+        const char *p = (const char *)map + (target_seqs_offset_ - start);
+        std::vector<size_t> lens(num_trans), offsets(num_trans+1, 0);
+        memcpy(lens.data(), p, num_trans * sizeof(size_t));
+        for (int i = 0; i < num_trans; i++) {
+          offsets[i+1] = offsets[i] + (lens[i] + 3) / 4;
+        }
+        if ((num_trans + 1) * sizeof(size_t) + offsets[num_trans] > target_seqs_bytes_) {
+          std::cerr << "Error: the target sequences in " << target_seqs_file_
+                    << " are inconsistent, the index file is damaged" << std::endl;
+          exit(1);
+        }
+        const unsigned char *packed = (const unsigned char *)p + (num_trans + 1) * sizeof(size_t);
+
+        parallel_for(num_trans, threads, [&](int begin, int end) {
+          for (int i = begin; i < end; i++) {
+            std::string &seq = target_seqs[i];
+            seq.resize(lens[i]);
+            const unsigned char *b = packed + offsets[i];
+            for (size_t j = 0; j < lens[i]; j++) {
+              seq[j] = Dna(b[j/4] >> (2*(j%4)));
+            }
+          }
+        });
+        munmap(map, len);
+        loaded = true;
+      }
+      close(fd);
     }
   }
 
-  auto &target_seqs = const_cast<std::vector<std::string>&>(target_seqs_);
-  
-  for (int i = 0; i < trans_contigs.size(); i++) {
-    auto &v = trans_contigs[i];
-    std::sort(v.begin(), v.end(), [](std::pair<int,ContigToTranscript> a, std::pair<int,ContigToTranscript> b) {
-        return a.second.pos < b.second.pos;
-      });
-
-    std::string seq;
-    seq.reserve(target_lens_[i]);
-
-    for (auto &pct : v) {
-      auto ct = pct.second;
-      int start = (ct.pos==0) ? 0 : k-1;
-      const auto& contig = dbGraph.contigs[pct.first];
-      if (ct.sense) {
-        seq.append(contig.seq.substr(start));
-      } else {
-        seq.append(revcomp(contig.seq).substr(start));
+  if (!loaded) {
+    // rebuild from the contigs
+    std::vector<std::vector<std::pair<int, ContigToTranscript>>> trans_contigs(num_trans);
+    for (auto &c : dbGraph.contigs) {
+      for (auto &ct : c.transcripts) {
+        trans_contigs[ct.trid].push_back({c.id, ct});
       }
     }
-    target_seqs.push_back(seq);
+
+    parallel_for(num_trans, threads, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        auto &v = trans_contigs[i];
+        std::sort(v.begin(), v.end(), [](const std::pair<int,ContigToTranscript>& a, const std::pair<int,ContigToTranscript>& b) {
+            return a.second.pos < b.second.pos;
+          });
+
+        std::string &seq = target_seqs[i];
+        seq.reserve(target_lens_[i]);
+
+        for (auto &pct : v) {
+          auto ct = pct.second;
+          int start = (ct.pos==0) ? 0 : k-1;
+          const auto& cs = dbGraph.contigs[pct.first].seq;
+          if (ct.sense) {
+            seq.append(cs, start, std::string::npos);
+          } else {
+            // reverse complement in place, skipping the first 'start' bases
+            for (int j = (int) cs.size() - 1 - start; j >= 0; j--) {
+              switch (cs[j]) {
+              case 'A': seq.push_back('T'); break;
+              case 'C': seq.push_back('G'); break;
+              case 'G': seq.push_back('C'); break;
+              case 'T': seq.push_back('A'); break;
+              default: seq.push_back('N');
+              }
+            }
+          }
+        }
+      }
+    });
   }
 
   bool &t = const_cast<bool&>(target_seqs_loaded);
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <mutex>
 #include <stdint.h>
 #include <ostream>
 //#include <map>
@@ -18,6 +19,7 @@
 #include "KmerHashTable.h"
 
 #include "hash.hpp"
+#include "RunStats.h"
 
 std::string revcomp(const std::string s);
 
@@ -46,6 +48,50 @@ struct SortedVectorHasher {
   }
 };
 
+using EcMapInv = std::unordered_map<std::vector<int>, int, SortedVectorHasher>;
+
+// The ecs seen by one run: the ecs of the index, which are shared by every
+// run and never change once loaded, followed by the ecs the run found in
+// its own reads. Ids continue after the index's ecs, so a run's table reads
+// like the ecmap the index would have had if the new ecs were added to it.
+class EcTable {
+public:
+  EcTable(const EcMap& base, const EcMapInv& base_inv) : base_(&base), base_inv_(&base_inv) {}
+
+  size_t size() const {
+    return base_->size() + added_.size();
+  }
+  const std::vector<int>& operator[](size_t ec) const {
+    return (ec < base_->size()) ? (*base_)[ec] : added_[ec - base_->size()];
+  }
+  // the id of the ec u (sorted), -1 if there is none
+  int find(const std::vector<int>& u) const {
+    auto search = base_inv_->find(u);
+    if (search != base_inv_->end()) {
+      return search->second;
+    }
+    auto added = added_inv_.find(u);
+    return (added != added_inv_.end()) ? added->second : -1;
+  }
+  // add an ec that isn't in the table yet, returns its id
+  int add(const std::vector<int>& u) {
+    int ec = size();
+    added_.push_back(u);
+    added_inv_.insert({u, ec});
+    return ec;
+  }
+  // the ecs that aren't in the index
+  const EcMap& added() const {
+    return added_;
+  }
+
+private:
+  const EcMap* base_;
+  const EcMapInv* base_inv_;
+  EcMap added_;
+  EcMapInv added_inv_;
+};
+
 struct KmerEntry {
   int32_t contig; // id of contig
   uint32_t _pos; // 0-based forward distance to EC-junction
@@ -93,13 +139,15 @@ struct DBGraph {
 
 
 struct KmerIndex {
-  KmerIndex(const ProgramOptions& opt) : k(opt.k), num_trans(0), skip(opt.skip), target_seqs_loaded(false) {
+  KmerIndex(const ProgramOptions& opt) : k(opt.k), num_trans(0), skip(opt.skip), target_seqs_loaded(false),
+    target_seqs_offset_(0), target_seqs_bytes_(0) {
     //LoadTranscripts(opt.transfasta);
   }
 
   ~KmerIndex() {}
 
-  void match(const char *s, int l, std::vector<std::pair<KmerEntry, int>>& v) const;
+  // stats, if given, counts the lookups
+  void match(const char *s, int l, std::vector<std::pair<KmerEntry, int>>& v, MatchStats* stats = nullptr) const;
 //  bool matchEnd(const char *s, int l, std::vector<std::pair<int, int>>& v, int p) const;
   int mapPair(const char *s1, int l1, const char *s2, int l2, int ec) const;
   std::vector<int> intersect(int ec, const std::vector<int>& v) const;
@@ -114,13 +162,18 @@ struct KmerIndex {
   bool fwStep(Kmer km, Kmer& end) const;
 
   // output methods
-  void write(const std::string& index_out, bool writeKmerTable = true);
+  // added_ecs are written after the index's own ecs
+  void write(const std::string& index_out, bool writeKmerTable = true, const EcMap& added_ecs = EcMap());
   void writePseudoBamHeader(std::ostream &o) const;
   
   // note opt is not const
   // load methods
   void load(ProgramOptions& opt, bool loadKmerTable = true);
-  void loadTranscriptSequences() const;
+  // same as load, but returns false instead of exiting if the index can't be read
+  bool tryLoad(ProgramOptions& opt, bool loadKmerTable = true);
+  // reads the packed sequences stored in the index if there are any,
+  // otherwise rebuilds them from the contigs
+  void loadTranscriptSequences(int threads = 1) const;
 
   // positional information
   std::pair<int,bool> findPosition(int tr, Kmer km, KmerEntry val, int p = 0) const;
@@ -130,9 +183,9 @@ struct KmerIndex {
   int skip;
 
   KmerHashTable<KmerEntry, KmerHash> kmap;
-  EcMap ecmap;
+  EcMap ecmap; // not changed after loading, new ecs of a run go in its EcTable
   DBGraph dbGraph;
-  std::unordered_map<std::vector<int>, int, SortedVectorHasher> ecmapinv;
+  EcMapInv ecmapinv;
   const size_t INDEX_VERSION = 10; // increase this every time you change the fileformat
 
   std::vector<int> target_lens_;
@@ -140,6 +193,13 @@ struct KmerIndex {
   std::vector<std::string> target_names_;
   std::vector<std::string> target_seqs_; // populated on demand
   bool target_seqs_loaded;
+  mutable std::mutex target_seqs_lock_; // concurrent runs may load them at once
+
+  // where the 2-bit packed target sequences live in the index file, they are
+  // only mapped in when loadTranscriptSequences is called
+  std::string target_seqs_file_;
+  size_t target_seqs_offset_; // 0 if the index doesn't store them
+  size_t target_seqs_bytes_;
 
 
 };
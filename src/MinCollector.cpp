@@ -1,5 +1,7 @@
 #include "MinCollector.h"
+#include "NumberFormat.h"
 #include <algorithm>
+#include <limits>
 
 // utility functions
 
@@ -83,12 +85,7 @@ int MinCollector::findEC(const std::vector<int>& u) const {
   if (u.size() == 1) {
     return u[0];
   }
-  auto search = index.ecmapinv.find(u);
-  if (search != index.ecmapinv.end()) {
-    return search ->second;
-  } else {
-    return -1;
-  }
+  return ecs.find(u);
 }
 
 int MinCollector::increaseCount(const std::vector<int>& u) {
@@ -101,12 +98,9 @@ int MinCollector::increaseCount(const std::vector<int>& u) {
       ++counts[ec];
       return ec;
     } else {
-      auto necs = counts.size();
-      //index.ecmap.insert({necs,u});
-      index.ecmap.push_back(u);
-      index.ecmapinv.insert({u,necs});
+      // new ec class, the index is left alone
       counts.push_back(1);
-      return necs;
+      return ecs.add(u);
     }
   }
 
@@ -134,7 +128,7 @@ int MinCollector::increaseCount(const std::vector<int>& u) {
 }
 
 int MinCollector::decreaseCount(const int ec) {
-  assert(ec >= 0 && ec <= index.ecmap.size());
+  assert(ec >= 0 && ec <= ecs.size());
   --counts[ec];
   return ec;
 }
@@ -245,29 +239,35 @@ void MinCollector::write(const std::string& pseudoprefix) const {
   std::string ecfilename = pseudoprefix + ".ec";
   std::string countsfilename = pseudoprefix + ".tsv";
 
-  std::ofstream ecof, countsof;
-  ecof.open(ecfilename.c_str(), std::ios::out);
+  BufferedWriter ecof, countsof;
+  if (!ecof.open(ecfilename)) {
+    std::cerr << "Error: Couldn't open file: " << ecfilename << std::endl;
+    exit(1);
+  }
   // output equivalence classes in the form "EC TXLIST";
-  for (int i = 0; i < index.ecmap.size(); i++) {
-    ecof << i << "\t";
+  for (int i = 0; i < ecs.size(); i++) {
+    ecof << i << '\t';
     // output the rest of the class
-    const auto &v = index.ecmap[i];
+    const auto &v = ecs[i];
     bool first = true;
     for (auto x : v) {
       if (!first) {
-        ecof << ",";
+        ecof << ',';
       } else {
         first = false;
       }
       ecof << x;
     }
-    ecof << "\n";
+    ecof << '\n';
   }
   ecof.close();
 
-  countsof.open(countsfilename.c_str(), std::ios::out);
+  if (!countsof.open(countsfilename)) {
+    std::cerr << "Error: Couldn't open file: " << countsfilename << std::endl;
+    exit(1);
+  }
   for (int i = 0; i < counts.size(); i++) {
-    countsof << i << "\t" << counts[i] << "\n";
+    countsof << i << '\t' << counts[i] << '\n';
   }
   countsof.close();
 }
@@ -13,11 +13,15 @@
 
 const int MAX_FRAG_LEN = 1000;
 
+// nonzero (ec, count) pairs of one batch cell, sorted by ec
+typedef std::vector<std::pair<int, int>> SparseCounts;
+
 struct MinCollector {
 
-  MinCollector(KmerIndex& ind, const ProgramOptions& opt)
+  MinCollector(const KmerIndex& ind, const ProgramOptions& opt)
     :
       index(ind),
+      ecs(ind.ecmap, ind.ecmapinv),
       counts(index.ecmap.size(), 0),
       flens(MAX_FRAG_LEN),
       bias3(4096),
@@ -77,7 +81,8 @@ struct MinCollector {
   // this function should only be used for SE data
   void init_mean_fl_trunc(double mean, double sd);
 
-  KmerIndex& index;
+  const KmerIndex& index;
+  EcTable ecs; // the index's ecs and the ones found by this run
   std::vector<int> counts;
   std::vector<int> flens;
   std::vector<int> bias3, bias5;
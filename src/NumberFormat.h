@@ -0,0 +1,271 @@
+#ifndef KALLISTO_NUMBER_FORMAT_H
+#define KALLISTO_NUMBER_FORMAT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Formatting of numbers into a char buffer, producing exactly the text
+// 'std::ostream << x' does with the default flags (precision 6, "%g") so
+// output files are unchanged, without the locale and stream overhead.
+//
+// Every format_* function writes to 'out' and returns a pointer one past the
+// last character written. No terminating 0 is written.
+//
+// BufferedWriter puts this behind an ofstream-like '<<' interface for the
+// text writers.
+
+// enough room for any value written by the functions below
+const size_t FORMAT_MAX_CHARS = 32;
+
+inline char* format_uint(char* out, uint64_t x) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + (x % 10);
+    x /= 10;
+  } while (x != 0);
+  while (n > 0) {
+    *out++ = tmp[--n];
+  }
+  return out;
+}
+
+inline char* format_int(char* out, int64_t x) {
+  if (x < 0) {
+    *out++ = '-';
+    return format_uint(out, static_cast<uint64_t>(0) - static_cast<uint64_t>(x));
+  }
+  return format_uint(out, static_cast<uint64_t>(x));
+}
+
+// powers of ten, 1e0 ... 1e308
+inline const double* pow10_table() {
+  static double table[309];
+  static bool init = [] {
+    for (int i = 0; i < 309; ++i) {
+      table[i] = std::pow(10.0, i);
+    }
+    return true;
+  }();
+  (void) init;
+  return table;
+}
+
+// the "%g" conversion with precision 6
+inline char* format_double(char* out, double x) {
+  char* start = out;
+  double ax = std::fabs(x);
+  if (!std::isfinite(x) || (ax != 0.0 && (ax < 1e-290 || ax > 1e290))) {
+    return out + snprintf(out, FORMAT_MAX_CHARS, "%g", x);
+  }
+  if (std::signbit(x)) {
+    *out++ = '-';
+  }
+  if (ax == 0.0) {
+    *out++ = '0';
+    return out;
+  }
+
+  // scale to 6 significant digits: y = ax * 10^(5 - e), y in [1e5, 1e6)
+  const double* p10 = pow10_table();
+  int b;
+  std::frexp(ax, &b);
+  int e = static_cast<int>(std::floor((b - 1) * 0.30102999566398120));
+  double y = 0.0;
+  for (int tries = 0; tries < 3; ++tries) {
+    int s = 5 - e;
+    y = (s >= 0) ? ax * p10[s] : ax / p10[-s];
+    if (y < 1e5) {
+      --e;
+    } else if (y >= 1e6) {
+      ++e;
+    } else {
+      break;
+    }
+  }
+  double r = std::floor(y);
+  double frac = y - r;
+  if (!(y >= 1e5 && y < 1e6) || std::fabs(frac - 0.5) < 1e-6) {
+    // too close to a rounding boundary for the scaled value to be trusted
+    return start + snprintf(start, FORMAT_MAX_CHARS, "%g", x);
+  }
+  if (frac > 0.5) {
+    r += 1.0;
+  }
+  if (r >= 1e6) {
+    r = 1e5;
+    ++e;
+  }
+
+  char d[6];
+  uint32_t v = static_cast<uint32_t>(r);
+  for (int i = 5; i >= 0; --i) {
+    d[i] = '0' + (v % 10);
+    v /= 10;
+  }
+  int nd = 6; // significant digits left after dropping trailing zeros
+  while (nd > 1 && d[nd - 1] == '0') {
+    --nd;
+  }
+
+  if (e < -4 || e >= 6) {
+    *out++ = d[0];
+    if (nd > 1) {
+      *out++ = '.';
+      memcpy(out, d + 1, nd - 1);
+      out += nd - 1;
+    }
+    *out++ = 'e';
+    *out++ = (e < 0) ? '-' : '+';
+    int ae = (e < 0) ? -e : e;
+    if (ae < 10) {
+      *out++ = '0';
+    }
+    return format_uint(out, ae);
+  }
+
+  if (e >= 0) {
+    int n_int = e + 1;
+    memcpy(out, d, n_int);
+    out += n_int;
+    if (nd > n_int) {
+      *out++ = '.';
+      memcpy(out, d + n_int, nd - n_int);
+      out += nd - n_int;
+    }
+  } else {
+    *out++ = '0';
+    *out++ = '.';
+    for (int i = 0; i < -e - 1; ++i) {
+      *out++ = '0';
+    }
+    memcpy(out, d, nd);
+    out += nd;
+  }
+  return out;
+}
+
+class BufferedWriter {
+  public:
+    BufferedWriter() : f_(nullptr), pos_(0), buf_(BUFFER_SIZE) {}
+    explicit BufferedWriter(const std::string& fname) : BufferedWriter() {
+      open(fname);
+    }
+    ~BufferedWriter() {
+      close();
+    }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    bool open(const std::string& fname) {
+      close();
+      fname_ = fname;
+      f_ = fopen(fname.c_str(), "w");
+      return f_ != nullptr;
+    }
+
+    bool is_open() const {
+      return f_ != nullptr;
+    }
+
+    // writing to a writer that failed to open is an error too
+    void flush() {
+      if (pos_ > 0 && (f_ == nullptr || fwrite(buf_.data(), 1, pos_, f_) != pos_)) {
+        std::cerr << "Error: could not write to " << fname_ << std::endl;
+        exit(1);
+      }
+      pos_ = 0;
+    }
+
+    void close() {
+      if (f_ == nullptr) {
+        return;
+      }
+      flush();
+      if (fclose(f_) != 0) {
+        std::cerr << "Error: could not write to " << fname_ << std::endl;
+        exit(1);
+      }
+      f_ = nullptr;
+    }
+
+    void write(const char* s, size_t n) {
+      if (n > BUFFER_SIZE - pos_) {
+        flush();
+        if (n > BUFFER_SIZE) {
+          if (f_ == nullptr || fwrite(s, 1, n, f_) != n) {
+            std::cerr << "Error: could not write to " << fname_ << std::endl;
+            exit(1);
+          }
+          return;
+        }
+      }
+      memcpy(buf_.data() + pos_, s, n);
+      pos_ += n;
+    }
+
+    BufferedWriter& operator<<(char c) {
+      if (pos_ == BUFFER_SIZE) {
+        flush();
+      }
+      buf_[pos_++] = c;
+      return *this;
+    }
+
+    BufferedWriter& operator<<(const char* s) {
+      write(s, strlen(s));
+      return *this;
+    }
+
+    BufferedWriter& operator<<(const std::string& s) {
+      write(s.data(), s.size());
+      return *this;
+    }
+
+    BufferedWriter& operator<<(double x) {
+      reserve();
+      pos_ = format_double(buf_.data() + pos_, x) - buf_.data();
+      return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value,
+             BufferedWriter&>::type operator<<(T x) {
+      reserve();
+      pos_ = format_int(buf_.data() + pos_, x) - buf_.data();
+      return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value,
+             BufferedWriter&>::type operator<<(T x) {
+      reserve();
+      pos_ = format_uint(buf_.data() + pos_, x) - buf_.data();
+      return *this;
+    }
+
+  private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    // room for one formatted number
+    void reserve() {
+      if (BUFFER_SIZE - pos_ < FORMAT_MAX_CHARS) {
+        flush();
+      }
+    }
+
+    FILE* f_;
+    std::string fname_;
+    size_t pos_;
+    std::vector<char> buf_;
+};
+
+#endif // KALLISTO_NUMBER_FORMAT_H
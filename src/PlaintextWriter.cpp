@@ -1,4 +1,5 @@
 #include "PlaintextWriter.h"
+#include "NumberFormat.h"
 
 std::vector<double> counts_to_tpm(const std::vector<double>& est_counts,
     const std::vector<double>& eff_lens) {
@@ -32,7 +33,7 @@ void plaintext_writer(
     const std::vector<int>& lens
     ){
 
-  std::ofstream of;
+  BufferedWriter of;
   of.open( out_name );
 
   if (!of.is_open()) {
@@ -48,7 +49,7 @@ void plaintext_writer(
     << "length" << "\t"
     << "eff_length" << "\t"
     << "est_counts" << "\t"
-    << "tpm" << std::endl;
+    << "tpm" << '\n';
 
   for (auto i = 0; i < alpha.size(); ++i) {
     of << targ_ids[i] << '\t'
@@ -56,7 +57,7 @@ void plaintext_writer(
       << lens[i] << '\t'
       << eff_lens[i] << '\t'
       << alpha[i] << '\t'
-      << tpm[i] << std::endl;
+      << tpm[i] << '\n';
   }
 
   of.close();
@@ -95,7 +96,8 @@ void plaintext_aux(
     const std::string& version,
     const std::string& index_v,
     const std::string& start_time,
-    const std::string& call) {
+    const std::string& call,
+    const RunStats* stats) {
   std::ofstream of;
   of.open( out_name );
 
@@ -106,8 +108,11 @@ void plaintext_aux(
     to_json("kallisto_version", version, true) << std::endl <<
     to_json("index_version", index_v, false) << std::endl <<
     to_json("start_time", start_time, true) << std::endl <<
-    to_json("call", call, true, false) << std::endl <<
-    "}" << std::endl;
+    to_json("call", call, true, stats != nullptr) << std::endl;
+  if (stats) {
+    of << to_json("stats", stats->json(1), false, false) << std::endl;
+  }
+  of << "}" << std::endl;
 
   of.close();
 }
@@ -115,52 +120,153 @@ void plaintext_aux(
  
 void writeBatchMatrix(
   const std::string &prefix,
-  const KmerIndex &index,
+  const EcTable &ecs,
   const std::vector<std::string> &ids,
-  std::vector<std::vector<int>> &counts) {
+  const std::vector<SparseCounts> &counts,
+  const std::string &format) {
 
     std::string ecfilename = prefix + ".ec";
-    std::string countsfilename = prefix + ".tsv";
     std::string cellnamesfilename = prefix + ".cells";
 
-    std::ofstream ecof, countsof, cellsof;
-    ecof.open(ecfilename.c_str(), std::ios::out);
+    BufferedWriter ecof, cellsof;
+    if (!ecof.open(ecfilename)) {
+      std::cerr << "Error: Couldn't open file: " << ecfilename << std::endl;
+      exit(1);
+    }
     // output equivalence classes in the form "EC TXLIST";
-    for (int i = 0; i < index.ecmap.size(); i++) {
-      ecof << i << "\t";
+    for (int i = 0; i < ecs.size(); i++) {
+      ecof << i << '\t';
       // output the rest of the class
-      const auto &v = index.ecmap[i];
+      const auto &v = ecs[i];
       bool first = true;
       for (auto x : v) {
         if (!first) {
-          ecof << ",";
+          ecof << ',';
         } else {
           first = false;
         }
         ecof << x;
       }
-      ecof << "\n";
+      ecof << '\n';
     }
     ecof.close();
 
     // write cell ids, one line per id
-    cellsof.open(cellnamesfilename.c_str(), std::ios::out);
+    if (!cellsof.open(cellnamesfilename)) {
+      std::cerr << "Error: Couldn't open file: " << cellnamesfilename << std::endl;
+      exit(1);
+    }
     for (int j = 0; j < ids.size(); j++) {
-      cellsof << ids[j] << "\n";
+      cellsof << ids[j] << '\n';
     }
     cellsof.close();
-    
-    countsof.open(countsfilename.c_str(), std::ios::out);
-    if (!counts.empty()) {      
+
+    if (format == "mtx") {
+      writeBatchMatrixMtx(prefix + ".mtx", ecs.size(), counts);
+    } else if (format == "csr") {
+      writeBatchMatrixCsr(prefix + ".csr", ecs.size(), counts);
+    } else {
+      BufferedWriter countsof;
+      std::string countsfilename = prefix + ".tsv";
+      if (!countsof.open(countsfilename)) {
+        std::cerr << "Error: Couldn't open file: " << countsfilename << std::endl;
+        exit(1);
+      }
       for (int j = 0; j < counts.size(); j++) {
-        const auto &v = counts[j];
-        for (int i = 0; i < v.size(); i++) {
-          if (v[i] != 0) {
-            countsof << i << "\t" << j << "\t" << v[i] << "\n";
-          }
+        for (const auto &t : counts[j]) {
+          countsof << t.first << '\t' << j << '\t' << t.second << '\n';
         }
       }
+      countsof.close();
     }
-    countsof.close();
+}
+
+void writeBatchMatrixMtx(
+  const std::string &fname,
+  size_t num_ecs,
+  const std::vector<SparseCounts> &counts) {
+
+  size_t nnz = 0;
+  for (const auto &c : counts) {
+    nnz += c.size();
+  }
 
+  BufferedWriter of;
+  if (!of.open(fname)) {
+    std::cerr << "Error: Couldn't open file: " << fname << std::endl;
+    exit(1);
+  }
+  of << "%%MatrixMarket matrix coordinate integer general\n"
+     << counts.size() << ' ' << num_ecs << ' ' << nnz << '\n';
+  for (size_t j = 0; j < counts.size(); j++) {
+    for (const auto &t : counts[j]) {
+      of << (j + 1) << ' ' << (t.first + 1) << ' ' << t.second << '\n';
+    }
+  }
+  of.close();
+}
+
+// appends x as little-endian, whatever the byte order of the host
+template <typename T>
+static void appendLE(std::string &o, T x) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    o.push_back((char) (((uint64_t) x >> (8 * i)) & 0xff));
+  }
+}
+
+void writeBatchMatrixCsr(
+  const std::string &fname,
+  size_t num_ecs,
+  const std::vector<SparseCounts> &counts) {
+
+  std::ofstream out;
+  out.open(fname, std::ios::out | std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Error: Couldn't open file: " << fname << std::endl;
+    exit(1);
+  }
+
+  uint64_t nnz = 0;
+  for (const auto &c : counts) {
+    nnz += c.size();
+  }
+
+  std::string buf = "KCSR";
+  appendLE<uint32_t>(buf, 1); // version
+  appendLE<uint64_t>(buf, counts.size());
+  appendLE<uint64_t>(buf, num_ecs);
+  appendLE<uint64_t>(buf, nnz);
+
+  uint64_t offset = 0;
+  appendLE<uint64_t>(buf, offset);
+  for (const auto &c : counts) {
+    offset += c.size();
+    appendLE<uint64_t>(buf, offset);
+    if (buf.size() >= (1 << 20)) {
+      out.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+
+  // one row at a time through a small buffer, never the whole array
+  for (const auto &c : counts) {
+    for (const auto &t : c) {
+      appendLE<uint32_t>(buf, t.first);
+    }
+    out.write(buf.data(), buf.size());
+    buf.clear();
+  }
+  for (const auto &c : counts) {
+    for (const auto &t : c) {
+      appendLE<uint32_t>(buf, t.second);
+    }
+    out.write(buf.data(), buf.size());
+    buf.clear();
+  }
+
+  out.close();
+  if (!out) {
+    std::cerr << "Error: could not write to " << fname << std::endl;
+    exit(1);
+  }
 }
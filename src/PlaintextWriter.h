@@ -2,6 +2,7 @@
 #define KALLISTO_PLAINTEXT_WRITER_H
 
 #include <assert.h>
+#include <cstdint>
 #include <cstdlib>
 
 #include <iostream>
@@ -10,6 +11,11 @@
 #include <vector>
 
 #include "KmerIndex.h"
+#include "MinCollector.h"
+#include "RunStats.h"
+
+std::vector<double> counts_to_tpm(const std::vector<double>& est_counts,
+    const std::vector<double>& eff_lens);
 
 void plaintext_writer(
     const std::string& out_name,
@@ -30,12 +36,33 @@ void plaintext_aux(
     const std::string& version,
     const std::string& index_v,
     const std::string& start_time,
-    const std::string& call);
+    const std::string& call,
+    const RunStats* stats = nullptr);
 
+// writes prefix.ec, prefix.cells and the cell x ec counts in one of
+//   "tsv": prefix.tsv, one "ec<TAB>cell<TAB>count" line per nonzero count
+//   "mtx": prefix.mtx, Matrix Market coordinate format, rows are cells and
+//          columns are ECs (both 1-based)
+//   "csr": prefix.csr, binary compressed sparse rows, rows are cells:
+//          char[4] "KCSR", uint32 version (1),
+//          uint64 rows, uint64 cols, uint64 nnz,
+//          uint64 indptr[rows+1], uint32 indices[nnz], uint32 data[nnz]
+//          all little-endian, row i spans [indptr[i], indptr[i+1])
 void writeBatchMatrix(
   const std::string &prefix,
-  const KmerIndex &index,
+  const EcTable &ecs,
   const std::vector<std::string> &ids,
-  std::vector<std::vector<int>> &counts);
+  const std::vector<SparseCounts> &counts,
+  const std::string &format = "tsv");
+
+void writeBatchMatrixMtx(
+  const std::string &fname,
+  size_t num_ecs,
+  const std::vector<SparseCounts> &counts);
+
+void writeBatchMatrixCsr(
+  const std::string &fname,
+  size_t num_ecs,
+  const std::vector<SparseCounts> &counts);
 
 #endif
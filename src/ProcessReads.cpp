@@ -14,6 +14,9 @@
 #include "common.h"
 */
 
+#include <cctype>
+#include <cstring>
+#include <unistd.h>
 #include <fstream>
 
 #include "ProcessReads.h"
@@ -66,7 +69,7 @@ int findFirstMappingKmer(const std::vector<std::pair<KmerEntry,int>> &v,KmerEntr
   return p;
 }
 
-int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, std::vector<std::vector<int>> &batchCounts) {
+int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, std::vector<SparseCounts> &batchCounts, RunStats* stats) {
   int limit = 1048576; 
   std::vector<std::pair<const char*, int>> seqs;
   seqs.reserve(limit/50);
@@ -101,13 +104,31 @@ int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector&
   std::cerr << "[quant] finding pseudoalignments for all files ..."; std::cerr.flush();
   
 
-  MasterProcessor MP(index, opt, tc);
+  MasterProcessor MP(index, opt, tc, stats);
   MP.processReads();
   numreads = MP.numreads;
   nummapped = MP.nummapped;
-  batchCounts = std::move(MP.batchCounts);
+  if (stats) {
+    stats->setCounter("n_pseudoaligned", nummapped);
+  }
+  // merge the per-cell maps into sorted lists, releasing each map as we go
+  batchCounts.clear();
+  batchCounts.resize(MP.batchCounts.size());
+  for (int id = 0; id < MP.batchCounts.size(); id++) {
+    auto &c = MP.batchCounts[id];
+    auto &sc = batchCounts[id];
+    sc.reserve(c.size());
+    for (const auto &t : c) {
+      if (t.second != 0) {
+        sc.push_back(t);
+      }
+    }
+    std::sort(sc.begin(), sc.end());
+    std::unordered_map<int, int>().swap(c);
+  }
 
-  std::cerr << " done" << std::endl;
+  // the progress reports have ended the "finding pseudoalignments" line
+  std::cerr << ((MP.progress && MP.progress->printed()) ? "[quant] done" : " done") << std::endl;
 
   if (opt.bias) {
     std::cerr << "[quant] learning parameters for sequence specific bias" << std::endl;
@@ -129,7 +150,7 @@ int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector&
 
 }
 
-int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc) {
+int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, RunStats* stats) {
 
   int limit = 1048576;
   std::vector<std::pair<const char*, int>> seqs;
@@ -159,8 +180,10 @@ int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc)
     std::cerr << "[quant] running in single-end mode" << std::endl;
   }
 
-  for (int i = 0; i < opt.files.size(); i += (paired) ? 2 : 1) {
-    if (paired) {
+  for (int i = 0; i < opt.files.size(); i += (paired && !opt.interleaved && !isBamFile(opt.files[i])) ? 2 : 1) {
+    if (paired && (opt.interleaved || isBamFile(opt.files[i]))) {
+      std::cerr << "[quant] will process pairs in file " << i+1 << ": " << opt.files[i] << std::endl;
+    } else if (paired) {
       std::cerr << "[quant] will process pair " << (i/2 +1) << ": "  << opt.files[i] << std::endl
                 << "                             " << opt.files[i+1] << std::endl;
     } else {
@@ -171,15 +194,19 @@ int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc)
   // for each file
   std::cerr << "[quant] finding pseudoalignments for the reads ..."; std::cerr.flush();
 
-  if (opt.pseudobam) {
+  if (opt.pseudobam && !opt.bam) {
     index.writePseudoBamHeader(std::cout);
   }
 
-  MasterProcessor MP(index, opt, tc);
+  MasterProcessor MP(index, opt, tc, stats);
   MP.processReads();
   numreads = MP.numreads;
   nummapped = MP.nummapped;
-  std::cerr << " done" << std::endl;
+  std::cerr << ((MP.progress && MP.progress->printed()) ? "[quant] done" : " done") << std::endl;
+  if (stats) {
+    stats->setCounter("n_pseudoaligned", nummapped);
+    stats->setCounter("n_new_ecs", tc.ecs.added().size());
+  }
 
   //std::cout << "betterCount = " << betterCount << ", out of betterCand = " << betterCand << std::endl;
 
@@ -214,9 +241,95 @@ int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc)
 
 
 
+/** -- UMI sets -- **/
+
+bool encodeUMI(const std::string& umi, uint64_t& code) {
+  if (umi.size() > 31) {
+    return false;
+  }
+  code = 1;
+  for (char c : umi) {
+    uint64_t b;
+    switch (c) {
+      case 'A': b = 0; break;
+      case 'C': b = 1; break;
+      case 'G': b = 2; break;
+      case 'T': b = 3; break;
+      default: return false;
+    }
+    code = (code << 2) | b;
+  }
+  return true;
+}
+
+bool UMISet::insert(int ec, uint64_t umi) {
+  if (2 * (n + 1) > ecs.size()) {
+    grow();
+  }
+  size_t mask = ecs.size() - 1;
+  size_t i = hash(ec, umi) & mask;
+  while (ecs[i] != -1) {
+    if (ecs[i] == ec && umis[i] == umi) {
+      return false;
+    }
+    i = (i + 1) & mask;
+  }
+  ecs[i] = ec;
+  umis[i] = umi;
+  ++n;
+  return true;
+}
+
+uint64_t UMISet::intern(const std::string& umi) {
+  return interned.emplace(umi, UMI_INTERNED | interned.size()).first->second;
+}
+
+void UMISet::clear() {
+  n = 0;
+  std::vector<int>().swap(ecs);
+  std::vector<uint64_t>().swap(umis);
+  std::unordered_map<std::string, uint64_t>().swap(interned);
+}
+
+void UMISet::grow() {
+  std::vector<int> old_ecs;
+  std::vector<uint64_t> old_umis;
+  old_ecs.swap(ecs);
+  old_umis.swap(umis);
+  ecs.assign(std::max<size_t>(1024, 2 * old_ecs.size()), -1);
+  umis.assign(ecs.size(), 0);
+  size_t mask = ecs.size() - 1;
+  for (size_t j = 0; j < old_ecs.size(); j++) {
+    if (old_ecs[j] != -1) {
+      size_t i = hash(old_ecs[j], old_umis[j]) & mask;
+      while (ecs[i] != -1) {
+        i = (i + 1) & mask;
+      }
+      ecs[i] = old_ecs[j];
+      umis[i] = old_umis[j];
+    }
+  }
+}
+
+
 /** -- read processors -- **/
 
 void MasterProcessor::processReads() {
+  if (opt.progress > 0 || !opt.status_file.empty()) {
+    std::vector<std::string> inputs;
+    if (!opt.batch_mode) {
+      inputs = opt.files;
+    } else {
+      for (const auto &fs : opt.batch_files) {
+        batchInputBase.push_back(inputs.size());
+        inputs.insert(inputs.end(), fs.begin(), fs.end());
+      }
+    }
+    progress.reset(new Progress(inputs, opt.threads, opt.progress, opt.status_file));
+    SR.progress = progress.get();
+    progress->start();
+  }
+
   // start worker threads
   if (!opt.batch_mode) {
     std::vector<std::thread> workers;
@@ -228,6 +341,9 @@ void MasterProcessor::processReads() {
     for (int i = 0; i < opt.threads; i++) {
       workers[i].join(); //wait for them to finish
     }
+    if (progress) {
+      progress->stop();
+    }
 
     // now handle the modification of the mincollector
     for (auto &t : newECcount) {
@@ -241,63 +357,37 @@ void MasterProcessor::processReads() {
       }
     }
   } else {
-    std::vector<std::thread> workers;
     int num_ids = opt.batch_ids.size();
-    int id =0;
-    while (id < num_ids) {
-      // TODO: put in thread pool
-      workers.clear();
-      int nt = std::min(opt.threads, (num_ids - id));
-      for (int i = 0; i < nt; i++,id++) {
-        workers.emplace_back(std::thread(ReadProcessor(index, opt, tc, *this, id)));
-      }
-      
-      for (int i = 0; i < nt; i++) {
-        workers[i].join();
-      }
-      
-      if (opt.umi) {
-        // process the regular EC umi now
-        for (int i = 0; i < nt; i++) {
-          int l_id = id - nt + i;
-          auto &umis = batchUmis[l_id];
-          std::sort(umis.begin(), umis.end());
-          size_t sz = umis.size();
-          nummapped += sz;
-          if (sz > 0) {
-            ++batchCounts[l_id][umis[0].first];
-          }
-          for (int j = 1; j < sz; j++) {
-            if (umis[j-1] != umis[j]) {
-              ++batchCounts[l_id][umis[j].first];
-            }
-          }
-          umis.clear();
-        }
-      }
+    // persistent pool, the workers pick up cells (and parts of cells) from
+    // nextBatchBuffer until every cell has been read
+    std::vector<std::thread> workers;
+    int nt = std::max(1, std::min(opt.threads, num_ids));
+    for (int i = 0; i < nt; i++) {
+      workers.emplace_back(std::thread(ReadProcessor(index, opt, tc, *this)));
     }
-    
-    int num_newEcs = 0;
+    for (int i = 0; i < nt; i++) {
+      workers[i].join();
+    }
+    if (progress) {
+      progress->stop();
+    }
+
+    // the counts are sparse so new ecs need no extra room per cell
     if (!opt.umi) {      
       // for each cell
       for (int id = 0; id < num_ids; id++) {
         // for each new ec
         for (auto &t : newBatchECcount[id]) {
-          // add the ec and count number of new ecs
+          // add the ec
           if (t.second <= 0) {
             continue;          
           }
-          int ecsize = index.ecmap.size();
-          int ec = tc.increaseCount(t.first);
-          if (ec != -1 && ecsize < index.ecmap.size()) {          
-            num_newEcs++; 
-          }
+          tc.increaseCount(t.first);
         }
       }
       // for each cell
       for (int id = 0; id < num_ids; id++) {
         auto& c = batchCounts[id];
-        c.resize(c.size() + num_newEcs,0);
         // for each new ec
         for (auto &t : newBatchECcount[id]) {
           // count the ec
@@ -316,49 +406,160 @@ void MasterProcessor::processReads() {
         // for each new ec
         for (auto &t : newBatchECumis[id]) {
           // add the new ec
-          int ecsize = index.ecmap.size();
-          int ec = tc.increaseCount(t.first);
-          if (ec != -1 && ecsize < index.ecmap.size()) {
-            num_newEcs++;  
-          }
+          tc.increaseCount(t.first);
         }
       }
       // for each cell
       for (int id = 0; id < num_ids; id++) {
         auto& c = batchCounts[id];
-        c.resize(c.size() + num_newEcs,0);
-        std::vector<std::pair<int, std::string>> umis;
-        umis.reserve(newBatchECumis[id].size());
+        // the new ecs were not in the cell's set, so they get their own
+        UMISet umis;
         // for each new ec
         for (auto &t : newBatchECumis[id]) {
-          // record the ec,umi          
+          // count unique ec,umi
           int ec = tc.findEC(t.first);
-          umis.push_back({ec, std::move(t.second)});
+          uint64_t code;
+          if (!encodeUMI(t.second, code)) {
+            code = umis.intern(t.second);
+          }
+          if (umis.insert(ec, code)) {
+            ++c[ec];
+          }
         }
-        // find unique umis per ec
-        std::sort(umis.begin(), umis.end());
-        size_t sz = umis.size();
-        if (sz > 0) {
-          ++batchCounts[id][umis[0].first];
+        std::vector<std::pair<std::vector<int>, std::string>>().swap(newBatchECumis[id]);
+        for (const auto &x : c) {
+          num_umi += x.second;
         }
-        for (int j = 1; j < sz; j++) {
-          if (umis[j-1] != umis[j]) {
-            ++batchCounts[id][umis[j].first];
+      }
+    }
+  }
+
+  if (opt.fusion) {
+    writeFusionSummary(index, opt.output + "/fusion_summary.txt", fusionTable);
+  }
+
+  if (bamSorter) {
+    BamIndex bai(index.num_trans);
+    bamSorter->merge(*bamWriter, bai);
+    bamSorter.reset();
+    bamWriter->close();
+    std::string baifile = opt.output + "/pseudoalignments.bam.bai";
+    if (!bai.write(baifile, *bamWriter)) {
+      std::cerr << "Error: could not write " << baifile << std::endl;
+      exit(1);
+    }
+  }
+  if (bamWriter) {
+    bamWriter->close();
+  }
+}
+
+bool MasterProcessor::nextBatchBuffer(ReadProcessor& rp) {
+  int id = rp.id;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(batch_lock);
+      if (id == -1 || batchCells[id]->exhausted) {
+        if (nextBatchCell < batchCells.size()) {
+          // start a new cell
+          id = nextBatchCell++;
+          auto &SR = batchCells[id]->SR;
+          SR.reset(new SequenceReader());
+          SR->files = opt.batch_files[id];
+          if (opt.umi) {
+            SR->umi_files = {opt.umi_files[id]};
+          }
+          SR->paired = !opt.single_end;
+          if (progress) {
+            SR->progress = progress.get();
+            SR->progress_base = batchInputBase[id];
           }
+          activeBatchCells.push_back(id);
+        } else if (!activeBatchCells.empty()) {
+          // steal from the running cell with the fewest helpers
+          id = activeBatchCells[0];
+          for (int a : activeBatchCells) {
+            if (batchCells[a]->pending < batchCells[id]->pending) {
+              id = a;
+            }
+          }
+        } else {
+          return false;
         }
-        for (auto x : c) {
-          num_umi += x;
-        }        
       }
+      ++batchCells[id]->pending;
+    }
+
+    rp.id = id;
+    auto &cell = *batchCells[id];
+    bool got = false;
+    {
+      std::lock_guard<std::mutex> lock(cell.lock);
+      if (cell.SR && !cell.SR->empty()) {
+        cell.SR->fetchSequences(rp.buffer, rp.bufsize, rp.seqs, rp.names, rp.quals, rp.umis, false);
+        got = !rp.seqs.empty();
+      }
+      if (!got) {
+        // closes the files
+        cell.SR.reset();
+      }
+    }
+    if (got) {
+      return true;
     }
+    doneBatchBuffer(id, true);
   }
 }
 
-void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::vector<int> > &newEcs, 
-                            std::vector<std::pair<int, std::string>>& ec_umi, std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, 
-                            int n, std::vector<int>& flens, std::vector<int> &bias, int id) {
+void MasterProcessor::doneBatchBuffer(int id, bool exhausted) {
+  bool finished = false;
+  {
+    std::lock_guard<std::mutex> lock(batch_lock);
+    auto &cell = *batchCells[id];
+    if (exhausted && !cell.exhausted) {
+      cell.exhausted = true;
+      activeBatchCells.erase(std::find(activeBatchCells.begin(), activeBatchCells.end(), id));
+    }
+    --cell.pending;
+    finished = cell.exhausted && cell.pending == 0;
+  }
+  if (finished) {
+    finishBatchCell(id);
+  }
+}
+
+void MasterProcessor::finishBatchCell(int id) {
+  // every buffer of the cell has been merged, its (ec, umi) set is done
+  batchCells[id]->umis.clear();
+}
+
+int MasterProcessor::update(const std::vector<int>& c, const std::vector<std::vector<int> > &newEcs, 
+                            std::vector<std::pair<int, uint64_t>>& ec_umi, std::vector<std::pair<int, std::string>>& ec_umi_str,
+                            std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, 
+                            int n, std::vector<int>& flens, std::vector<int> &bias, int id, ThreadStats* ts) {
+  if (opt.batch_mode && opt.umi) {
+    // count each (ec, umi) the first time the cell sees it, this only needs
+    // the lock of the cell
+    auto &cell = *batchCells[id];
+    auto &cellCounts = batchCounts[id];
+    std::lock_guard<std::mutex> lock(cell.umi_lock);
+    for (const auto &t : ec_umi) {
+      if (cell.umis.insert(t.first, t.second)) {
+        ++cellCounts[t.first];
+      }
+    }
+    for (const auto &t : ec_umi_str) {
+      if (cell.umis.insert(t.first, cell.umis.intern(t.second))) {
+        ++cellCounts[t.first];
+      }
+    }
+  }
+
   // acquire the writer lock
+  double t0 = wallSeconds();
   std::lock_guard<std::mutex> lock(this->writer_lock);
+  double t1 = wallSeconds();
+  int mapped = nummapped;
 
   if (!opt.batch_mode) {
     for (int i = 0; i < c.size(); i++) {
@@ -367,15 +568,16 @@ void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::v
     }
   } else {
     if (!opt.umi) {
+      auto &bc = batchCounts[id];
       for (int i = 0; i < c.size(); i++) {
-        batchCounts[id][i] += c[i];
-        nummapped += c[i];
+        if (c[i] != 0) {
+          bc[i] += c[i];
+          nummapped += c[i];
+        }
       }
     } else {
-      for (auto &t : ec_umi) {
-        batchUmis[id].push_back(std::move(t));
-      }
-    }    
+      nummapped += ec_umi.size() + ec_umi_str.size();
+    }
   }
 
   if (!opt.batch_mode) {
@@ -420,33 +622,74 @@ void MasterProcessor::update(const std::vector<int>& c, const std::vector<std::v
   }
 
   numreads += n;
+  if (ts) {
+    ts->writer_wait += t1 - t0;
+    ts->writer_hold += wallSeconds() - t1;
+  }
+  return nummapped - mapped;
   // releases the lock
 }
 
-void MasterProcessor::outputFusion(const std::stringstream &o) {
-  std::string os = o.str();
-  if (!os.empty()) {
+void MasterProcessor::outputFusion(const std::string &o) {
+  if (!o.empty()) {
     std::lock_guard<std::mutex> lock(this->writer_lock);
-    ofusion << os << "\n";
+    ofusion << o;
+  }
+}
+
+void MasterProcessor::mergeFusion(FusionTable &t) {
+  std::lock_guard<std::mutex> lock(this->writer_lock);
+  for (auto &x : t) {
+    auto &st = fusionTable[x.first];
+    st.count += x.second.count;
+    for (const auto &p : x.second.pos1) {
+      st.pos1[p.first] += p.second;
+    }
+    for (const auto &p : x.second.pos2) {
+      st.pos2[p.first] += p.second;
+    }
+  }
+  t.clear();
+}
+
+void MasterProcessor::writePseudoBam(int chunk, std::string &records) {
+  std::unique_lock<std::mutex> lock(pseudobam_lock);
+  // the next chunk in order never waits, the others can only get so far
+  // ahead of it before their output has to wait in memory
+  pseudobam_cv.wait(lock, [&] { return chunk < nextPseudoBamChunk + 4 * opt.threads; });
+  if (chunk != nextPseudoBamChunk) {
+    pendingPseudoBam[chunk] = std::move(records);
+    records.clear();
+    return;
+  }
+  emitPseudoBam(records);
+  ++nextPseudoBamChunk;
+  auto it = pendingPseudoBam.begin();
+  while (it != pendingPseudoBam.end() && it->first == nextPseudoBamChunk) {
+    emitPseudoBam(it->second);
+    it = pendingPseudoBam.erase(it);
+    ++nextPseudoBamChunk;
+  }
+  lock.unlock();
+  pseudobam_cv.notify_all();
+}
+
+void MasterProcessor::emitPseudoBam(const std::string &records) {
+  if (bamWriter) {
+    bamWriter->write(records);
+  } else if (fwrite(records.data(), 1, records.size(), stdout) != records.size()) {
+    std::cerr << "Error: could not write pseudobam output" << std::endl;
+    exit(1);
   }
 }
 
 
 ReadProcessor::ReadProcessor(const KmerIndex& index, const ProgramOptions& opt, const MinCollector& tc, MasterProcessor& mp, int _id) :
- paired(!opt.single_end), tc(tc), index(index), mp(mp), id(_id) {
+ paired(!opt.single_end), tc(tc), index(index), mp(mp), id(_id), chunk(-1), firstRead(0) {
    // initialize buffer
    bufsize = 1ULL<<23;
    buffer = new char[bufsize];
 
-   if (opt.batch_mode) {
-     assert(id != -1);
-     batchSR.files = opt.batch_files[id];
-     if (opt.umi) {
-       batchSR.umi_files = {opt.umi_files[id]};
-     }
-     batchSR.paired = !opt.single_end;
-   }
-
    seqs.reserve(bufsize/50);
    if (opt.umi) {
     umis.reserve(bufsize/50);
@@ -457,13 +700,14 @@ ReadProcessor::ReadProcessor(const KmerIndex& index, const ProgramOptions& opt,
 }
 
 ReadProcessor::ReadProcessor(ReadProcessor && o) :
+  bufsize(o.bufsize),
   paired(o.paired),
   tc(o.tc),
   index(o.index),
   mp(o.mp),
-  id(o.id),
-  bufsize(o.bufsize),
   numreads(o.numreads),
+  id(o.id),
+  chunk(o.chunk),
   seqs(std::move(o.seqs)),
   names(std::move(o.names)),
   quals(std::move(o.quals)),
@@ -471,7 +715,12 @@ ReadProcessor::ReadProcessor(ReadProcessor && o) :
   newEcs(std::move(o.newEcs)),
   flens(std::move(o.flens)),
   bias5(std::move(o.bias5)),
-  batchSR(std::move(o.batchSR)),
+  pseudobam(std::move(o.pseudobam)),
+  pseudobamScratch(std::move(o.pseudobamScratch)),
+  sortBuffer(std::move(o.sortBuffer)),
+  fusionScratch(std::move(o.fusionScratch)),
+  fusionOut(std::move(o.fusionOut)),
+  firstRead(o.firstRead),
   counts(std::move(o.counts)) {
     buffer = o.buffer;
     o.buffer = nullptr;
@@ -486,35 +735,185 @@ ReadProcessor::~ReadProcessor() {
 }
 
 void ReadProcessor::operator()() {
+  int worker = mp.numWorkers++;
+  auto addStats = [&] {
+    if (mp.stats) {
+      mp.stats->addThread(threadStats);
+      mp.stats->addMatch(matchStats);
+    }
+  };
   while (true) {
+    double t0 = wallSeconds();
     // grab the reader lock
     if (mp.opt.batch_mode) {
-      if (batchSR.empty()) {
+      // picks the cell, sets id
+      if (!mp.nextBatchBuffer(*this)) {
+        addStats();
         return;
-      } else {
-        batchSR.fetchSequences(buffer, bufsize, seqs, names, quals, umis, false);
       }
+      threadStats.reader_hold += wallSeconds() - t0;
     } else {
       std::lock_guard<std::mutex> lock(mp.reader_lock);
+      double t1 = wallSeconds();
+      threadStats.reader_wait += t1 - t0;
       if (mp.SR.empty()) {
         // nothing to do
+        if (mp.bamSorter) {
+          mp.bamSorter->finish(sortBuffer);
+        }
+        if (mp.opt.fusion) {
+          mp.mergeFusion(fusionOut.table);
+        }
+        addStats();
         return;
       } else {
         // get new sequences
         mp.SR.fetchSequences(buffer, bufsize, seqs, names, quals, umis, mp.opt.pseudobam || mp.opt.fusion);
+        chunk = mp.numChunks++;
+        firstRead = mp.numFetched;
+        mp.numFetched += paired ? seqs.size()/2 : seqs.size();
       }
+      threadStats.reader_hold += wallSeconds() - t1;
       // release the reader lock
     }
+    double t2 = wallSeconds();
+    if (mp.stats) {
+      mp.stats->addEvent("read", worker, t0, t2 - t0);
+    }
 
     // process our sequences
     processBuffer();
+    if (mp.opt.fusion) {
+      mp.outputFusion(fusionOut.dump);
+      fusionOut.dump.clear();
+    }
+    if (mp.bamSorter) {
+      mp.bamSorter->add(sortBuffer, chunk, pseudobam);
+      pseudobam.clear();
+    } else if (mp.opt.pseudobam) {
+      mp.writePseudoBam(chunk, pseudobam);
+      pseudobam.clear();
+    }
+
+    double t3 = wallSeconds();
+    threadStats.busy += t3 - t2;
 
     // update the results, MP acquires the lock
-    mp.update(counts, newEcs, ec_umi, new_ec_umi, paired ? seqs.size()/2 : seqs.size(), flens, bias5, id);
+    int n = paired ? seqs.size()/2 : seqs.size();
+    int mapped = mp.update(counts, newEcs, ec_umi, ec_umi_str, new_ec_umi, n, flens, bias5, id, &threadStats);
+    if (mp.progress) {
+      mp.progress->addReads(worker, n, mapped);
+    }
+    if (mp.opt.batch_mode) {
+      mp.doneBatchBuffer(id);
+    }
+    threadStats.buffers++;
+    if (mp.stats) {
+      mp.stats->addEvent("process", worker, t2, t3 - t2);
+      mp.stats->addEvent("merge", worker, t3, wallSeconds() - t3);
+    }
     clear();
   }
 }
 
+void filterPseudoalignment(const KmerIndex& index, const MinCollector& tc, const ProgramOptions& opt,
+  const char *s1, const std::vector<std::pair<KmerEntry,int>>& v1,
+  const char *s2, const std::vector<std::pair<KmerEntry,int>>& v2,
+  bool paired, std::vector<int>& u, std::vector<int>& vtmp) {
+  // If we have paired end reads where one end maps or single end reads, check if some transcsripts
+  // are not compatible with the mean fragment length
+  if (!opt.umi && !u.empty() && (!paired || v1.empty() || v2.empty()) && tc.has_mean_fl) {
+    vtmp.clear();
+    // inspect the positions
+    int fl = (int) tc.get_mean_frag_len();
+    int p = -1;
+    KmerEntry val;
+    Kmer km;
+
+    if (!v1.empty()) {
+      p = findFirstMappingKmer(v1,val);
+      km = Kmer((s1+p));
+    }
+    if (!v2.empty()) {
+      p = findFirstMappingKmer(v2,val);
+      km = Kmer((s2+p));
+    }
+
+    // for each transcript in the pseudoalignment
+    for (auto tr : u) {
+      auto x = index.findPosition(tr, km, val, p);
+      // if the fragment is within bounds for this transcript, keep it
+      if (x.second && x.first + fl <= index.target_lens_[tr]) {
+        vtmp.push_back(tr);
+      } else {
+        //pass
+      }
+      if (!x.second && x.first - fl >= 0) {
+        vtmp.push_back(tr);
+      } else {
+        //pass
+      }
+    }
+
+    if (vtmp.size() < u.size()) {
+      u = vtmp; // copy
+    }
+  }
+  
+  if (opt.strand_specific && !u.empty()) {
+    int p = -1;
+    Kmer km;
+    KmerEntry val;
+    if (!v1.empty()) {
+      vtmp.clear();
+      bool firstStrand = (opt.strand == ProgramOptions::StrandType::FR); // FR have first read mapping forward
+      p = findFirstMappingKmer(v1,val);
+      km = Kmer((s1+p));
+      bool strand = (val.isFw() == (km == km.rep())); // k-mer maps to fw strand?
+      // might need to optimize this
+      const auto &c = index.dbGraph.contigs[val.contig];
+      for (auto tr : u) {
+        for (auto ctx : c.transcripts) {
+          if (tr == ctx.trid) {
+            if ((strand == ctx.sense) == firstStrand) {
+              // swap out 
+              vtmp.push_back(tr);
+            } 
+            break;
+          }
+        }          
+      }
+      if (vtmp.size() < u.size()) {
+        u = vtmp; // copy
+      }
+    }
+    
+    if (!v2.empty()) {
+      vtmp.clear();
+      bool secondStrand = (opt.strand == ProgramOptions::StrandType::RF);
+      p = findFirstMappingKmer(v2,val);
+      km = Kmer((s2+p));
+      bool strand = (val.isFw() == (km == km.rep())); // k-mer maps to fw strand?
+      // might need to optimize this
+      const auto &c = index.dbGraph.contigs[val.contig];
+      for (auto tr : u) {
+        for (auto ctx : c.transcripts) {
+          if (tr == ctx.trid) {
+            if ((strand == ctx.sense) == secondStrand) {
+              // swap out 
+              vtmp.push_back(tr);
+            } 
+            break;
+          }
+        }          
+      }
+      if (vtmp.size() < u.size()) {
+        u = vtmp; // copy
+      }
+    }
+  }
+}
+
 void ReadProcessor::processBuffer() {
   // set up thread variables
   std::vector<std::pair<KmerEntry,int>> v1, v2;
@@ -576,9 +975,9 @@ void ReadProcessor::processBuffer() {
     u.clear();
 
     // process read
-    index.match(s1,l1, v1);
+    index.match(s1,l1, v1, &matchStats);
     if (paired) {
-      index.match(s2,l2, v2);
+      index.match(s2,l2, v2, &matchStats);
     }
 
     // collect the target information
@@ -586,7 +985,7 @@ void ReadProcessor::processBuffer() {
     int r = tc.intersectKmers(v1, v2, !paired,u);
     if (u.empty()) {
       if (mp.opt.fusion && !(v1.empty() || v2.empty())) {
-        searchFusion(index,mp.opt,tc,mp,ec,names[i-1].first,s1,v1,names[i].first,s2,v2,paired);
+        searchFusion(index,mp.opt,tc,mp,ec,names[i-1].first,s1,v1,names[i].first,s2,v2,paired,fusionScratch,fusionOut,firstRead+numreads-1);
       }
     } else {
       ec = tc.findEC(u);
@@ -594,99 +993,7 @@ void ReadProcessor::processBuffer() {
 
 
     /* --  possibly modify the pseudoalignment  -- */
-
-    // If we have paired end reads where one end maps or single end reads, check if some transcsripts
-    // are not compatible with the mean fragment length
-    if (!mp.opt.umi && !u.empty() && (!paired || v1.empty() || v2.empty()) && tc.has_mean_fl) {
-      vtmp.clear();
-      // inspect the positions
-      int fl = (int) tc.get_mean_frag_len();
-      int p = -1;
-      KmerEntry val;
-      Kmer km;
-
-      if (!v1.empty()) {
-        p = findFirstMappingKmer(v1,val);
-        km = Kmer((s1+p));
-      }
-      if (!v2.empty()) {
-        p = findFirstMappingKmer(v2,val);
-        km = Kmer((s2+p));
-      }
-
-      // for each transcript in the pseudoalignment
-      for (auto tr : u) {
-        auto x = index.findPosition(tr, km, val, p);
-        // if the fragment is within bounds for this transcript, keep it
-        if (x.second && x.first + fl <= index.target_lens_[tr]) {
-          vtmp.push_back(tr);
-        } else {
-          //pass
-        }
-        if (!x.second && x.first - fl >= 0) {
-          vtmp.push_back(tr);
-        } else {
-          //pass
-        }
-      }
-
-      if (vtmp.size() < u.size()) {
-        u = vtmp; // copy
-      }
-    }
-    
-    if (mp.opt.strand_specific && !u.empty()) {
-      int p = -1;
-      Kmer km;
-      KmerEntry val;
-      if (!v1.empty()) {
-        vtmp.clear();
-        bool firstStrand = (mp.opt.strand == ProgramOptions::StrandType::FR); // FR have first read mapping forward
-        p = findFirstMappingKmer(v1,val);
-        km = Kmer((s1+p));
-        bool strand = (val.isFw() == (km == km.rep())); // k-mer maps to fw strand?
-        // might need to optimize this
-        const auto &c = index.dbGraph.contigs[val.contig];
-        for (auto tr : u) {
-          for (auto ctx : c.transcripts) {
-            if (tr == ctx.trid) {
-              if ((strand == ctx.sense) == firstStrand) {
-                // swap out 
-                vtmp.push_back(tr);
-              } 
-              break;
-            }
-          }          
-        }
-        if (vtmp.size() < u.size()) {
-          u = vtmp; // copy
-        }
-      }
-      
-      if (!v2.empty()) {
-        vtmp.clear();
-        bool secondStrand = (mp.opt.strand == ProgramOptions::StrandType::RF);
-        p = findFirstMappingKmer(v2,val);
-        km = Kmer((s2+p));
-        bool strand = (val.isFw() == (km == km.rep())); // k-mer maps to fw strand?
-        // might need to optimize this
-        const auto &c = index.dbGraph.contigs[val.contig];
-        for (auto tr : u) {
-          for (auto ctx : c.transcripts) {
-            if (tr == ctx.trid) {
-              if ((strand == ctx.sense) == secondStrand) {
-                // swap out 
-                vtmp.push_back(tr);
-              } 
-              break;
-            }
-          }          
-        }
-        if (vtmp.size() < u.size()) {
-          u = vtmp; // copy
-        }
-      }
-    }
+    filterPseudoalignment(index, tc, mp.opt, s1, v1, s2, v2, paired, u, vtmp);
 
     // find the ec
     if (!u.empty()) {
@@ -705,7 +1012,12 @@ void ReadProcessor::processBuffer() {
         if (ec == -1 || ec >= counts.size()) {
           new_ec_umi.emplace_back(u, std::move(umis[i]));          
         } else {
-          ec_umi.emplace_back(ec, std::move(umis[i]));
+          uint64_t code;
+          if (encodeUMI(umis[i], code)) {
+            ec_umi.emplace_back(ec, code);
+          } else {
+            ec_umi_str.emplace_back(ec, std::move(umis[i]));
+          }
         }
       }
 
@@ -735,21 +1047,14 @@ void ReadProcessor::processBuffer() {
         outputPseudoBam(index, u,
           s1, names[i-1].first, quals[i-1].first, l1, names[i-1].second, v1,
           s2, names[i].first, quals[i].first, l2, names[i].second, v2,
-          paired);
+          paired, pseudobam, pseudobamScratch, mp.opt.bam);
       } else {
         outputPseudoBam(index, u,
           s1, names[i].first, quals[i].first, l1, names[i].second, v1,
           nullptr, nullptr, nullptr, 0, 0, v2,
-          paired);
+          paired, pseudobam, pseudobamScratch, mp.opt.bam);
       }
     }
-
-
-
-    /*
-    if (opt.verbose && numreads % 100000 == 0 ) {
-      std::cerr << "[quant] Processed " << pretty_num(numreads) << std::endl;
-    }*/
   }
 
 }
@@ -761,6 +1066,7 @@ void ReadProcessor::clear() {
   counts.clear();
   counts.resize(tc.counts.size(),0);
   ec_umi.clear();
+  ec_umi_str.clear();
   new_ec_umi.clear();
 }
 
@@ -768,7 +1074,190 @@ void ReadProcessor::clear() {
 
 
 
+/** -- UMI reader -- **/
+UMIReader::~UMIReader() {
+  close();
+}
+
+void UMIReader::open(const std::string& fname) {
+  close();
+  fp = gzopen(fname.c_str(), "r");
+  if (!fp) {
+    std::cerr << "Error: could not open UMI file " << fname << std::endl;
+    exit(1);
+  }
+  gzbuffer(fp, 1<<20);
+  buf.resize(1<<20);
+  pos = end = 0;
+  eof = false;
+}
+
+void UMIReader::close() {
+  if (fp) {
+    gzclose(fp);
+    fp = 0;
+  }
+  pos = end = 0;
+}
+
+// move the unread data to the front and read more behind it
+bool UMIReader::fill() {
+  if (eof) {
+    return false;
+  }
+  if (pos > 0) {
+    memmove(buf.data(), buf.data() + pos, end - pos);
+    end -= pos;
+    pos = 0;
+  }
+  if (end == buf.size()) {
+    // a line longer than the buffer
+    buf.resize(2 * buf.size());
+  }
+  int r = gzread(fp, buf.data() + end, buf.size() - end);
+  if (r <= 0) {
+    eof = true;
+    return false;
+  }
+  end += r;
+  return true;
+}
+
+bool UMIReader::next(std::string& umi) {
+  umi.clear();
+  if (!fp) {
+    return false;
+  }
+  const char* nl;
+  size_t scanned = 0; // bytes known to contain no newline
+  while ((nl = (const char*) memchr(buf.data() + pos + scanned, '\n', end - pos - scanned)) == nullptr) {
+    scanned = end - pos;
+    if (!fill()) {
+      break;
+    }
+  }
+  const char* p = buf.data() + pos;
+  const char* line_end = nl ? nl : buf.data() + end;
+  if (p == line_end && !nl) {
+    return false; // nothing left
+  }
+  pos = (nl ? nl + 1 : line_end) - buf.data();
+
+  while (p < line_end && isspace(*p)) {
+    ++p;
+  }
+  const char* q = p;
+  while (q < line_end && !isspace(*q)) {
+    ++q;
+  }
+  umi.assign(p, q);
+  return true;
+}
+
 /** -- sequence reader -- **/
+
+// "-" is standard input. gzip and plain text are both read as a stream, so
+// pipes and FIFOs work the same as files.
+static gzFile openReads(const std::string& fn) {
+  gzFile fp;
+  if (fn == "-") {
+    fp = gzdopen(dup(fileno(stdin)), "r");
+  } else {
+    fp = gzopen(fn.c_str(), "r");
+  }
+  if (fp == nullptr) {
+    std::cerr << "Error: could not open " << ((fn == "-") ? "standard input" : fn) << std::endl;
+    exit(1);
+  }
+  // fewer reads per system call, pipes only hand over 64KB at a time
+  gzbuffer(fp, 1<<20);
+  return fp;
+}
+
+static void swapRecords(kseq_t *a, kseq_t *b) {
+  std::swap(a->name, b->name);
+  std::swap(a->comment, b->comment);
+  std::swap(a->seq, b->seq);
+  std::swap(a->qual, b->qual);
+}
+
+static void assignRecord(kseq_t *ks, const BamRead& r) {
+  for (auto x : {std::make_pair(&ks->name, &r.name), std::make_pair(&ks->seq, &r.seq),
+                 std::make_pair(&ks->qual, &r.qual)}) {
+    kstring_t& k = *x.first;
+    const std::string& v = *x.second;
+    if (k.m < v.size() + 1) {
+      k.m = v.size() + 1;
+      kroundup32(k.m);
+      k.s = (char*) realloc(k.s, k.m);
+    }
+    memcpy(k.s, v.c_str(), v.size() + 1);
+    k.l = v.size();
+  }
+}
+
+// the BAM reader stands in for kseq, the records end up in seq1 and seq2
+void SequenceReader::readNextBam() {
+  l1 = l2 = -1;
+  if (paired) {
+    if (bam->nextPair(bam1, bam2)) {
+      assignRecord(seq1, bam1);
+      assignRecord(seq2, bam2);
+      l1 = bam1.seq.size();
+      l2 = bam2.seq.size();
+    }
+  } else if (bam->next(bam1)) {
+    assignRecord(seq1, bam1);
+    l1 = bam1.seq.size();
+  }
+}
+
+// reads the next record, or pair of records, into seq1 and seq2
+void SequenceReader::readNext() {
+  if (bam) {
+    readNextBam();
+    return;
+  }
+  l1 = kseq_read(seq1);
+  if (!paired) {
+    return;
+  }
+  if (!interleaved) {
+    l2 = kseq_read(seq2);
+    return;
+  }
+  // seq2 only holds the second read, both come from the stream of seq1
+  l2 = -1;
+  if (l1 > 0) {
+    swapRecords(seq1, seq2);
+    l2 = kseq_read(seq1);
+    swapRecords(seq1, seq2);
+    if (l2 <= 0) {
+      std::cerr << std::endl << "[~warn] " << files[current_file]
+                << " has an odd number of reads, ignoring the last one" << std::endl;
+    }
+  }
+}
+
+void SequenceReader::reportProgress() {
+  if (!progress) {
+    return;
+  }
+  // compressed offsets, gzoffset is -1 where the input cannot seek
+  if (bam) {
+    progress->setConsumed(progress_base + file1, bam->offset());
+    return;
+  }
+  z_off_t off = fp1 ? gzoffset(fp1) : -1;
+  if (off >= 0) {
+    progress->setConsumed(progress_base + file1, off);
+  }
+  off = (file2 >= 0 && fp2) ? gzoffset(fp2) : -1;
+  if (off >= 0) {
+    progress->setConsumed(progress_base + file2, off);
+  }
+}
+
 SequenceReader::~SequenceReader() {
   if (fp1) {
     gzclose(fp1);
@@ -778,9 +1267,7 @@ SequenceReader::~SequenceReader() {
   }
 
   kseq_destroy(seq1);
-  if (paired) {
-    kseq_destroy(seq2);
-  }
+  kseq_destroy(seq2);
   
   // check if umi stream is open, then close
 }
@@ -794,7 +1281,6 @@ bool SequenceReader::fetchSequences(char *buf, const int limit, std::vector<std:
   std::vector<std::string> &umis, 
   bool full) {
     
-  std::string line;
   std::string umi;
   
     
@@ -819,10 +1305,16 @@ bool SequenceReader::fetchSequences(char *buf, const int limit, std::vector<std:
         // close the current file
         if(fp1) {
           gzclose(fp1);
+          fp1 = 0;
         }
         if (paired && fp2) {
           gzclose(fp2);
+          fp2 = 0;
         }
+        kseq_destroy(seq1);
+        kseq_destroy(seq2);
+        seq1 = seq2 = 0;
+        bam.reset();
         // close current umi file
         if (usingUMIfiles) {
           // read up the rest of the files          
@@ -830,16 +1322,33 @@ bool SequenceReader::fetchSequences(char *buf, const int limit, std::vector<std:
         }
         
         // open the next one
-        fp1 = gzopen(files[current_file].c_str(),"r");
-        seq1 = kseq_init(fp1);
-        l1 = kseq_read(seq1);
         state = true;
-        if (paired) {
+        file1 = current_file;
+        file2 = -1;
+        if (isBamFile(files[current_file])) {
+          bam.reset(new BamReader());
+          if (!bam->open(files[current_file], threads)) {
+            std::cerr << "Error: could not read BAM file " << files[current_file] << std::endl;
+            exit(1);
+          }
+          // only used to hold the records
+          seq1 = kseq_init(nullptr);
+          seq2 = kseq_init(nullptr);
+        } else {
+          fp1 = openReads(files[current_file]);
+          seq1 = kseq_init(fp1);
+        }
+        if (bam) {
+          // a BAM file has both ends of every pair
+        } else if (paired && !interleaved) {
           current_file++;
-          fp2 = gzopen(files[current_file].c_str(),"r");
+          file2 = current_file;
+          fp2 = openReads(files[current_file]);
           seq2 = kseq_init(fp2);
-          l2 = kseq_read(seq2);
+        } else if (paired) {
+          seq2 = kseq_init(fp1);
         }
+        readNext();
         if (usingUMIfiles) {
           // open new umi file
           f_umi->open(umi_files[current_file]);          
@@ -865,10 +1374,7 @@ bool SequenceReader::fetchSequences(char *buf, const int limit, std::vector<std:
         seqs.emplace_back(p1,l1);
         
         if (usingUMIfiles) {
-          std::stringstream ss;
-          std::getline(*f_umi, line);
-          ss.str(line);
-          ss >> umi;
+          f_umi->next(umi);
           umis.emplace_back(std::move(umi));
         }
         if (full) {
@@ -899,15 +1405,19 @@ bool SequenceReader::fetchSequences(char *buf, const int limit, std::vector<std:
           }
         }
       } else {
+        reportProgress();
         return true; // read it next time
       }
 
       // read for the next one
-      l1 = kseq_read(seq1);
-      if (paired) {
-        l2 = kseq_read(seq2);
-      }
+      readNext();
     } else {
+      if (progress) {
+        progress->finishInput(progress_base + file1);
+        if (file2 >= 0) {
+          progress->finishInput(progress_base + file2);
+        }
+      }
       current_file++; // move to next file
       state = false; // haven't opened file yet
     }
@@ -928,11 +1438,18 @@ SequenceReader::SequenceReader(SequenceReader&& o) :
   nl1(o.nl1),
   nl2(o.nl2),
   paired(o.paired),
+  interleaved(o.interleaved),
+  threads(o.threads),
+  bam(std::move(o.bam)),
   files(std::move(o.files)),
   umi_files(std::move(o.umi_files)),
   f_umi(std::move(o.f_umi)),
   current_file(o.current_file),
-  state(o.state) {
+  state(o.state),
+  progress(o.progress),
+  progress_base(o.progress_base),
+  file1(o.file1),
+  file2(o.file2) {
   o.fp1 = nullptr;
   o.fp2 = nullptr;
   o.seq1 = nullptr;
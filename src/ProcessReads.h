@@ -14,8 +14,16 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <map>
+#include <tuple>
 
 #include "MinCollector.h"
+#include "BgzfWriter.h"
+#include "BamReader.h"
+#include "BamSorter.h"
+#include "Progress.h"
+#include "PseudoBam.h"
+#include "RunStats.h"
 
 #include "common.h"
 
@@ -24,9 +32,40 @@
 KSEQ_INIT(gzFile, gzread)
 #endif
 
-int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc);
-int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, std::vector<std::vector<int>> &batchCounts);
+// stats, if given, gets the timing of the reader threads and the k-mer lookups
+int ProcessReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, RunStats* stats = nullptr);
+int ProcessBatchReads(KmerIndex& index, const ProgramOptions& opt, MinCollector& tc, std::vector<SparseCounts> &batchCounts, RunStats* stats = nullptr);
 int findFirstMappingKmer(const std::vector<std::pair<KmerEntry,int>> &v,KmerEntry &val);
+// drops the targets in u that the mean fragment length rules out, when only
+// one end (or a single-end read) maps, and those on the wrong strand for
+// stranded libraries. vtmp is scratch space.
+void filterPseudoalignment(const KmerIndex& index, const MinCollector& tc, const ProgramOptions& opt,
+  const char *s1, const std::vector<std::pair<KmerEntry,int>>& v1,
+  const char *s2, const std::vector<std::pair<KmerEntry,int>>& v2,
+  bool paired, std::vector<int>& u, std::vector<int>& vtmp);
+
+// reads one UMI per line, the first whitespace separated token, from a plain
+// or gzipped file. lines are sliced out of a large block buffer.
+class UMIReader {
+public:
+  UMIReader() : fp(0), pos(0), end(0), eof(false) {}
+  ~UMIReader();
+  UMIReader(const UMIReader&) = delete;
+  UMIReader& operator=(const UMIReader&) = delete;
+
+  void open(const std::string& fname);
+  void close();
+  // false once the file is exhausted, umi is then empty
+  bool next(std::string& umi);
+
+private:
+  bool fill();
+
+  gzFile fp;
+  std::vector<char> buf;
+  size_t pos, end; // unread data is buf[pos, end)
+  bool eof;
+};
 
 class SequenceReader {
 public:
@@ -34,14 +73,14 @@ public:
   SequenceReader(const ProgramOptions& opt) :
   fp1(0),fp2(0),seq1(0),seq2(0),
   l1(0),l2(0),nl1(0),nl2(0),
-  paired(!opt.single_end), files(opt.files),
-  f_umi(new std::ifstream{}),
+  paired(!opt.single_end), interleaved(opt.interleaved), threads(opt.threads), files(opt.files),
+  f_umi(new UMIReader()),
   current_file(0), state(false) {}
   SequenceReader() :
   fp1(0),fp2(0),seq1(0),seq2(0),
   l1(0),l2(0),nl1(0),nl2(0),
-  paired(false), 
-  f_umi(new std::ifstream{}),
+  paired(false), interleaved(false), threads(1),
+  f_umi(new UMIReader()),
   current_file(0), state(false) {}
   SequenceReader(SequenceReader&& o);
   
@@ -54,36 +93,132 @@ public:
                       std::vector<std::string>& umis, 
                       bool full=false);
 
+private:
+  void readNext();
+  void readNextBam();
+  // tell progress how far into the open files we are
+  void reportProgress();
+
 public:
   gzFile fp1 = 0, fp2 = 0;
   kseq_t *seq1 = 0, *seq2 = 0;
   int l1,l2,nl1,nl2;
   bool paired;
+  bool interleaved; // paired reads come one after the other from fp1
+  int threads; // for decompressing BAM input
+  std::unique_ptr<BamReader> bam; // set when the current file is BAM
+  BamRead bam1, bam2;
   std::vector<std::string> files;
   std::vector<std::string> umi_files;
-  std::unique_ptr<std::ifstream> f_umi;
+  std::unique_ptr<UMIReader> f_umi;
   int current_file;
   bool state; // is the file open
+  Progress* progress = nullptr;
+  int progress_base = 0; // index of files[0] among the inputs of progress
+  int file1 = -1, file2 = -1; // the open files, -1 for none
+};
+
+// UMIs of up to 31 bases of ACGT are packed 2 bits per base behind a leading
+// 1 bit, so different lengths never collide. anything else is interned per
+// cell and gets an id with UMI_INTERNED set.
+const uint64_t UMI_INTERNED = 1ULL << 63;
+bool encodeUMI(const std::string& umi, uint64_t& code);
+
+// open-addressed set of the (ec, umi) pairs seen in one cell
+class UMISet {
+public:
+  UMISet() : n(0) {}
+  // true if the pair was not in the set yet
+  bool insert(int ec, uint64_t umi);
+  // code for a UMI that encodeUMI could not pack
+  uint64_t intern(const std::string& umi);
+  void clear();
+
+private:
+  void grow();
+  static size_t hash(int ec, uint64_t umi) {
+    uint64_t h = umi ^ (static_cast<uint64_t>(ec) * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  size_t n;
+  std::vector<int> ecs; // -1 marks an empty slot
+  std::vector<uint64_t> umis;
+  std::unordered_map<std::string, uint64_t> interned;
 };
 
+class ReadProcessor;
+
+// a batch mode cell, read one buffer at a time by whichever workers are free
+struct BatchCell {
+  std::unique_ptr<SequenceReader> SR; // only touched under 'lock'
+  std::mutex lock;
+  int pending = 0; // buffers handed out and not yet merged
+  bool exhausted = false;
+  std::mutex umi_lock; // guards umis and the cell's batchCounts in UMI mode
+  UMISet umis;
+};
+
+// a target a fusion candidate read maps to
+struct FusionTarget {
+  int tr;
+  int pos;
+  bool fw;
+};
+
+// support for one (target1, target2, type) candidate
+struct FusionStats {
+  int count = 0;
+  std::map<int, int> pos1, pos2; // position -> number of reads
+};
+
+// keyed by (target1, target2, 1 for SPLIT or 0 for PAIR), for PAIR target1 <= target2
+typedef std::map<std::tuple<int, int, int>, FusionStats> FusionTable;
+
+struct FusionOutput {
+  std::string dump; // fusion.txt or fusion.bin records of this buffer
+  FusionTable table;
+};
+
+void writeFusionHeader(const KmerIndex& index, const ProgramOptions& opt, std::ofstream& of);
+
 class MasterProcessor {
 public:
-  MasterProcessor (KmerIndex &index, const ProgramOptions& opt, MinCollector &tc)
-    : tc(tc), index(index), opt(opt), SR(opt), numreads(0)
+  MasterProcessor (KmerIndex &index, const ProgramOptions& opt, MinCollector &tc, RunStats* stats = nullptr)
+    : tc(tc), index(index), opt(opt), stats(stats), SR(opt), numreads(0)
     ,nummapped(0), num_umi(0), tlencount(0), biasCount(0), maxBiasCount((opt.bias) ? 1000000 : 0) { 
       if (opt.batch_mode) {
-        batchCounts.resize(opt.batch_ids.size(), {});
-        
-        for (auto &t : batchCounts) {
-          t.resize(tc.counts.size(),0);
+        batchCounts.resize(opt.batch_ids.size());
+        for (size_t i = 0; i < opt.batch_ids.size(); i++) {
+          batchCells.emplace_back(new BatchCell());
         }
         newBatchECcount.resize(opt.batch_ids.size());
         newBatchECumis.resize(opt.batch_ids.size());
-        batchUmis.resize(opt.batch_ids.size());
       }
       if (opt.fusion) {
-        ofusion.open(opt.output + "/fusion.txt");
-        ofusion << "TYPE\tNAME1\tSEQ1\tKPOS1\tNAME2\tSEQ2\tKPOS2\tINFO\tPOS1\tPOS2\n";
+        if (opt.fusion_dump == "text") {
+          ofusion.open(opt.output + "/fusion.txt");
+        } else if (opt.fusion_dump == "binary") {
+          ofusion.open(opt.output + "/fusion.bin", std::ios::out | std::ios::binary);
+        }
+        writeFusionHeader(index, opt, ofusion);
+      }
+      if (opt.pseudobam && opt.bam) {
+        std::string bamfile = opt.output + "/pseudoalignments.bam";
+        bamWriter.reset(new BgzfWriter());
+        if (!bamWriter->open(bamfile, opt.threads)) {
+          std::cerr << "Error: could not open " << bamfile << std::endl;
+          exit(1);
+        }
+        std::string header;
+        appendBamHeader(header, index, opt.sort_bam);
+        bamWriter->write(header);
+        if (opt.sort_bam) {
+          bamSorter.reset(new BamSorter(bamfile + ".tmp", (size_t) opt.sort_memory << 20, opt.threads));
+        }
       }
 
     }
@@ -91,26 +226,68 @@ public:
   std::mutex reader_lock;
   std::mutex writer_lock;
 
-  SequenceReader SR;
   MinCollector& tc;
   KmerIndex& index;
   const ProgramOptions& opt;
+  RunStats* stats;
+  std::atomic<int> numWorkers{0}; // numbers the workers for the trace
+  SequenceReader SR;
   int numreads;
   int nummapped;
   int num_umi;
   std::atomic<int> tlencount;
   std::atomic<int> biasCount;
-  std::vector<std::vector<int>> batchCounts;
+  // ec -> count for each batch cell, only for ecs the cell has seen
+  std::vector<std::unordered_map<int, int>> batchCounts;
   const int maxBiasCount;
   std::unordered_map<std::vector<int>, int, SortedVectorHasher> newECcount;
   std::ofstream ofusion;
-  void outputFusion(const std::stringstream &o);
+  void outputFusion(const std::string &o);
+  FusionTable fusionTable; // candidates of all workers, for fusion_summary.txt
+  void mergeFusion(FusionTable &t);
+  uint64_t numFetched = 0; // reads (pairs) handed out, guarded by reader_lock
+  std::unique_ptr<BgzfWriter> bamWriter;
+  std::unique_ptr<BamSorter> bamSorter; // only with --sort-bam
+  // pseudobam output, each buffer's records are written in the order the
+  // buffers were read so the output does not depend on the thread count
+  int numChunks = 0; // buffers read so far, guarded by reader_lock
+  std::mutex pseudobam_lock;
+  std::condition_variable pseudobam_cv;
+  int nextPseudoBamChunk = 0;
+  std::map<int, std::string> pendingPseudoBam; // finished early, not written yet
+  void writePseudoBam(int chunk, std::string &records);
+  void emitPseudoBam(const std::string &records);
   std::vector<std::unordered_map<std::vector<int>, int, SortedVectorHasher>> newBatchECcount;
-  std::vector<std::vector<std::pair<int, std::string>>> batchUmis;
   std::vector<std::vector<std::pair<std::vector<int>, std::string>>> newBatchECumis;
   void processReads();
 
-  void update(const std::vector<int>& c, const std::vector<std::vector<int>>& newEcs, std::vector<std::pair<int, std::string>>& ec_umi, std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, int n, std::vector<int>& flens, std::vector<int> &bias, int id = -1);
+  // batch mode scheduling. cells are started in order, once all of them are
+  // running idle workers steal buffers from the cells that are still being
+  // read, so a large cell does not hold up the rest of the pool.
+  std::vector<std::unique_ptr<BatchCell>> batchCells;
+  std::mutex batch_lock; // guards the scheduling state below and in BatchCell
+  int nextBatchCell = 0;
+  std::vector<int> activeBatchCells; // started and not exhausted
+  std::vector<int> batchInputBase; // index of each cell's first file among the inputs of progress
+  // fill rp with the next buffer of some cell and set rp.id, false when done
+  bool nextBatchBuffer(ReadProcessor& rp);
+  // called once the buffer of cell 'id' has been merged with update
+  void doneBatchBuffer(int id, bool exhausted = false);
+  void finishBatchCell(int id);
+
+  std::unique_ptr<Progress> progress; // null with --progress=0 and no status file
+
+  // merges the results of a buffer of n reads, returns how many of them pseudoaligned
+  int update(const std::vector<int>& c, const std::vector<std::vector<int>>& newEcs, std::vector<std::pair<int, uint64_t>>& ec_umi, std::vector<std::pair<int, std::string>>& ec_umi_str, std::vector<std::pair<std::vector<int>, std::string>> &new_ec_umi, int n, std::vector<int>& flens, std::vector<int> &bias, int id = -1, ThreadStats* ts = nullptr);
+};
+
+// reused buffers for searchFusion, so the search does not allocate per read
+struct FusionScratch {
+  std::vector<int> u1, u2, ut1, ut2;
+  std::vector<std::pair<KmerEntry,int>> vsafe, vsplit;
+  std::vector<std::pair<int,int>> hits1, hits2; // (read position, ec) of every k-mer in the index
+  std::vector<int> su1, su2; // unions of the hits, sorted
+  std::vector<FusionTarget> t1, t2;
 };
 
 class ReadProcessor {
@@ -122,13 +299,14 @@ public:
   size_t bufsize;
   bool paired;
   const MinCollector& tc;
-  std::vector<std::pair<int, std::string>> ec_umi;
+  std::vector<std::pair<int, uint64_t>> ec_umi;
+  std::vector<std::pair<int, std::string>> ec_umi_str; // UMIs encodeUMI can't pack
   std::vector<std::pair<std::vector<int>, std::string>> new_ec_umi;
   const KmerIndex& index;
   MasterProcessor& mp;
-  SequenceReader batchSR;
   int numreads;
   int id;
+  int chunk; // sequence number of the buffer, for ordering pseudobam output
 
   std::vector<std::pair<const char*, int>> seqs;
   std::vector<std::pair<const char*, int>> names;
@@ -137,6 +315,14 @@ public:
   std::vector<std::vector<int>> newEcs;
   std::vector<int> flens;
   std::vector<int> bias5;
+  std::string pseudobam; // SAM or BAM records of this buffer
+  std::vector<char> pseudobamScratch; // reverse complemented reads for outputPseudoBam
+  BamSortBuffer sortBuffer;
+  FusionScratch fusionScratch;
+  FusionOutput fusionOut;
+  uint64_t firstRead; // number of the first read in the buffer, for fusion.bin
+  ThreadStats threadStats;
+  MatchStats matchStats;
 
   std::vector<int> counts;
 
@@ -0,0 +1,206 @@
+#include "Progress.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#include "PlaintextWriter.h"
+#include "RunStats.h"
+#include "common.h"
+
+static std::string num(double x) {
+  std::ostringstream o;
+  o.precision(6);
+  o << x;
+  return o.str();
+}
+
+static std::string pretty_bytes(uint64_t b) {
+  const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+  double x = b;
+  int u = 0;
+  while (x >= 1024.0 && u < 4) {
+    x /= 1024.0;
+    ++u;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), (u == 0) ? "%.0f %s" : "%.1f %s", x, units[u]);
+  return buf;
+}
+
+static std::string pretty_time(double s) {
+  long t = (long) (s + 0.5);
+  char buf[32];
+  if (t >= 3600) {
+    snprintf(buf, sizeof(buf), "%ldh%02ldm", t / 3600, (t / 60) % 60);
+  } else if (t >= 60) {
+    snprintf(buf, sizeof(buf), "%ldm%02lds", t / 60, t % 60);
+  } else {
+    snprintf(buf, sizeof(buf), "%lds", t);
+  }
+  return buf;
+}
+
+Progress::Progress(const std::vector<std::string>& inputs, int n_workers,
+                   double interval, const std::string& status_file)
+  : inputs_(inputs.size()), workers_(std::max(n_workers, 1)),
+    interval_(interval), status_file_(status_file) {
+  for (size_t i = 0; i < inputs.size(); i++) {
+    inputs_[i].name = inputs[i];
+    struct stat st;
+    if (inputs[i] != "-" && stat(inputs[i].c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      inputs_[i].size = st.st_size;
+    }
+  }
+}
+
+Progress::~Progress() {
+  stop();
+}
+
+void Progress::start() {
+  start_ = last_time_ = wallSeconds();
+  if (!status_file_.empty()) {
+    writeStatus(false, 0.0, 0, 0, 0.0, -1.0);
+  }
+  thread_ = std::thread(&Progress::run, this);
+}
+
+void Progress::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  report(true);
+}
+
+void Progress::finishInput(size_t i) {
+  if (i < inputs_.size() && inputs_[i].size >= 0) {
+    inputs_[i].consumed.store(inputs_[i].size, std::memory_order_relaxed);
+  }
+}
+
+void Progress::run() {
+  auto period = std::chrono::duration<double>((interval_ > 0) ? interval_ : 10.0);
+  std::unique_lock<std::mutex> lock(lock_);
+  while (!cv_.wait_for(lock, period, [this] { return stop_; })) {
+    report(false);
+  }
+}
+
+void Progress::report(bool done) {
+  double now = wallSeconds();
+  double elapsed = now - start_;
+  uint64_t reads = 0, mapped = 0;
+  for (const auto& w : workers_) {
+    reads += w.reads.load(std::memory_order_relaxed);
+    mapped += w.mapped.load(std::memory_order_relaxed);
+  }
+  double rate = (now > last_time_) ? (reads - last_reads_) / (now - last_time_) : 0.0;
+  last_time_ = now;
+  last_reads_ = reads;
+
+  // the ETA assumes the rest of the input goes as fast as the part read so
+  // far, it needs the size of every input
+  uint64_t consumed = 0, total = 0;
+  bool sized = !inputs_.empty();
+  bool counted = false; // gzip read from a pipe has no offset to report
+  for (const auto& in : inputs_) {
+    uint64_t c = in.consumed.load(std::memory_order_relaxed);
+    consumed += c;
+    counted = counted || c > 0 || in.size >= 0;
+    if (in.size < 0) {
+      sized = false;
+    } else {
+      total += in.size;
+    }
+  }
+  double eta = -1.0;
+  if (done) {
+    eta = 0.0;
+  } else if (sized && total > 0 && consumed > 0) {
+    double f = std::min(1.0, (double) consumed / total);
+    eta = elapsed * (1.0 - f) / f;
+  }
+
+  if (!status_file_.empty()) {
+    writeStatus(done, elapsed, reads, mapped, rate, eta);
+  }
+  if (done || interval_ <= 0) {
+    return;
+  }
+
+  if (!printed_) {
+    // finishes the "finding pseudoalignments ..." line
+    std::cerr << std::endl;
+    printed_ = true;
+  }
+  std::cerr << "[progress] " << pretty_num((size_t) reads) << " reads";
+  if (reads > 0) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * mapped / reads);
+    std::cerr << ", " << buf << " pseudoaligned";
+  }
+  std::cerr << ", " << pretty_num((size_t) rate) << " reads/s";
+  if (counted) {
+    std::cerr << ", " << pretty_bytes(consumed);
+    if (sized) {
+      std::cerr << " of " << pretty_bytes(total);
+    }
+    std::cerr << " read";
+  }
+  if (eta >= 0) {
+    std::cerr << ", ETA " << pretty_time(eta);
+  }
+  std::cerr << std::endl;
+}
+
+void Progress::writeStatus(bool done, double elapsed, uint64_t reads, uint64_t mapped,
+                           double rate, double eta) {
+  std::string tmp = status_file_ + ".tmp";
+  std::ofstream of(tmp);
+  of << "{" << std::endl
+     << to_json("state", done ? "done" : "running", true) << std::endl
+     << to_json("elapsed_s", num(elapsed), false) << std::endl
+     << to_json("n_processed", std::to_string(reads), false) << std::endl
+     << to_json("n_pseudoaligned", std::to_string(mapped), false) << std::endl
+     << to_json("p_pseudoaligned", num(reads ? 100.0 * mapped / reads : 0.0), false) << std::endl
+     << to_json("reads_per_s", num(rate), false) << std::endl
+     << to_json("mean_reads_per_s", num(elapsed > 0 ? reads / elapsed : 0.0), false) << std::endl
+     << to_json("eta_s", (eta >= 0) ? num(eta) : "null", false) << std::endl;
+  of << "\t\"inputs\": [" << std::endl;
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    const auto& in = inputs_[i];
+    uint64_t c = in.consumed.load(std::memory_order_relaxed);
+    of << "\t\t{\"file\": \"" << in.name << "\", \"bytes_read\": "
+       << ((c > 0 || in.size >= 0) ? std::to_string(c) : "null") << ", \"bytes_total\": "
+       << ((in.size >= 0) ? std::to_string(in.size) : "null") << "}"
+       << ((i + 1 < inputs_.size()) ? "," : "") << std::endl;
+  }
+  of << "\t]," << std::endl;
+  of << "\t\"threads\": [" << std::endl;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    of << "\t\t{\"n_processed\": " << workers_[i].reads.load(std::memory_order_relaxed)
+       << ", \"n_pseudoaligned\": " << workers_[i].mapped.load(std::memory_order_relaxed) << "}"
+       << ((i + 1 < workers_.size()) ? "," : "") << std::endl;
+  }
+  of << "\t]" << std::endl << "}" << std::endl;
+  of.close();
+
+  if (!of.good() || rename(tmp.c_str(), status_file_.c_str()) != 0) {
+    if (!status_failed_) {
+      std::cerr << std::endl << "[~warn] could not write the status file " << status_file_ << std::endl;
+      status_failed_ = true;
+    }
+  }
+}
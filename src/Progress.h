@@ -0,0 +1,84 @@
+#ifndef KALLISTO_PROGRESS_H
+#define KALLISTO_PROGRESS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reports how far the read processing has got while it runs: reads per
+// second, the fraction pseudoaligned, how much of each input file has been
+// read and an estimate of the time left. A background thread wakes up every
+// interval and sums counters that the workers bump once per buffer, so the
+// workers never wait on it.
+//
+// The report goes to stderr and, if a status file is given, to a small JSON
+// file that is replaced with rename(), so whoever polls it never sees half a
+// file.
+class Progress {
+public:
+  // interval is in seconds, with 0 nothing is printed but the status file is
+  // still updated every 10 seconds
+  Progress(const std::vector<std::string>& inputs, int n_workers,
+           double interval, const std::string& status_file);
+  ~Progress();
+
+  void start();
+  // stops the thread and writes the final status
+  void stop();
+  // whether any report was printed to stderr
+  bool printed() const { return printed_; }
+
+  // worker finished a buffer of n reads, mapped of which pseudoaligned
+  void addReads(int worker, uint64_t n, uint64_t mapped) {
+    auto& w = workers_[worker % workers_.size()];
+    w.reads.fetch_add(n, std::memory_order_relaxed);
+    w.mapped.fetch_add(mapped, std::memory_order_relaxed);
+  }
+  // bytes of input i read so far, called by whoever reads it
+  void setConsumed(size_t i, uint64_t bytes) {
+    if (i < inputs_.size()) {
+      inputs_[i].consumed.store(bytes, std::memory_order_relaxed);
+    }
+  }
+  // input i has been read to the end
+  void finishInput(size_t i);
+
+private:
+  struct Input {
+    std::string name;
+    int64_t size = -1; // -1 for pipes and standard input
+    std::atomic<uint64_t> consumed{0};
+  };
+  struct Counters {
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> mapped{0};
+    char pad[48]; // each worker gets its own cache line
+  };
+
+  void run();
+  void report(bool done);
+  void writeStatus(bool done, double elapsed, uint64_t reads, uint64_t mapped,
+                   double rate, double eta);
+
+  std::vector<Input> inputs_;
+  std::vector<Counters> workers_;
+  double interval_;
+  std::string status_file_;
+  bool printed_ = false;
+  bool status_failed_ = false; // warned about the status file already
+
+  double start_ = 0.0;
+  double last_time_ = 0.0; // time and reads of the previous report
+  uint64_t last_reads_ = 0;
+
+  std::thread thread_;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+#endif // KALLISTO_PROGRESS_H
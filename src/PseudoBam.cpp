@@ -1,16 +1,35 @@
 #include "PseudoBam.h"
+#include "NumberFormat.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
 
 /** --- pseudobam functions -- **/
 
 void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
     const char *s1, const char *n1, const char *q1, int slen1, int nlen1, const std::vector<std::pair<KmerEntry,int>>& v1,
     const char *s2, const char *n2, const char *q2, int slen2, int nlen2, const std::vector<std::pair<KmerEntry,int>>& v2,
-    bool paired) {
+    bool paired, std::string &out, std::vector<char> &rev, bool bam) {
+
+  // reverse complemented read and reversed quality
+  int maxlen = std::max(slen1, slen2) + 1;
+  if (rev.size() < 2 * (size_t) maxlen) {
+    rev.resize(2 * maxlen);
+  }
+  char *buf1 = rev.data();
+  char *buf2 = rev.data() + maxlen;
+  char cig[64];
 
-  static char buf1[32768];
-  static char buf2[32768];
-  static char cig_[1000];
-  char *cig = &cig_[0];
+  auto emit = [&](const PseudoBamRecord &r) {
+    if (bam) {
+      appendBamRecord(out, r);
+    } else {
+      appendSamRecord(out, index, r);
+    }
+  };
 
 
   if (nlen1 > 2 && n1[nlen1-2] == '/') {
@@ -24,12 +43,10 @@ void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
   if (u.empty()) {
     // no mapping
     if (paired) {
-      printf("%s\t77\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n", n1,s1,q1);
-      printf("%s\t141\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n", n2,s2,q2);
-      //o << seq1->name.s << "" << seq1->seq.s << "\t" << seq1->qual.s << "\n";
-      //o << seq2->name.s << "\t141\t*\t0\t0\t*\t*\t0\t0\t" << seq2->seq.s << "\t" << seq2->qual.s << "\n";
+      emit(unmappedRecord(n1, 77, s1, q1, slen1));
+      emit(unmappedRecord(n2, 141, s2, q2, slen2));
     } else {
-      printf("%s\t4\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n", n1,s1,q1);
+      emit(unmappedRecord(n1, 4, s1, q1, slen1));
     }
   } else {
     if (paired) {
@@ -132,7 +149,8 @@ void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
           tlen += (tlen>0) ? 1 : -1;
         }
 
-        printf("%s\t%d\t%s\t%d\t%d\t%s\t=\t%d\t%d\t%s\t%s\tNH:i:%d\n", n1, f1 & 0xFFFF, index.target_names_[tr].c_str(), posread, (!v1.empty()) ? 255 : 0 , cig, posmate, tlen, (f1 & 0x10) ? &buf1[0] : s1, (f1 & 0x10) ? &buf2[0] : q1, nmap);
+        emit({n1, f1 & 0xFFFF, tr, posread, (!v1.empty()) ? 255 : 0, cig, tr, posmate, tlen,
+              (f1 & 0x10) ? &buf1[0] : s1, (f1 & 0x10) ? &buf2[0] : q1, slen1, nmap});
         if (v1.empty()) {
           break; // only report primary alignment
         }
@@ -188,7 +206,8 @@ void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
           tlen += (tlen > 0) ? 1 : -1;
         }
 
-        printf("%s\t%d\t%s\t%d\t%d\t%s\t=\t%d\t%d\t%s\t%s\tNH:i:%d\n", n2, f2 & 0xFFFF, index.target_names_[tr].c_str(), posread, (!v2.empty()) ? 255 : 0, cig, posmate, tlen, (f2 & 0x10) ? &buf1[0] : s2,  (f2 & 0x10) ? &buf2[0] : q2, nmap);
+        emit({n2, f2 & 0xFFFF, tr, posread, (!v2.empty()) ? 255 : 0, cig, tr, posmate, tlen,
+              (f2 & 0x10) ? &buf1[0] : s2, (f2 & 0x10) ? &buf2[0] : q2, slen2, nmap});
         if(v2.empty()) {
           break; // only print primary alignment
         }
@@ -227,7 +246,8 @@ void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
         int dummy=1;
         getCIGARandSoftClip(cig, bool(f1 & 0x10), (f1 & 0x04) == 0, posread, dummy, slen1, index.target_lens_[tr]);
 
-        printf("%s\t%d\t%s\t%d\t255\t%s\t*\t%d\t%d\t%s\t%s\tNH:i:%d\n", n1, f1 & 0xFFFF, index.target_names_[tr].c_str(), posread, cig, 0, 0, (f1 & 0x10) ? &buf1[0] : s1, (f1 & 0x10) ? &buf2[0] : q1, nmap);
+        emit({n1, f1 & 0xFFFF, tr, posread, 255, cig, -1, 0, 0,
+              (f1 & 0x10) ? &buf1[0] : s1, (f1 & 0x10) ? &buf2[0] : q1, slen1, nmap});
       }
     }
   }
@@ -282,3 +302,166 @@ void getCIGARandSoftClip(char* cig, bool strand, bool mapped, int &posread, int
     posmate = 1;
   }
 }
+
+
+PseudoBamRecord unmappedRecord(const char *name, int flag, const char *seq, const char *qual, int len) {
+  return {name, flag, -1, 0, 0, "*", -1, 0, 0, seq, qual, len, -1};
+}
+
+void appendSamRecord(std::string &out, const KmerIndex &index, const PseudoBamRecord &r) {
+  char num[FORMAT_MAX_CHARS];
+  auto field = [&](int x) {
+    out.append(num, format_int(num, x) - num);
+    out.push_back('\t');
+  };
+
+  out.append(r.name);
+  out.push_back('\t');
+  field(r.flag);
+  if (r.tid < 0) {
+    out.push_back('*');
+  } else {
+    out.append(index.target_names_[r.tid]);
+  }
+  out.push_back('\t');
+  field(r.pos);
+  field(r.mapq);
+  out.append(r.cigar);
+  out.push_back('\t');
+  out.push_back((r.mtid < 0) ? '*' : '=');
+  out.push_back('\t');
+  field(r.mpos);
+  field(r.tlen);
+  out.append(r.seq);
+  out.push_back('\t');
+  out.append(r.qual);
+  if (r.nh >= 0) {
+    out.append("\tNH:i:");
+    out.append(num, format_int(num, r.nh) - num);
+  }
+  out.push_back('\n');
+}
+
+
+/** --- BAM encoding -- **/
+
+template <typename T>
+static void putLE(std::string &out, T x) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out.push_back((char) ((x >> (8 * i)) & 0xff));
+  }
+}
+
+// bin of the 0-based region [beg, end) as in the SAM specification
+int reg2bin(int beg, int end) {
+  --end;
+  if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+  if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+  if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
+  if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
+  if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+  return 0;
+}
+
+void appendBamHeader(std::string &out, const KmerIndex &index, bool sorted) {
+  std::ostringstream text;
+  index.writePseudoBamHeader(text);
+  std::string t = text.str();
+  if (sorted) {
+    t.insert(t.find('\n'), "\tSO:coordinate");
+  }
+
+  out.append("BAM\1", 4);
+  putLE<int32_t>(out, t.size());
+  out.append(t);
+  putLE<int32_t>(out, index.num_trans);
+  for (int i = 0; i < index.num_trans; i++) {
+    const auto &name = index.target_names_[i];
+    putLE<int32_t>(out, name.size() + 1);
+    out.append(name.c_str(), name.size() + 1);
+    putLE<int32_t>(out, index.target_lens_[i]);
+  }
+}
+
+void appendBamRecord(std::string &out, const PseudoBamRecord &r) {
+  static const char *CIGAR_OPS = "MIDNSHP=X";
+  static const char *SEQ_CODES = "=ACMGRSVTWYHKDBN";
+  static unsigned char seqcode[256];
+  static bool init = [] {
+    for (int i = 0; i < 256; i++) {
+      seqcode[i] = 15; // N
+    }
+    for (int i = 0; i < 16; i++) {
+      seqcode[(unsigned char) SEQ_CODES[i]] = i;
+      seqcode[(unsigned char) tolower(SEQ_CODES[i])] = i;
+    }
+    return true;
+  }();
+  (void) init;
+
+  // the cigar strings we make have at most three ops
+  uint32_t ops[8];
+  int n_ops = 0;
+  int ref_len = 0;
+  if (r.cigar[0] != '*') {
+    const char *c = r.cigar;
+    while (*c && n_ops < 8) {
+      uint32_t n = 0;
+      while (*c >= '0' && *c <= '9') {
+        n = 10 * n + (*c++ - '0');
+      }
+      uint32_t op = strchr(CIGAR_OPS, *c++) - CIGAR_OPS;
+      ops[n_ops++] = (n << 4) | op;
+      if (op == 0 || op == 2 || op == 3 || op == 7 || op == 8) {
+        ref_len += n;
+      }
+    }
+  }
+
+  size_t l_name = strlen(r.name) + 1;
+  int pos = r.pos - 1; // -1 when unset
+  int bin = (pos < 0) ? 4680 : reg2bin(pos, pos + std::max(ref_len, 1));
+
+  size_t start = out.size();
+  putLE<int32_t>(out, 0); // block_size, filled in below
+  putLE<int32_t>(out, r.tid);
+  putLE<int32_t>(out, pos);
+  out.push_back((char) l_name);
+  out.push_back((char) r.mapq);
+  putLE<uint16_t>(out, bin);
+  putLE<uint16_t>(out, n_ops);
+  putLE<uint16_t>(out, r.flag);
+  putLE<int32_t>(out, r.len);
+  putLE<int32_t>(out, r.mtid);
+  putLE<int32_t>(out, r.mpos - 1);
+  putLE<int32_t>(out, r.tlen);
+  out.append(r.name, l_name);
+  for (int i = 0; i < n_ops; i++) {
+    putLE<uint32_t>(out, ops[i]);
+  }
+  for (int i = 0; i < r.len; i += 2) {
+    unsigned char b = seqcode[(unsigned char) r.seq[i]] << 4;
+    if (i + 1 < r.len) {
+      b |= seqcode[(unsigned char) r.seq[i+1]];
+    }
+    out.push_back((char) b);
+  }
+  for (int i = 0; i < r.len; i++) {
+    out.push_back((char) (r.qual[i] - 33));
+  }
+  if (r.nh >= 0) {
+    out.append("NH", 2);
+    if (r.nh < 256) {
+      out.push_back('C');
+      out.push_back((char) r.nh);
+    } else {
+      out.push_back('I');
+      putLE<uint32_t>(out, r.nh);
+    }
+  }
+
+  uint32_t block_size = out.size() - start - 4;
+  for (int i = 0; i < 4; i++) {
+    out[start + i] = (char) ((block_size >> (8 * i)) & 0xff);
+  }
+}
@@ -1,12 +1,44 @@
+#ifndef KALLISTO_PSEUDOBAM_H
+#define KALLISTO_PSEUDOBAM_H
+
+#include <string>
 #include <vector>
 #include <iostream>
 #include <utility>
 
 #include "KmerIndex.h"
 
+// one line of pseudobam output, positions are 1-based as in SAM, 0 if unset
+struct PseudoBamRecord {
+  const char *name;
+  int flag;
+  int tid;  // target, -1 for '*'
+  int pos;
+  int mapq;
+  const char *cigar;
+  int mtid; // mate target, -1 for '*'
+  int mpos;
+  int tlen;
+  const char *seq;
+  const char *qual;
+  int len;
+  int nh;   // NH tag, -1 for none
+};
+
+// appends the SAM lines, or BAM records if bam is set, for one read (pair)
+// to out. Only touches out and rev, so every thread can format into its own
+// buffer. rev is scratch space for the reverse complemented reads.
 void outputPseudoBam(const KmerIndex &index, const std::vector<int> &u,
                     const char *s1, const char *n1, const char *q1, int slen1, int nlen1, const std::vector<std::pair<KmerEntry,int>>& v1,
                     const char *s2, const char *n2, const char *q2, int slen2, int nlen2, const std::vector<std::pair<KmerEntry,int>>& v2,
-                    bool paired);
+                    bool paired, std::string &out, std::vector<char> &rev, bool bam = false);
+PseudoBamRecord unmappedRecord(const char *name, int flag, const char *seq, const char *qual, int len);
+void appendSamRecord(std::string &out, const KmerIndex &index, const PseudoBamRecord &r);
+// uncompressed BAM header and records, to be written through a BgzfWriter
+void appendBamHeader(std::string &out, const KmerIndex &index, bool sorted = false);
+void appendBamRecord(std::string &out, const PseudoBamRecord &r);
+int reg2bin(int beg, int end);
 void revseq(char *b1, char *b2, const char *s, const char *q, int n);
 void getCIGARandSoftClip(char* cig, bool strand, bool mapped, int &posread, int &posmate, int length, int targetlength);
+
+#endif // KALLISTO_PSEUDOBAM_H
@@ -0,0 +1,146 @@
+#include "Quant.h"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "ProcessReads.h"
+#include "MinCollector.h"
+#include "EMAlgorithm.h"
+#include "weights.h"
+#include "Bootstrap.h"
+#include "H5Writer.h"
+#include "PlaintextWriter.h"
+
+int RunQuant(KmerIndex& index, const ProgramOptions& opt, const std::string& call,
+  const std::string& start_time, RunStats& stats) {
+  if (opt.fusion) {
+    // need full transcript sequences
+    RunStats::Stage stage(&stats, "load_sequences");
+    index.loadTranscriptSequences(opt.threads);
+  }
+  MinCollector collection(index, opt);
+  int num_processed = 0;
+  {
+    RunStats::Stage stage(&stats, "pseudoalign");
+    num_processed = ProcessReads(index, opt, collection, &stats);
+  }
+
+  // save modified index for future use
+  if (opt.write_index) {
+    RunStats::Stage stage(&stats, "write_index");
+    index.write((opt.output + "/index.saved"), false, collection.ecs.added());
+  }
+
+  // if mean FL not provided, estimate
+  std::vector<int> fld;
+  if (opt.fld == 0.0) {
+    fld = collection.flens; // copy
+    collection.compute_mean_frag_lens_trunc();
+  } else {
+    auto mean_fl = (opt.fld > 0.0) ? opt.fld : collection.get_mean_frag_len();
+    auto sd_fl = opt.sd;
+    collection.init_mean_fl_trunc( mean_fl, sd_fl );
+    //fld.resize(MAX_FRAG_LEN,0); // no obersvations
+    fld = trunc_gaussian_counts(0, MAX_FRAG_LEN, mean_fl, sd_fl, 10000);
+
+    // for (size_t i = 0; i < collection.mean_fl_trunc.size(); ++i) {
+    //   cout << "--- " << i << '\t' << collection.mean_fl_trunc[i] << std::endl;
+    // }
+  }
+
+  std::vector<int> preBias(4096,1);
+  if (opt.bias) {
+    preBias = collection.bias5; // copy
+  }
+
+  auto fl_means = get_frag_len_means(index.target_lens_, collection.mean_fl_trunc);
+
+  /*for (int i = 0; i < collection.bias3.size(); i++) {
+    std::cout << i << "\t" << collection.bias3[i] << "\t" << collection.bias5[i] << "\n";
+    }*/
+
+  EMAlgorithm em(collection.counts, index, collection, fl_means, opt);
+  {
+    RunStats::Stage stage(&stats, "em");
+    em.run(10000, 50, true, opt.bias);
+  }
+  stats.setCounter("em_rounds", em.rounds_);
+  if (opt.bias) {
+    stats.setCounter("em_bias_update_s", em.eff_len_seconds_);
+  }
+
+  H5Writer writer;
+  {
+    RunStats::Stage stage(&stats, "write_abundance");
+    if (!opt.plaintext) {
+      writer.init(opt.output + "/abundance.h5", opt.bootstrap, num_processed, fld, preBias, em.post_bias_, 6,
+          index.INDEX_VERSION, call, start_time, opt.bootstrap_matrix);
+      writer.write_main(em, index.target_names_, index.target_lens_);
+    }
+
+    plaintext_writer(opt.output + "/abundance.tsv", em.target_names_,
+        em.alpha_, em.eff_lens_, index.target_lens_);
+  }
+
+  if (opt.bootstrap > 0) {
+    RunStats::Stage stage(&stats, "bootstrap");
+    auto B = opt.bootstrap;
+    std::mt19937_64 rand;
+    rand.seed( opt.seed );
+
+    std::vector<size_t> seeds;
+    for (auto s = 0; s < B; ++s) {
+      seeds.push_back( rand() );
+    }
+
+    BootstrapContext bs_ctx(collection.counts, index, collection, fl_means);
+
+    if (opt.threads > 1 || opt.bootstrap_batch > 1) {
+      auto n_threads = opt.threads;
+      if (opt.threads > opt.bootstrap) {
+        std::cerr
+          << "[~warn] number of threads (" << opt.threads <<
+          ") greater than number of bootstraps" << std::endl
+          << "[~warn] (cont'd) updating threads to number of bootstraps "
+          << opt.bootstrap << std::endl;
+        n_threads = opt.bootstrap;
+      }
+
+      BootstrapThreadPool pool(n_threads, seeds, bs_ctx, index,
+          collection, em.eff_lens_, opt, writer, fl_means);
+    } else {
+      Bootstrap bs(bs_ctx, index, collection, fl_means, opt);
+      for (auto b = 0; b < B; ++b) {
+        std::cerr << "[bstrp] running EM for the bootstrap: " << b + 1 << "\r";
+        const auto& res = bs.run_em(seeds[b]);
+
+        if (!opt.plaintext) {
+          writer.write_bootstrap(res, b);
+        } else {
+          plaintext_writer(opt.output + "/bs_abundance_" + std::to_string(b) + ".tsv",
+              em.target_names_, res.alpha_, em.eff_lens_, index.target_lens_);
+        }
+      }
+    }
+
+    std::cerr << std::endl;
+  }
+
+  // last, so it has the time of every stage
+  plaintext_aux(
+      opt.output + "/run_info.json",
+      std::string(std::to_string(index.num_trans)),
+      std::string(std::to_string(opt.bootstrap)),
+      std::string(std::to_string(num_processed)),
+      KALLISTO_VERSION,
+      std::string(std::to_string(index.INDEX_VERSION)),
+      start_time,
+      call,
+      &stats);
+  if (stats.tracing() && !stats.writeTrace(opt.output + "/trace.json")) {
+    std::cerr << "Error: could not write " << opt.output << "/trace.json" << std::endl;
+  }
+
+  return num_processed;
+}
@@ -0,0 +1,19 @@
+#ifndef KALLISTO_QUANT_H
+#define KALLISTO_QUANT_H
+
+#include <string>
+
+#include "common.h"
+#include "KmerIndex.h"
+#include "RunStats.h"
+
+// Pseudoaligns the reads in opt.files against a loaded index, runs the EM
+// and the bootstraps and writes everything to opt.output, what
+// 'kallisto quant' does after loading the index. 'call' and 'start_time'
+// go into run_info.json and abundance.h5, and so do the stages timed in
+// stats, along with those already in it (e.g. loading the index). Returns
+// the number of reads processed.
+int RunQuant(KmerIndex& index, const ProgramOptions& opt, const std::string& call,
+  const std::string& start_time, RunStats& stats);
+
+#endif // KALLISTO_QUANT_H
@@ -0,0 +1,124 @@
+#include "RunStats.h"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <sys/resource.h>
+
+#include "PlaintextWriter.h"
+
+double cpuSeconds() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+void RunStats::addStage(const std::string& name, double start, double wall, double cpu) {
+  std::lock_guard<std::mutex> lock(lock_);
+  stages_.push_back({name, {wall, cpu}});
+  if (trace_) {
+    events_.push_back({name, -1, start, wall});
+  }
+}
+
+void RunStats::addEvent(const char* name, int thread, double start, double dur) {
+  if (!trace_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(lock_);
+  events_.push_back({name, thread, start, dur});
+}
+
+void RunStats::addThread(const ThreadStats& t) {
+  std::lock_guard<std::mutex> lock(lock_);
+  threads_.push_back(t);
+}
+
+void RunStats::addMatch(const MatchStats& m) {
+  std::lock_guard<std::mutex> lock(lock_);
+  match_.add(m);
+}
+
+void RunStats::setCounter(const std::string& name, double value) {
+  std::lock_guard<std::mutex> lock(lock_);
+  for (auto& c : counters_) {
+    if (c.first == name) {
+      c.second = value;
+      return;
+    }
+  }
+  counters_.push_back({name, value});
+}
+
+static std::string num(double x) {
+  std::ostringstream o;
+  o.precision(6);
+  o << x;
+  return o.str();
+}
+
+std::string RunStats::json(int level) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::string tabs(level, '\t');
+  std::ostringstream o;
+  o << "{" << std::endl;
+
+  o << tabs << "\t\"stages\": [" << std::endl;
+  for (size_t i = 0; i < stages_.size(); i++) {
+    o << tabs << "\t\t{\"name\": \"" << stages_[i].first << "\", \"wall_s\": "
+      << num(stages_[i].second.first);
+    if (cpu_) {
+      o << ", \"cpu_s\": " << num(stages_[i].second.second);
+    }
+    o << "}" << ((i + 1 < stages_.size()) ? "," : "") << std::endl;
+  }
+  o << tabs << "\t]," << std::endl;
+
+  o << tabs << "\t\"threads\": [" << std::endl;
+  for (size_t i = 0; i < threads_.size(); i++) {
+    const auto& t = threads_[i];
+    o << tabs << "\t\t{\"buffers\": " << t.buffers
+      << ", \"busy_s\": " << num(t.busy)
+      << ", \"reader_wait_s\": " << num(t.reader_wait)
+      << ", \"reader_hold_s\": " << num(t.reader_hold)
+      << ", \"writer_wait_s\": " << num(t.writer_wait)
+      << ", \"writer_hold_s\": " << num(t.writer_hold) << "}"
+      << ((i + 1 < threads_.size()) ? "," : "") << std::endl;
+  }
+  o << tabs << "\t]," << std::endl;
+
+  double per_read = match_.reads ? (double) match_.lookups / match_.reads : 0.0;
+  double jump_rate = match_.jumps ? (double) match_.jumps_ok / match_.jumps : 0.0;
+  o << to_json("reads_looked_up", std::to_string(match_.reads), false, true, level + 1) << std::endl
+    << to_json("kmer_lookups_per_read", num(per_read), false, true, level + 1) << std::endl
+    << to_json("skip_ahead_attempts", std::to_string(match_.jumps), false, true, level + 1) << std::endl
+    << to_json("skip_ahead_success_rate", num(jump_rate), false, !counters_.empty(), level + 1) << std::endl;
+  for (size_t i = 0; i < counters_.size(); i++) {
+    o << to_json(counters_[i].first, num(counters_[i].second), false,
+        i + 1 < counters_.size(), level + 1) << std::endl;
+  }
+  o << tabs << "}";
+  return o.str();
+}
+
+bool RunStats::writeTrace(const std::string& fname) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::ofstream of(fname);
+  if (!of.is_open()) {
+    return false;
+  }
+  // complete events in microseconds, the stages on thread 0 and the read
+  // processing threads after it
+  of << "{\"traceEvents\": [" << std::endl;
+  for (size_t i = 0; i < events_.size(); i++) {
+    const auto& e = events_[i];
+    of << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << (e.thread + 1)
+       << std::fixed << std::setprecision(1)
+       << ", \"ts\": " << (e.start - start_) * 1e6 << ", \"dur\": " << e.dur * 1e6 << "}"
+       << ((i + 1 < events_.size()) ? "," : "") << std::endl;
+  }
+  of << "]}" << std::endl;
+  return of.good();
+}
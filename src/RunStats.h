@@ -0,0 +1,113 @@
+#ifndef KALLISTO_RUNSTATS_H
+#define KALLISTO_RUNSTATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Where the time of a run goes: wall and CPU time of every stage, how the
+// read processing threads spent theirs and a few counters from the k-mer
+// lookups and the EM. Written to run_info.json and, with --trace, as a
+// Chrome trace (chrome://tracing or Perfetto) with one span per stage and
+// per buffer of reads.
+//
+// Everything is timed per stage or per buffer, never per read, so keeping
+// these stats costs nothing measurable.
+//
+// The CPU time of a stage (cpu_s) is that of the whole process, so it only
+// means something when the run has the process to itself. Runs that share
+// it, like the jobs of kallisto serve, leave it out.
+
+// seconds on a monotonic clock
+inline double wallSeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+// CPU seconds used by the process, all threads
+double cpuSeconds();
+
+// counted by KmerIndex::match
+struct MatchStats {
+  uint64_t reads = 0; // reads (single ends) looked up
+  uint64_t lookups = 0; // k-mers looked up in the hash table
+  uint64_t jumps = 0; // times match tried to skip ahead along a contig
+  uint64_t jumps_ok = 0; // of those, the ones confirmed by the k-mer jumped to
+
+  void add(const MatchStats& o) {
+    reads += o.reads;
+    lookups += o.lookups;
+    jumps += o.jumps;
+    jumps_ok += o.jumps_ok;
+  }
+};
+
+// how one read processing thread spent its time, in seconds
+struct ThreadStats {
+  double busy = 0.0; // pseudoaligning its buffers
+  double reader_wait = 0.0; // waiting for reader_lock
+  double reader_hold = 0.0; // reading and decompressing under reader_lock
+  double writer_wait = 0.0; // waiting for writer_lock
+  double writer_hold = 0.0; // merging its results under writer_lock
+  int buffers = 0;
+};
+
+class RunStats {
+public:
+  // cpu = false leaves out the CPU time of the stages
+  explicit RunStats(bool trace = false, bool cpu = true)
+    : trace_(trace), cpu_(cpu), start_(wallSeconds()) {}
+
+  // times its scope as a stage of the run, does nothing without stats
+  class Stage {
+  public:
+    Stage(RunStats* stats, const std::string& name)
+      : stats_(stats), name_(name), wall_(wallSeconds()),
+        cpu_((stats && stats->cpu_) ? cpuSeconds() : 0.0) {}
+    ~Stage() {
+      if (stats_) {
+        double cpu = stats_->cpu_ ? cpuSeconds() - cpu_ : 0.0;
+        stats_->addStage(name_, wall_, wallSeconds() - wall_, cpu);
+      }
+    }
+
+  private:
+    RunStats* stats_;
+    std::string name_;
+    double wall_, cpu_;
+  };
+
+  bool tracing() const { return trace_; }
+
+  // start is a wallSeconds() value, the others are durations
+  void addStage(const std::string& name, double start, double wall, double cpu);
+  // a span on a read processing thread, only kept when tracing
+  void addEvent(const char* name, int thread, double start, double dur);
+  void addThread(const ThreadStats& t);
+  void addMatch(const MatchStats& m);
+  void setCounter(const std::string& name, double value);
+
+  // the body of the "stats" object in run_info.json, indented by level tabs
+  std::string json(int level) const;
+  bool writeTrace(const std::string& fname) const;
+
+private:
+  struct Event {
+    std::string name;
+    int thread; // -1 for the stages of the run
+    double start, dur;
+  };
+
+  bool trace_;
+  bool cpu_; // the process is not shared, so its CPU time is the run's
+  double start_;
+  mutable std::mutex lock_;
+  std::vector<std::pair<std::string, std::pair<double, double>>> stages_; // name, (wall, cpu)
+  std::vector<Event> events_;
+  std::vector<ThreadStats> threads_;
+  MatchStats match_;
+  std::vector<std::pair<std::string, double>> counters_;
+};
+
+#endif // KALLISTO_RUNSTATS_H
@@ -0,0 +1,222 @@
+#include "Server.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Quant.h"
+
+namespace {
+
+// one line without the newline, false once the client has closed
+bool readLine(int fd, std::string& buf, std::string& line) {
+  while (true) {
+    size_t nl = buf.find('\n');
+    if (nl != std::string::npos) {
+      line.assign(buf, 0, nl);
+      buf.erase(0, nl + 1);
+      return true;
+    }
+    char tmp[4096];
+    ssize_t n = read(fd, tmp, sizeof(tmp));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // a last line without a newline still counts
+      line.swap(buf);
+      buf.clear();
+      return !line.empty();
+    }
+    buf.append(tmp, n);
+  }
+}
+
+void writeAll(int fd, const std::string& s) {
+  size_t off = 0;
+  while (off < s.size()) {
+    ssize_t n = write(fd, s.data() + off, s.size() - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return; // the client is gone, nobody to tell
+    }
+    off += n;
+  }
+}
+
+// the start time as asctime writes it, without its static buffer
+std::string localTime() {
+  time_t rawtime;
+  struct tm timeinfo;
+  time(&rawtime);
+  localtime_r(&rawtime, &timeinfo);
+  char buf[64];
+  size_t n = strftime(buf, sizeof(buf), "%a %b %e %H:%M:%S %Y", &timeinfo);
+  return std::string(buf, n);
+}
+
+struct Server {
+  KmerIndex& index;
+  const ProgramOptions& opt;
+  const JobParser& parse;
+
+  int listen_fd = -1;
+  std::atomic<bool> stopping{false};
+  std::mutex parse_lock; // option parsing uses getopt's globals
+  std::mutex state_lock;
+  std::condition_variable idle_cv;
+  int running = 0; // connections being handled
+  int num_jobs = 0;
+
+  Server(KmerIndex& index, const ProgramOptions& opt, const JobParser& parse)
+    : index(index), opt(opt), parse(parse) {}
+
+  void listen();
+  void run();
+  void handle(int fd);
+};
+
+void Server::listen() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (opt.socket.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Error: socket path is too long: " << opt.socket << std::endl;
+    exit(1);
+  }
+  strncpy(addr.sun_path, opt.socket.c_str(), sizeof(addr.sun_path) - 1);
+
+  struct stat st;
+  if (stat(opt.socket.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      std::cerr << "Error: " << opt.socket << " exists and is not a socket" << std::endl;
+      exit(1);
+    }
+    // left over from a server that is gone, unless one still answers
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = (fd != -1) && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    if (fd != -1) {
+      close(fd);
+    }
+    if (live) {
+      std::cerr << "Error: a server is already listening on " << opt.socket << std::endl;
+      exit(1);
+    }
+    unlink(opt.socket.c_str());
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1
+      || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+      || ::listen(listen_fd, 64) != 0) {
+    std::cerr << "Error: could not listen on " << opt.socket << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+void Server::run() {
+  std::cerr << "[serve] listening on " << opt.socket << std::endl;
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+      if (stopping) {
+        break;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      std::cerr << "Error: accept failed: " << strerror(errno) << std::endl;
+      exit(1);
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_lock);
+      ++running;
+    }
+    std::thread([this, fd] {
+      handle(fd);
+      close(fd);
+      std::lock_guard<std::mutex> lock(state_lock);
+      --running;
+      idle_cv.notify_all();
+    }).detach();
+  }
+
+  std::unique_lock<std::mutex> lock(state_lock);
+  idle_cv.wait(lock, [this] { return running == 0; });
+  close(listen_fd);
+  unlink(opt.socket.c_str());
+  std::cerr << "[serve] stopped after " << num_jobs << " jobs" << std::endl;
+}
+
+void Server::handle(int fd) {
+  std::string buf, line;
+  std::vector<std::string> args;
+  while (readLine(fd, buf, line) && !line.empty()) {
+    args.push_back(line);
+  }
+  if (args.empty()) {
+    return;
+  }
+
+  if (args.size() == 1 && args[0] == "shutdown") {
+    std::cerr << "[serve] shutting down" << std::endl;
+    stopping = true;
+    // wakes up the accept in run
+    shutdown(listen_fd, SHUT_RDWR);
+    writeAll(fd, "OK\n");
+    return;
+  }
+
+  std::string call = "kallisto quant";
+  for (const auto& a : args) {
+    call += " " + a;
+  }
+  args.insert(args.begin(), "quant");
+
+  ProgramOptions jopt;
+  bool valid;
+  int id;
+  {
+    std::lock_guard<std::mutex> lock(parse_lock);
+    valid = parse(args, jopt);
+    id = ++num_jobs;
+  }
+  if (!valid) {
+    std::cerr << "[serve] job " << id << " rejected: " << call << std::endl;
+    writeAll(fd, "ERROR\tinvalid arguments, see the server log\n");
+    return;
+  }
+
+  std::cerr << "[serve] job " << id << ": " << call << std::endl;
+  std::string start_time = localTime();
+  // the index is only read, the new ecs of the job go in its MinCollector.
+  // Other jobs run in the same process, so there is no CPU time per stage.
+  RunStats stats(jopt.trace, false);
+  int n = RunQuant(index, jopt, call, start_time, stats);
+  std::cerr << "[serve] job " << id << " done" << std::endl;
+  writeAll(fd, "OK\t" + std::to_string(n) + "\n");
+}
+
+}
+
+void RunServer(KmerIndex& index, const ProgramOptions& opt, const JobParser& parse) {
+  // a client that hangs up early must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+  Server server(index, opt, parse);
+  server.listen();
+  server.run();
+}
@@ -0,0 +1,29 @@
+#ifndef KALLISTO_SERVER_H
+#define KALLISTO_SERVER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "KmerIndex.h"
+
+// 'kallisto serve' keeps an index loaded and runs quant jobs sent to it over
+// a UNIX domain socket, so many small runs pay for loading the index once.
+//
+// A client connects and sends the arguments it would give 'kallisto quant'
+// (without -i), one per line, followed by an empty line. When the job is
+// done the server answers with one line, "OK\t<reads processed>" or
+// "ERROR\t<message>", and closes the connection. Sending just "shutdown"
+// stops the server once the running jobs are done.
+//
+// Every connection runs on its own thread, so jobs run concurrently and
+// share the one index.
+
+// fills opt from the job's arguments and checks it, false if the job is
+// invalid. Only ever called by one thread at a time.
+typedef std::function<bool(std::vector<std::string>& args, ProgramOptions& opt)> JobParser;
+
+void RunServer(KmerIndex& index, const ProgramOptions& opt, const JobParser& parse);
+
+#endif // KALLISTO_SERVER_H
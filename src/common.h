@@ -19,26 +19,39 @@ struct ProgramOptions {
   double sd;
   int min_range;
   int bootstrap;
+  int bootstrap_batch; // bootstrap replicates advanced together by the EM
+  bool bootstrap_matrix; // quant: one 2-D HDF5 dataset for the bootstraps
+  bool bootstrap_tsv_matrix; // h5dump: bs_est_counts.tsv and bs_tpm.tsv
   std::vector<std::string> transfasta;
   bool batch_mode;
   std::string batch_file_name;
   std::vector<std::vector<std::string>> batch_files;
   std::vector<std::string> batch_ids;
+  std::string matrix_format; // tsv, mtx or csr, empty if not given
   std::vector<std::string> files;
   std::vector<std::string> umi_files;
   bool plaintext;
   bool write_index;
   bool single_end;
+  bool interleaved; // both ends of a pair in one file, one after the other
   bool strand_specific;
   bool peek; // only used for H5Dump
   bool bias;
   bool pseudobam;
+  bool bam; // pseudobam written as BAM to the output directory
+  bool sort_bam;
+  int sort_memory; // MB used for sorting BAM records
   bool make_unique;
   bool fusion;
+  std::string fusion_dump; // text, binary or none
   enum class StrandType {None, FR, RF};
   StrandType strand;
   bool umi;
   std::string gfa; // used for inspect
+  std::string socket; // used for serve
+  bool trace; // write OUTPUT_DIR/trace.json
+  double progress; // seconds between progress reports, 0 for none
+  std::string status_file; // JSON status kept up to date while reading
 
 ProgramOptions() :
   verbose(false),
@@ -51,18 +64,28 @@ ProgramOptions() :
   sd(0.0),
   min_range(1),
   bootstrap(0),
+  bootstrap_batch(1),
+  bootstrap_matrix(false),
+  bootstrap_tsv_matrix(false),
   batch_mode(false),
   plaintext(false),
   write_index(false),
   single_end(false),
+  interleaved(false),
   strand_specific(false),
   peek(false),
   bias(false),
   pseudobam(false),
+  bam(false),
+  sort_bam(false),
+  sort_memory(768),
   make_unique(false),
   fusion(false),
+  fusion_dump("text"),
   strand(StrandType::None),
-  umi(false)
+  umi(false),
+  trace(false),
+  progress(10.0)
   {}
 };
 
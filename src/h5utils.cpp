@@ -1,5 +1,12 @@
 #include "h5utils.h"
 
+#include <zlib.h>
+
+// raw chunk writes (and so compressing ahead of time) need HDF5 >= 1.10.3
+#if H5_VERSION_GE(1,10,3)
+#define KALLISTO_H5_DIRECT_CHUNK
+#endif
+
 // allocate a contiguous block of memory, dependent on the largest string
 char* vec_to_ptr(const std::vector<std::string>& v) {
   size_t max_len = 0;
@@ -60,6 +67,97 @@ hid_t get_datatype_id(const std::vector<int>& v) {
   return H5T_NATIVE_INT;
 }
 
+void deflate_chunk(const std::vector<double>& v, uint compression_level,
+    H5Chunk& chunk) {
+  const Bytef* src = reinterpret_cast<const Bytef*>(v.data());
+  uLong src_len = v.size() * sizeof(double);
+
+  chunk.n = v.size();
+  chunk.compressed = false;
+
+#ifdef KALLISTO_H5_DIRECT_CHUNK
+  // same stream the deflate filter would produce inside of H5Dwrite
+  uLongf dst_len = compressBound(src_len);
+  chunk.data.resize(dst_len);
+  int ret = compress2(chunk.data.data(), &dst_len, src, src_len,
+      compression_level);
+  if (ret == Z_OK && dst_len < src_len) {
+    chunk.data.resize(dst_len);
+    chunk.compressed = true;
+    return;
+  }
+#endif
+
+  chunk.data.assign(src, src + src_len);
+}
+
+hid_t create_chunked_dataset(hid_t group_id, const std::string& dataset_name,
+    hsize_t rows, hsize_t cols, uint compression_level) {
+  herr_t status;
+
+  int rank = (rows == 0) ? 1 : 2;
+  hsize_t dims[2] = {rows, cols};
+  hsize_t chunk_dims[2] = {1, cols};
+  if (rank == 1) {
+    dims[0] = cols;
+    chunk_dims[0] = cols;
+  }
+
+  hid_t prop_id = H5Pcreate(H5P_DATASET_CREATE);
+  status = H5Pset_chunk(prop_id, rank, chunk_dims);
+  assert( status >= 0 );
+  status = H5Pset_deflate(prop_id, compression_level);
+  assert( status >= 0 );
+
+  hid_t dataspace_id = H5Screate_simple(rank, dims, NULL);
+  hid_t dataset_id = H5Dcreate(group_id, dataset_name.c_str(),
+      H5T_NATIVE_DOUBLE, dataspace_id, H5P_DEFAULT, prop_id, H5P_DEFAULT);
+
+  status = H5Pclose(prop_id);
+  assert( status >= 0 );
+  status = H5Sclose(dataspace_id);
+  assert( status >= 0 );
+
+  return dataset_id;
+}
+
+herr_t write_chunk(hid_t dataset_id, hsize_t row, const H5Chunk& chunk) {
+  herr_t status;
+
+  hid_t file_space = H5Dget_space(dataset_id);
+  int rank = H5Sget_simple_extent_ndims(file_space);
+  hsize_t offset[2] = {row, 0};
+  if (rank == 1) {
+    offset[0] = 0;
+  }
+
+#ifdef KALLISTO_H5_DIRECT_CHUNK
+  // bit 0 of the filter mask set means the deflate filter was skipped
+  uint32_t filter_mask = chunk.compressed ? 0 : 1;
+  status = H5Dwrite_chunk(dataset_id, H5P_DEFAULT, filter_mask, offset,
+      chunk.data.size(), chunk.data.data());
+  assert( status >= 0 );
+#else
+  hsize_t count[2] = {1, chunk.n};
+  if (rank == 1) {
+    count[0] = chunk.n;
+  }
+  status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL,
+      count, NULL);
+  assert( status >= 0 );
+  hsize_t mem_dims[1] = {chunk.n};
+  hid_t mem_space = H5Screate_simple(1, mem_dims, NULL);
+  status = H5Dwrite(dataset_id, H5T_NATIVE_DOUBLE, mem_space, file_space,
+      H5P_DEFAULT, chunk.data.data());
+  assert( status >= 0 );
+  H5Sclose(mem_space);
+#endif
+
+  H5Sclose(file_space);
+
+  return status;
+}
+
 void read_vector(
     hid_t dataset_id,
     hid_t datatype_id,
@@ -138,3 +236,112 @@ void read_vector(
 
   delete [] pool;
 }
+
+void read_row(hid_t dataset_id, hsize_t row, std::vector<double>& out) {
+  herr_t status;
+
+  hid_t file_space = H5Dget_space(dataset_id);
+  hsize_t dims[2];
+  H5Sget_simple_extent_dims(file_space, dims, NULL);
+
+  hsize_t offset[2] = {row, 0};
+  hsize_t count[2] = {1, dims[1]};
+  status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL,
+      count, NULL);
+  assert( status >= 0 );
+
+  hsize_t mem_dims[1] = {dims[1]};
+  hid_t mem_space = H5Screate_simple(1, mem_dims, NULL);
+
+  out.resize(dims[1]);
+  status = H5Dread(dataset_id, H5T_NATIVE_DOUBLE, mem_space, file_space,
+      H5P_DEFAULT, out.data());
+  assert( status >= 0 );
+
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+}
+
+bool read_raw_chunk(hid_t dataset_id, hsize_t row, H5Chunk& chunk) {
+#ifdef KALLISTO_H5_DIRECT_CHUNK
+  bool ok = true;
+
+  hid_t file_space = H5Dget_space(dataset_id);
+  int rank = H5Sget_simple_extent_ndims(file_space);
+  hsize_t dims[2] = {0, 0};
+  if (rank == 1 || rank == 2) {
+    H5Sget_simple_extent_dims(file_space, dims, NULL);
+  } else {
+    ok = false;
+  }
+  H5Sclose(file_space);
+
+  hid_t datatype_id = H5Dget_type(dataset_id);
+  ok = ok && H5Tequal(datatype_id, H5T_NATIVE_DOUBLE) > 0;
+  H5Tclose(datatype_id);
+
+  // exactly one chunk per row, with nothing but (at most) deflate on it
+  hid_t prop_id = H5Dget_create_plist(dataset_id);
+  int n_filters = 0;
+  if (ok && H5Pget_layout(prop_id) == H5D_CHUNKED) {
+    hsize_t chunk_dims[2] = {0, 0};
+    H5Pget_chunk(prop_id, rank, chunk_dims);
+    n_filters = H5Pget_nfilters(prop_id);
+    if (rank == 1) {
+      ok = chunk_dims[0] == dims[0];
+    } else {
+      ok = chunk_dims[0] == 1 && chunk_dims[1] == dims[1];
+    }
+    if (n_filters == 1) {
+      unsigned int flags;
+      size_t n_values = 0;
+      unsigned int filter_config;
+      ok = ok && H5Pget_filter(prop_id, 0, &flags, &n_values, NULL, 0, NULL,
+          &filter_config) == H5Z_FILTER_DEFLATE;
+    } else if (n_filters != 0) {
+      ok = false;
+    }
+  } else {
+    ok = false;
+  }
+  H5Pclose(prop_id);
+
+  if (!ok) {
+    return false;
+  }
+
+  chunk.n = (rank == 1) ? dims[0] : dims[1];
+  hsize_t offset[2] = {(rank == 1) ? 0 : row, 0};
+  hsize_t n_bytes = 0;
+  if (H5Dget_chunk_storage_size(dataset_id, offset, &n_bytes) < 0 ||
+      n_bytes == 0) {
+    return false;
+  }
+  chunk.data.resize(n_bytes);
+  uint32_t filter_mask = 0;
+  if (H5Dread_chunk(dataset_id, H5P_DEFAULT, offset, &filter_mask,
+        chunk.data.data()) < 0) {
+    return false;
+  }
+  // without any filters the chunk is stored as is
+  chunk.compressed = n_filters == 1 && (filter_mask & 1) == 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool inflate_chunk(const H5Chunk& chunk, std::vector<double>& out) {
+  out.resize(chunk.n);
+  uLongf n_bytes = chunk.n * sizeof(double);
+  if (!chunk.compressed) {
+    if (chunk.data.size() != n_bytes) {
+      return false;
+    }
+    memcpy(out.data(), chunk.data.data(), n_bytes);
+    return true;
+  }
+  int ret = uncompress(reinterpret_cast<Bytef*>(out.data()), &n_bytes,
+      chunk.data.data(), chunk.data.size());
+  return ret == Z_OK && n_bytes == chunk.n * sizeof(double);
+}
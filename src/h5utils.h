@@ -85,6 +85,26 @@ herr_t vector_to_h5(
   return status;
 }
 
+// a vector of doubles run through the deflate filter ahead of time, so that
+// the compression can happen outside of the (serialized) HDF5 calls.
+// if compressing does not pay off the raw bytes are kept instead.
+struct H5Chunk {
+  std::vector<unsigned char> data;
+  size_t n = 0; // number of elements
+  bool compressed = false;
+};
+
+void deflate_chunk(const std::vector<double>& v, uint compression_level,
+    H5Chunk& chunk);
+
+// create a dataset of doubles chunked by row with the deflate filter.
+// rows == 0 gives a 1-D dataset of length 'cols' (a single chunk).
+hid_t create_chunked_dataset(hid_t group_id, const std::string& dataset_name,
+    hsize_t rows, hsize_t cols, uint compression_level);
+
+// write 'chunk' to row 'row' of a dataset made by create_chunked_dataset
+herr_t write_chunk(hid_t dataset_id, hsize_t row, const H5Chunk& chunk);
+
 // end: writing utils
 
 // begin: reading utils
@@ -137,6 +157,17 @@ void read_dataset(hid_t group_id,
   assert(status >= 0);
 }
 
+// read row 'row' of a 2-D dataset of doubles
+void read_row(hid_t dataset_id, hsize_t row, std::vector<double>& out);
+
+// read the chunk at row 'row' of a dataset laid out by create_chunked_dataset
+// as it is stored in the file, leaving the decompression to inflate_chunk.
+// returns false if the dataset has some other layout, type or filters.
+bool read_raw_chunk(hid_t dataset_id, hsize_t row, H5Chunk& chunk);
+
+// undo deflate_chunk, safe to call outside of the HDF5 calls
+bool inflate_chunk(const H5Chunk& chunk, std::vector<double>& out);
+
 // end: reading utils
 
 #endif // KALLISTO_H5_UTILS
@@ -22,6 +22,8 @@
 #include "Inspect.h"
 #include "Bootstrap.h"
 #include "H5Writer.h"
+#include "Quant.h"
+#include "Server.h"
 
 
 //#define ERROR_STR "\033[1mError:\033[0m"
@@ -118,25 +120,40 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
   int plaintext_flag = 0;
   int write_index_flag = 0;
   int single_flag = 0;
+  int interleaved_flag = 0;
   int strand_FR_flag = 0;
   int strand_RF_flag = 0;
   int bias_flag = 0;
   int pbam_flag = 0;
+  int bam_flag = 0;
+  int sort_bam_flag = 0;
   int fusion_flag = 0;
+  int bs_matrix_flag = 0;
+  int trace_flag = 0;
 
   const char *opt_string = "t:i:l:s:o:n:m:d:b:";
-  static struct option long_options[] = {
+  struct option long_options[] = {
     // long args
     {"verbose", no_argument, &verbose_flag, 1},
     {"plaintext", no_argument, &plaintext_flag, 1},
     {"write-index", no_argument, &write_index_flag, 1},
     {"single", no_argument, &single_flag, 1},
+    {"interleaved", no_argument, &interleaved_flag, 1},
     {"fr-stranded", no_argument, &strand_FR_flag, 1},
     {"rf-stranded", no_argument, &strand_RF_flag, 1},
     {"bias", no_argument, &bias_flag, 1},
     {"pseudobam", no_argument, &pbam_flag, 1},
+    {"bam", no_argument, &bam_flag, 1},
+    {"sort-bam", no_argument, &sort_bam_flag, 1},
+    {"sort-memory", required_argument, 0, 'M'},
     {"fusion", no_argument, &fusion_flag, 1},
+    {"fusion-dump", required_argument, 0, 'D'},
+    {"bootstrap-matrix", no_argument, &bs_matrix_flag, 1},
+    {"trace", no_argument, &trace_flag, 1},
+    {"progress", required_argument, 0, 'P'},
+    {"status-file", required_argument, 0, 'Q'},
     {"seed", required_argument, 0, 'd'},
+    {"bootstrap-batch", required_argument, 0, 'B'},
     // short args
     {"threads", required_argument, 0, 't'},
     {"index", required_argument, 0, 'i'},
@@ -195,6 +212,26 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
       stringstream(optarg) >> opt.seed;
       break;
     }
+    case 'B': {
+      stringstream(optarg) >> opt.bootstrap_batch;
+      break;
+    }
+    case 'M': {
+      stringstream(optarg) >> opt.sort_memory;
+      break;
+    }
+    case 'P': {
+      stringstream(optarg) >> opt.progress;
+      break;
+    }
+    case 'Q': {
+      opt.status_file = optarg;
+      break;
+    }
+    case 'D': {
+      opt.fusion_dump = optarg;
+      break;
+    }
     default: break;
     }
   }
@@ -220,6 +257,14 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
     opt.single_end = true;
   }
 
+  if (interleaved_flag) {
+    opt.interleaved = true;
+  }
+
+  if (trace_flag) {
+    opt.trace = true;
+  }
+
   if (strand_FR_flag) {
     opt.strand_specific = true;
     opt.strand = ProgramOptions::StrandType::FR;
@@ -238,21 +283,39 @@ void ParseOptionsEM(int argc, char **argv, ProgramOptions& opt) {
     opt.pseudobam = true;
   }
 
+  if (bam_flag) {
+    opt.pseudobam = true;
+    opt.bam = true;
+  }
+
+  if (sort_bam_flag) {
+    opt.pseudobam = true;
+    opt.bam = true;
+    opt.sort_bam = true;
+  }
+
   if (fusion_flag) {
     opt.fusion = true;
   }
+
+  if (bs_matrix_flag) {
+    opt.bootstrap_matrix = true;
+  }
 }
 
 void ParseOptionsEMOnly(int argc, char **argv, ProgramOptions& opt) {
   int verbose_flag = 0;
   int plaintext_flag = 0;
+  int bs_matrix_flag = 0;
 
   const char *opt_string = "t:s:l:s:o:n:m:d:b:";
   static struct option long_options[] = {
     // long args
     {"verbose", no_argument, &verbose_flag, 1},
     {"plaintext", no_argument, &plaintext_flag, 1},
+    {"bootstrap-matrix", no_argument, &bs_matrix_flag, 1},
     {"seed", required_argument, 0, 'd'},
+    {"bootstrap-batch", required_argument, 0, 'B'},
     // short args
     {"threads", required_argument, 0, 't'},
     {"fragment-length", required_argument, 0, 'l'},
@@ -306,6 +369,10 @@ void ParseOptionsEMOnly(int argc, char **argv, ProgramOptions& opt) {
       stringstream(optarg) >> opt.seed;
       break;
     }
+    case 'B': {
+      stringstream(optarg) >> opt.bootstrap_batch;
+      break;
+    }
     default: break;
     }
   }
@@ -317,24 +384,40 @@ void ParseOptionsEMOnly(int argc, char **argv, ProgramOptions& opt) {
   if (plaintext_flag) {
     opt.plaintext = true;
   }
+
+  if (bs_matrix_flag) {
+    opt.bootstrap_matrix = true;
+  }
 }
 
 void ParseOptionsPseudo(int argc, char **argv, ProgramOptions& opt) {
   int verbose_flag = 0;
   int single_flag = 0;
+  int interleaved_flag = 0;
   int strand_flag = 0;
   int pbam_flag = 0;
+  int bam_flag = 0;
+  int sort_bam_flag = 0;
   int umi_flag = 0;
+  int trace_flag = 0;
 
   const char *opt_string = "t:i:l:s:o:b:";
   static struct option long_options[] = {
     // long args
     {"verbose", no_argument, &verbose_flag, 1},
     {"single", no_argument, &single_flag, 1},
+    {"interleaved", no_argument, &interleaved_flag, 1},
     //{"strand-specific", no_argument, &strand_flag, 1},
     {"pseudobam", no_argument, &pbam_flag, 1},
+    {"bam", no_argument, &bam_flag, 1},
+    {"sort-bam", no_argument, &sort_bam_flag, 1},
+    {"sort-memory", required_argument, 0, 'M'},
     {"umi", no_argument, &umi_flag, 'u'},
     {"batch", required_argument, 0, 'b'},
+    {"matrix-format", required_argument, 0, 'F'},
+    {"trace", no_argument, &trace_flag, 1},
+    {"progress", required_argument, 0, 'P'},
+    {"status-file", required_argument, 0, 'Q'},
     // short args
     {"threads", required_argument, 0, 't'},
     {"index", required_argument, 0, 'i'},
@@ -380,6 +463,22 @@ void ParseOptionsPseudo(int argc, char **argv, ProgramOptions& opt) {
       opt.batch_file_name = optarg;
       break;
     }
+    case 'F': {
+      opt.matrix_format = optarg;
+      break;
+    }
+    case 'M': {
+      stringstream(optarg) >> opt.sort_memory;
+      break;
+    }
+    case 'P': {
+      stringstream(optarg) >> opt.progress;
+      break;
+    }
+    case 'Q': {
+      opt.status_file = optarg;
+      break;
+    }
     default: break;
     }
   }
@@ -402,6 +501,14 @@ void ParseOptionsPseudo(int argc, char **argv, ProgramOptions& opt) {
     opt.single_end = true;
   }
 
+  if (interleaved_flag) {
+    opt.interleaved = true;
+  }
+
+  if (trace_flag) {
+    opt.trace = true;
+  }
+
   if (strand_flag) {
     opt.strand_specific = true;
   }
@@ -409,19 +516,68 @@ void ParseOptionsPseudo(int argc, char **argv, ProgramOptions& opt) {
   if (pbam_flag) {
     opt.pseudobam = true;
   }
+
+  if (bam_flag) {
+    opt.pseudobam = true;
+    opt.bam = true;
+  }
+
+  if (sort_bam_flag) {
+    opt.pseudobam = true;
+    opt.bam = true;
+    opt.sort_bam = true;
+  }
   
   
 }
 
 
+void ParseOptionsServe(int argc, char **argv, ProgramOptions& opt) {
+  const char *opt_string = "i:";
+  static struct option long_options[] = {
+    // long args
+    {"socket", required_argument, 0, 'S'},
+    // short args
+    {"index", required_argument, 0, 'i'},
+    {0,0,0,0}
+  };
+
+  int c;
+  int option_index = 0;
+  while (true) {
+    c = getopt_long(argc, argv, opt_string, long_options, &option_index);
+
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      break;
+    case 'i': {
+      opt.index = optarg;
+      break;
+    }
+    case 'S': {
+      opt.socket = optarg;
+      break;
+    }
+    default: break;
+    }
+  }
+}
+
 void ParseOptionsH5Dump(int argc, char **argv, ProgramOptions& opt) {
   int peek_flag = 0;
-  const char *opt_string = "o:";
+  int bs_tsv_flag = 0;
+  const char *opt_string = "o:t:";
   static struct option long_options[] = {
     // long args
     {"peek", no_argument, &peek_flag, 1},
+    {"bootstrap-tsv-matrix", no_argument, &bs_tsv_flag, 1},
     // short args
     {"output-dir", required_argument, 0, 'o'},
+    {"threads", required_argument, 0, 't'},
     {0,0,0,0}
   };
 
@@ -441,6 +597,10 @@ void ParseOptionsH5Dump(int argc, char **argv, ProgramOptions& opt) {
       opt.output = optarg;
       break;
     }
+    case 't': {
+      stringstream(optarg) >> opt.threads;
+      break;
+    }
     default: break;
     }
   }
@@ -453,6 +613,62 @@ void ParseOptionsH5Dump(int argc, char **argv, ProgramOptions& opt) {
   if (peek_flag) {
     opt.peek = true;
   }
+
+  if (bs_tsv_flag) {
+    opt.bootstrap_tsv_matrix = true;
+  }
+}
+
+// read files must exist, except "-" which is stdin and can only be read once.
+// named pipes pass the check like any other file.
+bool CheckReadFiles(const std::vector<std::string>& files) {
+  bool ret = true;
+  int num_stdin = 0;
+  struct stat stFileInfo;
+  for (auto& fn : files) {
+    if (fn == "-") {
+      ++num_stdin;
+      continue;
+    }
+    auto intStat = stat(fn.c_str(), &stFileInfo);
+    if (intStat != 0) {
+      cerr << ERROR_STR << " file not found " << fn << endl;
+      ret = false;
+    }
+  }
+  if (num_stdin > 1) {
+    cerr << ERROR_STR << " standard input (-) can only be given once" << endl;
+    ret = false;
+  }
+  return ret;
+}
+
+// pairs come from two FASTQ files each, or from one file each with
+// --interleaved. A BAM file always has both ends.
+bool CheckPairedFiles(const ProgramOptions& opt) {
+  if (opt.interleaved) {
+    if (opt.single_end) {
+      cerr << "Error: --interleaved is for paired-end reads and cannot be used with --single" << endl;
+      return false;
+    }
+    return true;
+  }
+  if (opt.single_end) {
+    return true;
+  }
+  for (size_t i = 0; i < opt.files.size(); i++) {
+    if (isBamFile(opt.files[i])) {
+      continue;
+    }
+    if (i + 1 >= opt.files.size() || isBamFile(opt.files[i+1])) {
+      cerr << "Error: paired-end mode requires an even number of input files" << endl
+           << "       (use --single for processing single-end reads," << endl
+           << "        or --interleaved if both reads of a pair are in one file)" << endl;
+      return false;
+    }
+    ++i;
+  }
+  return true;
 }
 
 bool CheckOptionsIndex(ProgramOptions& opt) {
@@ -518,15 +734,8 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
     if (opt.files.size() == 0) {
       cerr << ERROR_STR << " Missing read files" << endl;
       ret = false;
-    } else {
-      struct stat stFileInfo;
-      for (auto& fn : opt.files) {
-        auto intStat = stat(fn.c_str(), &stFileInfo);
-        if (intStat != 0) {
-          cerr << ERROR_STR << " file not found " << fn << endl;
-          ret = false;
-        }
-      }
+    } else if (!CheckReadFiles(opt.files)) {
+      ret = false;
     }
 
     /*
@@ -535,12 +744,8 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
       ret = false;
     }*/
 
-    if (!opt.single_end) {
-      if (opt.files.size() % 2 != 0) {
-        cerr << "Error: paired-end mode requires an even number of input files" << endl
-             << "       (use --single for processing single-end reads)" << endl;
-        ret = false;
-      }
+    if (!CheckPairedFiles(opt)) {
+      ret = false;
     }
   }
 
@@ -639,10 +844,21 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
       cerr << "Warning: you asked for " << opt.threads
            << ", but only " << n << " cores on the machine" << endl;
     }
-    if (opt.threads > 1 && opt.pseudobam) {
-      cerr << "Error: pseudobam is not compatible with running on many threads."<< endl;
-      ret = false;
-    }
+  }
+
+  if (opt.sort_bam && opt.sort_memory <= 0) {
+    cerr << "Error: sort memory must be a positive number of MB" << endl;
+    ret = false;
+  }
+
+  if (opt.progress < 0) {
+    cerr << "Error: progress interval must be a non-negative number of seconds" << endl;
+    ret = false;
+  }
+
+  if (opt.fusion_dump != "text" && opt.fusion_dump != "binary" && opt.fusion_dump != "none") {
+    cerr << "Error: unknown fusion dump format " << opt.fusion_dump << ", use text, binary or none" << endl;
+    ret = false;
   }
 
   if (opt.bootstrap < 0) {
@@ -650,6 +866,11 @@ bool CheckOptionsEM(ProgramOptions& opt, bool emonly = false) {
     ret = false;
   }
 
+  if (opt.bootstrap_batch <= 0) {
+    cerr << "Error: invalid number of bootstraps per batch " << opt.bootstrap_batch << endl;
+    ret = false;
+  }
+
   return ret;
 }
 
@@ -673,6 +894,18 @@ bool CheckOptionsPseudo(ProgramOptions& opt) {
     }
   }
 
+  if (opt.matrix_format.empty()) {
+    if (opt.batch_mode) {
+      opt.matrix_format = "tsv";
+    }
+  } else if (!opt.batch_mode) {
+    cerr << ERROR_STR << " --matrix-format only applies in batch mode, use --batch option" << endl;
+    ret = false;
+  } else if (opt.matrix_format != "tsv" && opt.matrix_format != "mtx" && opt.matrix_format != "csr") {
+    cerr << ERROR_STR << " unknown matrix format " << opt.matrix_format << ", use tsv, mtx or csr" << endl;
+    ret = false;
+  }
+
   // check for read files
   if (!opt.batch_mode) {
     if (opt.umi) {
@@ -683,20 +916,16 @@ bool CheckOptionsPseudo(ProgramOptions& opt) {
     if (opt.files.size() == 0) {
       cerr << ERROR_STR << " Missing read files" << endl;
       ret = false;
-    } else {
-      struct stat stFileInfo;      
-      for (auto& fn : opt.files) {        
-        auto intStat = stat(fn.c_str(), &stFileInfo);
-        if (intStat != 0) {
-          cerr << ERROR_STR << " file not found " << fn << endl;
-          ret = false;
-        }
-      }
+    } else if (!CheckReadFiles(opt.files)) {
+      ret = false;
     }
   } else {
     if (opt.files.size() != 0) {
       cerr << ERROR_STR << " cannot specify batch mode and supply read files" << endl;
       ret = false;
+    } else if (opt.interleaved) {
+      cerr << ERROR_STR << " --interleaved cannot be used in batch mode" << endl;
+      ret = false;
     } else {
       // check for batch files
       if (opt.batch_mode) {
@@ -759,12 +988,8 @@ bool CheckOptionsPseudo(ProgramOptions& opt) {
     ret = false;
   }*/
 
-  if (!opt.single_end) {
-    if (opt.files.size() % 2 != 0) {
-      cerr << "Error: paired-end mode requires an even number of input files" << endl
-           << "       (use --single for processing single-end reads)" << endl;
-      ret = false;
-    }
+  if (!CheckPairedFiles(opt)) {
+    ret = false;
   }
   
   if (opt.umi) {
@@ -836,10 +1061,21 @@ bool CheckOptionsPseudo(ProgramOptions& opt) {
       cerr << "[~warn]  you asked for " << opt.threads
            << ", but only " << n << " cores on the machine" << endl;
     }
-    if (opt.threads > 1 && opt.pseudobam) {
-      cerr << "Error: pseudobam is not compatible with running on many threads."<< endl;
-      ret = false;
-    }
+  }
+
+  if (opt.sort_bam && opt.sort_memory <= 0) {
+    cerr << "Error: sort memory must be a positive number of MB" << endl;
+    ret = false;
+  }
+
+  if (opt.progress < 0) {
+    cerr << "Error: progress interval must be a non-negative number of seconds" << endl;
+    ret = false;
+  }
+
+  if (opt.batch_mode && opt.pseudobam) {
+    cerr << ERROR_STR << " pseudobam is not supported in batch mode" << endl;
+    ret = false;
   }
 
   return ret;
@@ -865,8 +1101,55 @@ bool CheckOptionsInspect(ProgramOptions& opt) {
   return ret;
 }
 
+// parse the arguments of a job sent to 'kallisto serve', args[0] is "quant"
+bool ParseServeJob(std::vector<std::string>& args, const ProgramOptions& serve_opt, ProgramOptions& opt) {
+  std::vector<char*> argv;
+  for (auto& a : args) {
+    argv.push_back(&a[0]);
+  }
+  argv.push_back(nullptr);
+  // start getopt over
+#ifdef __GLIBC__
+  optind = 0;
+#else
+  optind = 1;
+  optreset = 1;
+#endif
+  ParseOptionsEM(args.size(), argv.data(), opt);
+  opt.index = serve_opt.index;
+  if (opt.pseudobam && !opt.bam) {
+    // the server's stdout is shared by all the jobs
+    cerr << "Error: --pseudobam needs --bam when running under kallisto serve" << endl;
+    return false;
+  }
+  for (auto& fn : opt.files) {
+    if (fn == "-") {
+      cerr << "Error: jobs run under kallisto serve cannot read standard input" << endl;
+      return false;
+    }
+  }
+  return CheckOptionsEM(opt);
+}
+
+bool CheckOptionsServe(ProgramOptions& opt) {
+  bool ret = CheckOptionsInspect(opt);
+
+  if (opt.socket.empty()) {
+    cerr << "Error: missing socket path" << endl;
+    ret = false;
+  }
+
+  return ret;
+}
+
 bool CheckOptionsH5Dump(ProgramOptions& opt) {
   bool ret = true;
+
+  if (opt.threads <= 0) {
+    cerr << "Error: invalid number of threads " << opt.threads << endl;
+    ret = false;
+  }
+
   if (!opt.peek) {
     if ( opt.output.size() == 0) {
       cerr << "Error: You must specify an output directory." << endl;
@@ -932,6 +1215,7 @@ void usage() {
        << "    quant         Runs the quantification algorithm " << endl
        << "    pseudo        Runs the pseudoalignment step " << endl
        << "    h5dump        Converts HDF5-formatted results to plaintext" << endl
+       << "    serve         Keeps an index loaded and runs quant jobs sent to a socket" << endl
        << "    version       Prints version information"<< endl
        << "    cite          Prints citation information" << endl << endl
        << "Running kallisto <CMD> without arguments prints usage information for <CMD>"<< endl << endl;
@@ -956,7 +1240,23 @@ void usageh5dump() {
        << "Converts HDF5-formatted results to plaintext" << endl << endl
        << "Usage:  kallisto h5dump [arguments] abundance.h5" << endl << endl
        << "Required argument:" << endl
-       << "-o, --output-dir=STRING       Directory to write output to" << endl << endl;
+       << "-o, --output-dir=STRING       Directory to write output to" << endl << endl
+       << "Optional arguments:" << endl
+       << "-t, --threads=INT             Number of threads to use (default: 1)" << endl
+       << "    --bootstrap-tsv-matrix    Write bootstraps to bs_est_counts.tsv and bs_tpm.tsv," << endl
+       << "                              one column per bootstrap, instead of one file each" << endl << endl;
+}
+
+void usageServe() {
+  cout << "kallisto " << KALLISTO_VERSION << endl
+       << "Keeps an index loaded and runs quant jobs sent to a UNIX socket" << endl << endl
+       << "Usage: kallisto serve [arguments]" << endl << endl
+       << "Required arguments:" << endl
+       << "-i, --index=STRING            Filename for the kallisto index to be used" << endl
+       << "    --socket=STRING           Path of the UNIX socket to listen on" << endl << endl
+       << "A job is the arguments to kallisto quant, without -i, one per line and" << endl
+       << "ended by an empty line. The server answers OK<TAB>reads processed or" << endl
+       << "ERROR<TAB>message once the job is done. Send shutdown to stop the server." << endl << endl;
 }
 
 void usageInspect() {
@@ -973,7 +1273,9 @@ void usageEM(bool valid_input = true) {
        << "Computes equivalence classes for reads and quantifies abundances" << endl << endl;
   }
   //      "----|----|----|----|----|----|----|----|----|----|----|----|----|----|----|----|"
-  cout << "Usage: kallisto quant [arguments] FASTQ-files" << endl << endl
+  cout << "Usage: kallisto quant [arguments] FASTQ-files" << endl
+       << "       (a FASTQ file can be a named pipe, - reads standard input," << endl
+       << "        files ending in .bam are read as BAM, with both reads of a pair)" << endl << endl
        << "Required arguments:" << endl
        << "-i, --index=STRING            Filename for the kallisto index to be used for" << endl
        << "                              quantification" << endl
@@ -982,9 +1284,23 @@ void usageEM(bool valid_input = true) {
        << "    --bias                    Perform sequence based bias correction" << endl
        << "-b, --bootstrap-samples=INT   Number of bootstrap samples (default: 0)" << endl
        << "    --seed=INT                Seed for the bootstrap sampling (default: 42)" << endl
+       << "    --bootstrap-batch=INT     Number of bootstrap samples to run together in" << endl
+       << "                              each pass of the EM (default: 1)" << endl
+       << "    --bootstrap-matrix        Store bootstrap samples in one 2-D HDF5 dataset" << endl
+       << "                              (/bootstrap/matrix) instead of one per sample" << endl
+       << "    --trace                   Write the timing of the run to OUTPUT_DIR/trace.json" << endl
+       << "                              (Chrome trace format)" << endl
+       << "    --progress=DOUBLE         Seconds between progress reports while reading" << endl
+       << "                              (default: 10, 0 to turn them off)" << endl
+       << "    --status-file=STRING      Keep a JSON status of the read processing in this" << endl
+       << "                              file, replaced at every report" << endl
        << "    --plaintext               Output plaintext instead of HDF5" << endl
        << "    --fusion                  Search for fusions for Pizzly" << endl
+       << "    --fusion-dump=STRING      Per-read fusion output: text (fusion.txt, default)," << endl
+       << "                              binary (fusion.bin) or none" << endl
        << "    --single                  Quantify single-end reads" << endl
+       << "    --interleaved             Paired-end reads with both reads of a pair" << endl
+       << "                              next to each other in one file" << endl
        << "    --fr-stranded             Strand specific reads, first read forward" << endl
        << "    --rf-stranded             Strand specific reads, first read reverse" << endl
        << "-l, --fragment-length=DOUBLE  Estimated average fragment length" << endl
@@ -992,7 +1308,13 @@ void usageEM(bool valid_input = true) {
        << "                              (default: -l, -s values are estimated from paired" << endl
        << "                               end data, but are required when using --single)" << endl
        << "-t, --threads=INT             Number of threads to use (default: 1)" << endl
-       << "    --pseudobam               Output pseudoalignments in SAM format to stdout" << endl;
+       << "    --pseudobam               Output pseudoalignments in SAM format to stdout" << endl
+       << "    --bam                     Output pseudoalignments in BAM format to" << endl
+       << "                              OUTPUT_DIR/pseudoalignments.bam instead" << endl
+       << "    --sort-bam                Sort the BAM output by coordinate and index it" << endl
+       << "                              (implies --bam)" << endl
+       << "    --sort-memory=INT         Memory in MB for sorting before records are" << endl
+       << "                              spilled to disk (default: 768)" << endl;
 
 }
 
@@ -1002,7 +1324,9 @@ void usagePseudo(bool valid_input = true) {
          << "Computes equivalence classes for reads and quantifies abundances" << endl << endl;
   }
 
-  cout << "Usage: kallisto pseudo [arguments] FASTQ-files" << endl << endl
+  cout << "Usage: kallisto pseudo [arguments] FASTQ-files" << endl
+       << "       (a FASTQ file can be a named pipe, - reads standard input," << endl
+       << "        files ending in .bam are read as BAM, with both reads of a pair)" << endl << endl
        << "Required arguments:" << endl
        << "-i, --index=STRING            Filename for the kallisto index to be used for" << endl
        << "                              pseudoalignment" << endl
@@ -1010,13 +1334,29 @@ void usagePseudo(bool valid_input = true) {
        << "Optional arguments:" << endl
        << "-u  --umi                     First file in pair is a UMI file" << endl
        << "-b  --batch=FILE              Process files listed in FILE" << endl
+       << "    --matrix-format=STRING    Format of the batch count matrix: tsv (default)," << endl
+       << "                              mtx (Matrix Market) or csr (binary sparse rows)" << endl
+       << "    --trace                   Write the timing of the run to OUTPUT_DIR/trace.json" << endl
+       << "                              (Chrome trace format)" << endl
+       << "    --progress=DOUBLE         Seconds between progress reports while reading" << endl
+       << "                              (default: 10, 0 to turn them off)" << endl
+       << "    --status-file=STRING      Keep a JSON status of the read processing in this" << endl
+       << "                              file, replaced at every report" << endl
        << "    --single                  Quantify single-end reads" << endl
+       << "    --interleaved             Paired-end reads with both reads of a pair" << endl
+       << "                              next to each other in one file" << endl
        << "-l, --fragment-length=DOUBLE  Estimated average fragment length" << endl
        << "-s, --sd=DOUBLE               Estimated standard deviation of fragment length" << endl
        << "                              (default: -l, -s values are estimated from paired" << endl
        << "                               end data, but are required when using --single)" << endl
        << "-t, --threads=INT             Number of threads to use (default: 1)" << endl
-       << "    --pseudobam               Output pseudoalignments in SAM format to stdout" << endl;
+       << "    --pseudobam               Output pseudoalignments in SAM format to stdout" << endl
+       << "    --bam                     Output pseudoalignments in BAM format to" << endl
+       << "                              OUTPUT_DIR/pseudoalignments.bam instead" << endl
+       << "    --sort-bam                Sort the BAM output by coordinate and index it" << endl
+       << "                              (implies --bam)" << endl
+       << "    --sort-memory=INT         Memory in MB for sorting before records are" << endl
+       << "                              spilled to disk (default: 768)" << endl;
 
 }
 
@@ -1030,6 +1370,10 @@ void usageEMOnly() {
        << "-l, --fragment-length=DOUBLE  Estimated fragment length (default: value is estimated from the input data)" << endl
        << "-b, --bootstrap-samples=INT   Number of bootstrap samples (default: 0)" << endl
        << "    --seed=INT                Seed for the bootstrap sampling (default: 42)" << endl
+       << "    --bootstrap-batch=INT     Number of bootstrap samples to run together in" << endl
+       << "                              each pass of the EM (default: 1)" << endl
+       << "    --bootstrap-matrix        Store bootstrap samples in one 2-D HDF5 dataset" << endl
+       << "                              (/bootstrap/matrix) instead of one per sample" << endl
        << "    --plaintext               Output plaintext instead of HDF5" << endl << endl;
 }
 
@@ -1118,116 +1462,31 @@ int main(int argc, char *argv[]) {
         exit(1);
       } else {
         // run the em algorithm
+        RunStats stats(opt.trace);
         KmerIndex index(opt);
-        index.load(opt);
-        if (opt.fusion) {
-          // need full transcript sequences
-          index.loadTranscriptSequences();
-        }
-        MinCollector collection(index, opt);
-        int num_processed = 0;
-        num_processed = ProcessReads(index, opt, collection);
-
-        // save modified index for future use
-        if (opt.write_index) {
-          index.write((opt.output + "/index.saved"), false);
-        }
-
-        // if mean FL not provided, estimate
-        std::vector<int> fld;
-        if (opt.fld == 0.0) {
-          fld = collection.flens; // copy
-          collection.compute_mean_frag_lens_trunc();
-        } else {
-          auto mean_fl = (opt.fld > 0.0) ? opt.fld : collection.get_mean_frag_len();
-          auto sd_fl = opt.sd;
-          collection.init_mean_fl_trunc( mean_fl, sd_fl );
-          //fld.resize(MAX_FRAG_LEN,0); // no obersvations
-          fld = trunc_gaussian_counts(0, MAX_FRAG_LEN, mean_fl, sd_fl, 10000);
-
-          // for (size_t i = 0; i < collection.mean_fl_trunc.size(); ++i) {
-          //   cout << "--- " << i << '\t' << collection.mean_fl_trunc[i] << endl;
-          // }
-        }
-
-        std::vector<int> preBias(4096,1);
-        if (opt.bias) {
-          preBias = collection.bias5; // copy
+        {
+          RunStats::Stage stage(&stats, "load_index");
+          index.load(opt);
         }
-
-        auto fl_means = get_frag_len_means(index.target_lens_, collection.mean_fl_trunc);
-
-        /*for (int i = 0; i < collection.bias3.size(); i++) {
-          std::cout << i << "\t" << collection.bias3[i] << "\t" << collection.bias5[i] << "\n";
-          }*/
-
-        EMAlgorithm em(collection.counts, index, collection, fl_means, opt);
-        em.run(10000, 50, true, opt.bias);
-
-        std::string call = argv_to_string(argc, argv);
-
-        H5Writer writer;
-        if (!opt.plaintext) {
-          writer.init(opt.output + "/abundance.h5", opt.bootstrap, num_processed, fld, preBias, em.post_bias_, 6,
-              index.INDEX_VERSION, call, start_time);
-          writer.write_main(em, index.target_names_, index.target_lens_);
-        }
-
-        plaintext_aux(
-            opt.output + "/run_info.json",
-            std::string(std::to_string(index.num_trans)),
-            std::string(std::to_string(opt.bootstrap)),
-            std::string(std::to_string(num_processed)),
-            KALLISTO_VERSION,
-            std::string(std::to_string(index.INDEX_VERSION)),
-            start_time,
-            call);
-
-        plaintext_writer(opt.output + "/abundance.tsv", em.target_names_,
-            em.alpha_, em.eff_lens_, index.target_lens_);
-
-        if (opt.bootstrap > 0) {
-          auto B = opt.bootstrap;
-          std::mt19937_64 rand;
-          rand.seed( opt.seed );
-
-          std::vector<size_t> seeds;
-          for (auto s = 0; s < B; ++s) {
-            seeds.push_back( rand() );
-          }
-
-          if (opt.threads > 1) {
-            auto n_threads = opt.threads;
-            if (opt.threads > opt.bootstrap) {
-              cerr
-                << "[~warn] number of threads (" << opt.threads <<
-                ") greater than number of bootstraps" << endl
-                << "[~warn] (cont'd) updating threads to number of bootstraps "
-                << opt.bootstrap << endl;
-              n_threads = opt.bootstrap;
-            }
-
-            BootstrapThreadPool pool(opt.threads, seeds, collection.counts, index,
-                collection, em.eff_lens_, opt, writer, fl_means);
-          } else {
-            for (auto b = 0; b < B; ++b) {
-              Bootstrap bs(collection.counts, index, collection, em.eff_lens_, seeds[b], fl_means, opt);
-              cerr << "[bstrp] running EM for the bootstrap: " << b + 1 << "\r";
-              auto res = bs.run_em();
-
-              if (!opt.plaintext) {
-                writer.write_bootstrap(res, b);
-              } else {
-                plaintext_writer(opt.output + "/bs_abundance_" + std::to_string(b) + ".tsv",
-                    em.target_names_, res.alpha_, em.eff_lens_, index.target_lens_);
-              }
-            }
-          }
-
-          cerr << endl;
-        }
-
+        RunQuant(index, opt, argv_to_string(argc, argv), start_time, stats);
+        cerr << endl;
+      }
+    } else if (cmd == "serve") {
+      if (argc==2) {
+        usageServe();
+        return 0;
+      }
+      ParseOptionsServe(argc-1, argv+1, opt);
+      if (!CheckOptionsServe(opt)) {
         cerr << endl;
+        usageServe();
+        exit(1);
+      } else {
+        KmerIndex index(opt);
+        index.load(opt);
+        RunServer(index, opt, [&](std::vector<std::string>& args, ProgramOptions& jopt) {
+          return ParseServeJob(args, opt, jopt);
+        });
       }
     } else if (cmd == "quant-only") {
       if (argc==2) {
@@ -1279,7 +1538,7 @@ int main(int argc, char *argv[]) {
         if (!opt.plaintext) {
           // setting num_processed to 0 because quant-only is for debugging/special ops
           writer.init(opt.output + "/abundance.h5", opt.bootstrap, 0, fld, preBias, em.post_bias_, 6,
-              index.INDEX_VERSION, call, start_time);
+              index.INDEX_VERSION, call, start_time, opt.bootstrap_matrix);
           writer.write_main(em, index.target_names_, index.target_lens_);
         } else {
           plaintext_aux(
@@ -1307,7 +1566,9 @@ int main(int argc, char *argv[]) {
             seeds.push_back( rand() );
           }
 
-          if (opt.threads > 1) {
+          BootstrapContext bs_ctx(collection.counts, index, collection, fl_means);
+
+          if (opt.threads > 1 || opt.bootstrap_batch > 1) {
             auto n_threads = opt.threads;
             if (opt.threads > opt.bootstrap) {
               cerr << "[btstrp] Warning: number of threads (" << opt.threads <<
@@ -1317,13 +1578,13 @@ int main(int argc, char *argv[]) {
               n_threads = opt.bootstrap;
             }
 
-            BootstrapThreadPool pool(n_threads, seeds, collection.counts, index,
+            BootstrapThreadPool pool(n_threads, seeds, bs_ctx, index,
                 collection, em.eff_lens_, opt, writer, fl_means);
           } else {
+            Bootstrap bs(bs_ctx, index, collection, fl_means, opt);
             for (auto b = 0; b < B; ++b) {
-              Bootstrap bs(collection.counts, index, collection, em.eff_lens_, seeds[b], fl_means, opt);
               cerr << "[bstrp] running EM for the bootstrap: " << b + 1 << "\r";
-              auto res = bs.run_em();
+              const auto& res = bs.run_em(seeds[b]);
 
               if (!opt.plaintext) {
                 writer.write_bootstrap(res, b);
@@ -1348,19 +1609,31 @@ int main(int argc, char *argv[]) {
         exit(1);
       } else {
         // pseudoalign the reads
+        RunStats stats(opt.trace);
         KmerIndex index(opt);
-        index.load(opt);
+        {
+          RunStats::Stage stage(&stats, "load_index");
+          index.load(opt);
+        }
 
         MinCollector collection(index, opt);
         int num_processed = 0;
 
         if (!opt.batch_mode) {
-          num_processed = ProcessReads(index, opt, collection);
+          {
+            RunStats::Stage stage(&stats, "pseudoalign");
+            num_processed = ProcessReads(index, opt, collection, &stats);
+          }
+          RunStats::Stage stage(&stats, "write");
           collection.write((opt.output + "/pseudoalignments"));
         } else {
 
-          std::vector<std::vector<int>> batchCounts;
-          num_processed = ProcessBatchReads(index, opt, collection, batchCounts);
+          std::vector<SparseCounts> batchCounts;
+          {
+            RunStats::Stage stage(&stats, "pseudoalign");
+            num_processed = ProcessBatchReads(index, opt, collection, batchCounts, &stats);
+          }
+          RunStats::Stage stage(&stats, "write");
           /*
           for (int i = 0; i < opt.batch_ids.size(); i++) {
             std::fill(collection.counts.begin(), collection.counts.end(),0);
@@ -1370,7 +1643,7 @@ int main(int argc, char *argv[]) {
           }
           */
 
-          writeBatchMatrix((opt.output + "/matrix"),index, opt.batch_ids,batchCounts);
+          writeBatchMatrix((opt.output + "/matrix"),collection.ecs, opt.batch_ids,batchCounts, opt.matrix_format);
         }
 
         std::string call = argv_to_string(argc, argv);
@@ -1383,7 +1656,11 @@ int main(int argc, char *argv[]) {
             KALLISTO_VERSION,
             std::string(std::to_string(index.INDEX_VERSION)),
             start_time,
-            call);
+            call,
+            &stats);
+        if (stats.tracing() && !stats.writeTrace(opt.output + "/trace.json")) {
+          cerr << "Error: could not write " << opt.output << "/trace.json" << endl;
+        }
 
         cerr << endl;
       }
@@ -1403,7 +1680,7 @@ int main(int argc, char *argv[]) {
       H5Converter h5conv(opt.files[0], opt.output);
       if (!opt.peek) {
         h5conv.write_aux();
-        h5conv.convert();
+        h5conv.convert(opt.threads, opt.bootstrap_tsv_matrix);
       }
     }  else {
       cerr << "Error: invalid command " << cmd << endl;
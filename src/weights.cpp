@@ -1,6 +1,8 @@
 #include "weights.h"
 
+#include <algorithm>
 #include <cmath>
+#include <thread>
 
 const double MIN_ALPHA = 1e-8;
 
@@ -97,6 +99,129 @@ inline int update_hexamer(int hex, char c, bool revcomp) {
   return hex;
 }
 
+// splits [0,n) into one contiguous range per thread and runs f(begin, end, id)
+template <typename F>
+void parallel_for_targets(int n, int n_threads, F f) {
+  n_threads = std::max(1, std::min(n_threads, n));
+  if (n_threads == 1) {
+    f(0, n, 0);
+    return;
+  }
+  std::vector<std::thread> workers;
+  int chunk = (n + n_threads - 1) / n_threads;
+  for (int t = 0; t < n_threads; t++) {
+    int begin = std::min(n, t*chunk);
+    int end = std::min(n, begin + chunk);
+    workers.emplace_back(f, begin, end, t);
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+void HexamerHistograms::clear() {
+  // release the memory, these are only needed while the EM updates the lengths
+  std::vector<size_t>().swap(offsets);
+  std::vector<uint16_t>().swap(hex);
+  std::vector<uint16_t>().swap(count);
+}
+
+void build_hexamer_histograms(
+    HexamerHistograms& hist,
+    const std::vector<double>& means,
+    const KmerIndex& index,
+    const ProgramOptions& opt) {
+
+  const int num6mers = 4096;
+  const bool use_fw = !opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR);
+  const bool use_rc = !opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF);
+
+  index.loadTranscriptSequences(opt.threads);
+
+  int n_threads = std::max(1, std::min(opt.threads, index.num_trans));
+  std::vector<std::vector<size_t>> sizes(n_threads);
+  std::vector<std::vector<uint16_t>> hexs(n_threads), counts(n_threads);
+
+  parallel_for_targets(index.num_trans, n_threads, [&](int begin, int end, int id) {
+    std::vector<uint32_t> bins(num6mers, 0);
+    std::vector<uint16_t> touched;
+    touched.reserve(num6mers);
+    auto& sz = sizes[id];
+    auto& hx = hexs[id];
+    auto& ct = counts[id];
+
+    auto add = [&](int hex) {
+      if (bins[hex]++ == 0) {
+        touched.push_back(hex);
+      }
+    };
+
+    for (int i = begin; i < end; i++) {
+      size_t before = hx.size();
+      // same positions as the loops this replaces in update_eff_lens
+      if (index.target_lens_[i] >= means[i]) {
+        int seqlen = index.target_seqs_[i].size();
+        const char* cs = index.target_seqs_[i].c_str();
+
+        if (use_fw) {
+          int fwlimit = (int) std::max(seqlen - means[i] - 6, 0.0);
+          if (fwlimit > 0) {
+            int hex = hexamerToInt(cs,false);
+            for (int j = 0; j < fwlimit; j++) {
+              add(hex);
+              hex = update_hexamer(hex,*(cs+j+6),false);
+            }
+          }
+        }
+        if (use_rc) {
+          int bwlimit = (int) std::max(means[i] - 6, 0.0);
+          if (bwlimit < seqlen - 6) {
+            int hex = hexamerToInt(cs+bwlimit,true);
+            for (int j = bwlimit; j < seqlen - 6; j++) {
+              add(hex);
+              hex = update_hexamer(hex,*(cs+j+6),true);
+            }
+          }
+        }
+
+        std::sort(touched.begin(), touched.end());
+        for (auto h : touched) {
+          uint32_t c = bins[h];
+          while (c > 0) {
+            uint16_t part = (uint16_t) std::min<uint32_t>(c, 0xFFFF);
+            hx.push_back(h);
+            ct.push_back(part);
+            c -= part;
+          }
+          bins[h] = 0;
+        }
+        touched.clear();
+      }
+      sz.push_back(hx.size() - before);
+    }
+  });
+
+  hist.clear();
+  hist.offsets.reserve(index.num_trans + 1);
+  size_t total = 0;
+  for (int t = 0; t < n_threads; t++) {
+    total += hexs[t].size();
+  }
+  hist.hex.reserve(total);
+  hist.count.reserve(total);
+  hist.offsets.push_back(0);
+  for (int t = 0; t < n_threads; t++) {
+    for (auto x : sizes[t]) {
+      hist.offsets.push_back(hist.offsets.back() + x);
+    }
+    hist.hex.insert(hist.hex.end(), hexs[t].begin(), hexs[t].end());
+    hist.count.insert(hist.count.end(), counts[t].begin(), counts[t].end());
+    std::vector<uint16_t>().swap(hexs[t]);
+    std::vector<uint16_t>().swap(counts[t]);
+  }
+  assert(hist.offsets.size() == index.num_trans + 1);
+}
+
 std::vector<double> update_eff_lens(
     const std::vector<double>& means,
     const MinCollector& tc,
@@ -104,6 +229,7 @@ std::vector<double> update_eff_lens(
     const std::vector<double>& alpha,
     const std::vector<double>& eff_lens,
     std::vector<double>& dbias5,
+    HexamerHistograms& hist,
     const ProgramOptions& opt
     ) {
 
@@ -114,112 +240,88 @@ std::vector<double> update_eff_lens(
     biasDataNorm += tc.bias5[i];
   }
 
-  dbias5.clear();
-  dbias5.resize(num6mers, 0.0); // clear the bias
-
-  index.loadTranscriptSequences();
-  
+  if (hist.empty()) {
+    build_hexamer_histograms(hist, means, index, opt);
+  }
 
-  for (int i = 0; i < index.num_trans; i++) {
-    if (index.target_lens_[i] < means[i]) {
-      // this should never happen.. but I'll sleep better at night with this
-      // condition -HP
-      continue;
+  auto expressed = [&](int i) {
+    // the length condition should never fail.. but I'll sleep better at
+    // night with it -HP
+    return index.target_lens_[i] >= means[i] && alpha[i] >= MIN_ALPHA;
+  };
+
+  // accumulate the expected hexamer distribution, one partial sum per thread
+  int n_threads = std::max(1, std::min(opt.threads, index.num_trans));
+  std::vector<std::vector<double>> partial(n_threads);
+  parallel_for_targets(index.num_trans, n_threads, [&](int begin, int end, int id) {
+    auto& db = partial[id];
+    db.assign(num6mers, 0.0);
+    for (int i = begin; i < end; i++) {
+      if (!expressed(i)) {
+        continue;
+      }
+      double contrib = 0.5*alpha[i]/eff_lens[i];
+      if (opt.strand_specific) {
+        contrib = alpha[i]/eff_lens[i];
+      }
+      for (size_t e = hist.offsets[i]; e < hist.offsets[i+1]; e++) {
+        db[hist.hex[e]] += contrib * hist.count[e];
+      }
     }
+  });
 
-    if (alpha[i] < MIN_ALPHA) {
-      continue;
+  dbias5.clear();
+  dbias5.resize(num6mers, 0.0); // clear the bias
+  for (auto& db : partial) {
+    for (int i = 0; i < num6mers; i++) {
+      dbias5[i] += db[i];
     }
+  }
 
-    double contrib = 0.5*alpha[i]/eff_lens[i];
-    if (opt.strand_specific) {
-      contrib = alpha[i]/eff_lens[i];
-    }
-    int seqlen = index.target_seqs_[i].size();
-    const char* cs = index.target_seqs_[i].c_str();
-
-    if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR)) {
-      int hex = hexamerToInt(cs,false);
-      int fwlimit = (int) std::max(seqlen - means[i] - 6, 0.0);
-      for (int j = 0; j < fwlimit; j++) {
-        dbias5[hex] += contrib;
-        hex = update_hexamer(hex,*(cs+j+6),false);
-      } 
-    }
+  for (int i = 0; i < num6mers; i++) {
+    biasAlphaNorm += dbias5[i];
+  }
 
-    if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF)) {
-      int bwlimit = (int) std::max(means[i] - 6, 0.0);
-      int hex = hexamerToInt(cs+bwlimit,true);
-      for (int j = bwlimit; j < seqlen - 6; j++) {
-        dbias5[hex] += contrib;
-        if (j < seqlen - 6) {
-          hex = update_hexamer(hex,*(cs+j+6),true);
-        }
-      }
+  // observed over expected for every hexamer, only looked up for hexamers of
+  // expressed targets which always have dbias5 > 0
+  std::vector<double> ratio(num6mers, 0.0);
+  for (int i = 0; i < num6mers; i++) {
+    if (dbias5[i] > 0.0) {
+      ratio[i] = tc.bias5[i] / dbias5[i];
     }
   }
 
-  for (int i = 0; i < num6mers; i++) {
-    biasAlphaNorm += dbias5[i];
+  double scale = biasAlphaNorm/biasDataNorm;
+  if (!opt.strand_specific) {
+    scale *= 0.5;
   }
 
   std::vector<double> biaslens(index.num_trans);
 
-  for (int i = 0; i < index.num_trans; i++) {
-    double efflen = 0.0;
-    if (index.target_lens_[i] >= means[i] && alpha[i] >= MIN_ALPHA) {
-
-      int seqlen = index.target_seqs_[i].size();
-      const char* cs = index.target_seqs_[i].c_str();
-
-      // forward direction
-      if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::FR)) {
-        int hex = hexamerToInt(cs,false);
-        int fwlimit = (int) std::max(seqlen - means[i] - 6, 0.0);
-        for (int j = 0; j < fwlimit; j++) {
-          //int hex = hexamerToInt(cs+j,false);
-          //efflen += 0.5*(tc.bias5[hex]/biasDataNorm) / (dbias5[hex]/biasAlphaNorm );
-          efflen += tc.bias5[hex] / dbias5[hex];
-          hex = update_hexamer(hex,*(cs+j+6),false);
+  parallel_for_targets(index.num_trans, n_threads, [&](int begin, int end, int id) {
+    for (int i = begin; i < end; i++) {
+      double efflen = 0.0;
+      if (expressed(i)) {
+        for (size_t e = hist.offsets[i]; e < hist.offsets[i+1]; e++) {
+          efflen += hist.count[e] * ratio[hist.hex[e]];
         }
+        efflen *= scale;
       }
-      if (!opt.strand_specific || (opt.strand == ProgramOptions::StrandType::RF)) {
-        int bwlimit = (int) std::max(means[i] - 6 , 0.0);
-        int hex = hexamerToInt(cs+bwlimit,true);
-        for (int j = bwlimit; j < seqlen - 6; j++) {
-          efflen += tc.bias5[hex] / dbias5[hex];
-          if (j < seqlen-6) {
-            hex = update_hexamer(hex,*(cs+j+6),true);
-          }
-        }
-      }
-      
-      
-      if (!opt.strand_specific) {
-        efflen *= 0.5*biasAlphaNorm/biasDataNorm;
+
+      if (efflen > means[i]) {
+        biaslens[i] = efflen;
       } else {
-        efflen *= biasAlphaNorm/biasDataNorm;
+        biaslens[i] = eff_lens[i]; // just for unexpressed sequences
       }
     }
-
-
-    if (efflen > means[i]) {
-      //efflen *= ((seqlen-mean) / ((double) (seqlen-mean-6));
-      biaslens[i] = efflen;
-    } else {
-      biaslens[i] = eff_lens[i]; // just for unexpressed sequences
-    }
-    //std::cout << index.target_names_[i] << "\t" << eff_lens[i] << "\t" << biaslens[i] << "\t" << efflen << "\n";
-  }
-
-
+  });
 
   return biaslens;
 }
 
 WeightMap calc_weights(
   const std::vector<int>& counts,
-  const EcMap& ecmap,
+  const EcTable& ecmap,
   const std::vector<double>& eff_lens)
 {
 
@@ -4,6 +4,7 @@
 #include "KmerIndex.h"
 #include "MinCollector.h"
 #include <cmath>
+#include <cstdint>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -26,16 +27,35 @@ std::vector<double> calc_eff_lens(const std::vector<int>& lengths, double mean);
 std::vector<double> calc_eff_lens(const std::vector<int>& lengths,
     const std::vector<double>& means);
 
+// Hexamer counts of every target, restricted to the positions that
+// update_eff_lens looks at: the strands used by the library type, truncated at
+// the mean fragment length of the target. Both strands are summed into one
+// sparse histogram per target. They only depend on the sequences and the
+// means, so they are built once per run and reused by every update.
+struct HexamerHistograms {
+  bool empty() const { return offsets.empty(); }
+  void clear();
+
+  std::vector<size_t> offsets; // target -> first entry, num_trans+1 values
+  std::vector<uint16_t> hex;
+  std::vector<uint16_t> count; // counts above 65535 are split over entries
+};
+
+void build_hexamer_histograms(HexamerHistograms& hist,
+    const std::vector<double>& means, const KmerIndex& index,
+    const ProgramOptions& opt);
+
+// hist is built on the first call if it is empty
 std::vector<double> update_eff_lens(const std::vector<double>& means,
     const MinCollector& tc,
     const KmerIndex &index, const std::vector<double>& alpha,
     const std::vector<double>& eff_lens, std::vector<double>& post_bias,
-    const ProgramOptions& opt );
+    HexamerHistograms& hist, const ProgramOptions& opt );
 
 
 WeightMap calc_weights(
   const std::vector<int>& counts,
-  const EcMap& ecmap,
+  const EcTable& ecmap,
   const std::vector<double>& eff_lens);
 
 
@@ -0,0 +1,122 @@
+#include "catch.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "BamReader.h"
+#include "BgzfWriter.h"
+
+static void put32(std::string& s, int32_t x) {
+  s.append((const char*) &x, 4);
+}
+
+// a BAM header with one reference, l_text, n_ref and l_name as given
+static std::string bamHeader(int32_t l_text, int32_t n_ref, int32_t l_name) {
+  std::string s = "BAM\1";
+  put32(s, l_text);
+  s.append(l_text > 0 ? l_text : 0, '@');
+  put32(s, n_ref);
+  put32(s, l_name);
+  s.append(l_name > 0 ? l_name : 0, 'r');
+  put32(s, 1000);
+  return s;
+}
+
+// an unmapped single-end record with the sequence ACGT
+static std::string bamRecord() {
+  std::string rec;
+  put32(rec, -1); // refID
+  put32(rec, -1); // pos
+  rec.push_back(3); // l_read_name
+  rec.push_back(0); // mapq
+  rec.append(2, '\0'); // bin
+  rec.append(2, '\0'); // n_cigar_op
+  rec.push_back(4); // flag 0x4, unmapped
+  rec.push_back(0);
+  put32(rec, 4); // l_seq
+  put32(rec, -1); // next refID
+  put32(rec, -1); // next pos
+  put32(rec, 0); // tlen
+  rec.append("r1\0", 3);
+  rec.push_back(0x12); // AC
+  rec.push_back(0x48); // GT
+  rec.append(4, (char) 30);
+  std::string s;
+  put32(s, rec.size());
+  return s + rec;
+}
+
+static void writeBam(const std::string& fname, const std::string& data) {
+  BgzfWriter w;
+  REQUIRE(w.open(fname, 1));
+  w.write(data);
+  w.close();
+}
+
+// runs f in a child process and returns its exit status, -1 if it was killed
+template<typename F>
+static int exitStatus(F f) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    fclose(stderr);
+    f();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+TEST_CASE("BamReader reads a record", "[bam]")
+{
+  std::string fname = "test_bam.tmp.bam";
+  writeBam(fname, bamHeader(5, 1, 3) + bamRecord());
+  BamReader r;
+  REQUIRE(r.open(fname, 1));
+  BamRead read;
+  REQUIRE(r.next(read));
+  REQUIRE(read.name == "r1");
+  REQUIRE(read.seq == "ACGT");
+  REQUIRE(read.qual == "????");
+  REQUIRE(!r.next(read));
+  remove(fname.c_str());
+}
+
+TEST_CASE("BamReader rejects a corrupt header", "[bam]")
+{
+  std::string fname = "test_bam.tmp.bam";
+  for (auto h : {bamHeader(-5, 1, 3), bamHeader(5, -1, 3), bamHeader(5, 1, -3)}) {
+    writeBam(fname, h);
+    BamReader r;
+    REQUIRE(!r.open(fname, 1));
+  }
+  remove(fname.c_str());
+}
+
+TEST_CASE("BamReader exits cleanly on a corrupt record", "[bam]")
+{
+  std::string fname = "test_bam.tmp.bam";
+  std::string good = bamRecord();
+  std::string negative = good, short_seq = good;
+  int32_t block_size = -100;
+  negative.replace(0, 4, (const char*) &block_size, 4);
+  int32_t l_seq = -8;
+  short_seq.replace(4 + 16, 4, (const char*) &l_seq, 4);
+
+  for (auto rec : {negative, short_seq, good.substr(0, good.size() - 2)}) {
+    writeBam(fname, bamHeader(5, 1, 3) + rec);
+    int status = exitStatus([&]() {
+      BamReader r;
+      BamRead read;
+      if (r.open(fname, 1)) {
+        r.next(read);
+      }
+    });
+    REQUIRE(status == 1);
+  }
+  remove(fname.c_str());
+}
@@ -0,0 +1,44 @@
+#include "catch.hpp"
+
+#include <cstdio>
+#include <random>
+#include <string>
+
+#include "BgzfReader.h"
+#include "BgzfWriter.h"
+
+TEST_CASE("BgzfReader reads back what BgzfWriter wrote", "[bgzf]")
+{
+  std::mt19937 gen(7);
+  std::string data;
+  for (int i = 0; i < 300000; i++) {
+    // compressible, but not too much
+    data.push_back("ACGT"[gen() % 4]);
+  }
+  std::string fname = "test_bgzf.tmp";
+
+  for (int threads : {1, 3}) {
+    BgzfWriter w;
+    REQUIRE(w.open(fname, threads));
+    w.write(data.data(), 1000);
+    w.flush(); // a short block in the middle
+    w.write(data.data() + 1000, data.size() - 1000);
+    w.close();
+
+    BgzfReader r;
+    REQUIRE(r.open(fname, threads));
+    std::string back(data.size(), '\0');
+    // reads that cross block boundaries
+    size_t pos = 0;
+    while (pos < data.size()) {
+      size_t n = std::min<size_t>(1 + gen() % 100000, data.size() - pos);
+      REQUIRE(r.read(&back[pos], n));
+      pos += n;
+    }
+    REQUIRE(back == data);
+    char c;
+    REQUIRE(!r.read(&c, 1));
+    r.close();
+  }
+  remove(fname.c_str());
+}
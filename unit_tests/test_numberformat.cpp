@@ -0,0 +1,39 @@
+#include "catch.hpp"
+
+#include <sstream>
+#include <string>
+
+#include "NumberFormat.h"
+
+static std::string fmt(double x) {
+  char buf[FORMAT_MAX_CHARS];
+  return std::string(buf, format_double(buf, x));
+}
+
+static std::string stream_fmt(double x) {
+  std::ostringstream o;
+  o << x;
+  return o.str();
+}
+
+TEST_CASE("format_double matches ostream", "[number_format]")
+{
+  double vals[] = {0.0, -0.0, 1.0, -1.0, 0.5, 123456.0, 1234567.0, 999999.5,
+    9999995.0, 0.0001, 0.00001, 1e-5, 3.14159265358979, 2.5e-300, 1e300,
+    6.02214076e23, 83.7416, 1562.305, 100000.0};
+  for (double x : vals) {
+    REQUIRE(fmt(x) == stream_fmt(x));
+  }
+  for (int i = -2000; i < 2000; ++i) {
+    REQUIRE(fmt(i / 7.0) == stream_fmt(i / 7.0));
+    REQUIRE(fmt(i * 1234.5678) == stream_fmt(i * 1234.5678));
+  }
+}
+
+TEST_CASE("format_int", "[number_format]")
+{
+  char buf[FORMAT_MAX_CHARS];
+  REQUIRE(std::string(buf, format_int(buf, 0)) == "0");
+  REQUIRE(std::string(buf, format_int(buf, -42)) == "-42");
+  REQUIRE(std::string(buf, format_int(buf, 9223372036854775807LL)) == "9223372036854775807");
+}